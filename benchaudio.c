@@ -0,0 +1,85 @@
+/*
+ * xhisper - Whisper for Linux
+ * Test audio for the benchmarks: 16 kHz mono s16 from files or synthesized
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "benchaudio.h"
+
+#define RATE BENCH_RATE
+
+// Read a WAV file's data chunk, or a whole raw file
+int16_t *load_pcm(const char *path, size_t *out_n) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (!data || fread(data, 1, size, f) != (size_t)size) {
+        perror(path);
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+
+    size_t off = 0, len = size;
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVE", 4) == 0) {
+        for (size_t p = 12; p + 8 <= (size_t)size;) {
+            uint32_t chunk = data[p + 4] | data[p + 5] << 8 | data[p + 6] << 16 | (uint32_t)data[p + 7] << 24;
+            if (memcmp(data + p, "data", 4) == 0) {
+                off = p + 8;
+                len = chunk < size - off ? chunk : size - off;
+                break;
+            }
+            p += 8 + chunk + (chunk & 1);
+        }
+    }
+
+    int16_t *pcm = malloc(len + 2);
+    memcpy(pcm, data + off, len);
+    free(data);
+    *out_n = len / 2;
+    return pcm;
+}
+
+// Background noise with a voiced phrase every 3.5 s, each ending in a
+// fricative, between long pauses
+int16_t *synthetic_pcm(unsigned int seconds, size_t *out_n) {
+    size_t n = (size_t)seconds * RATE;
+    int phrases = seconds > 2 ? (seconds * 2 - 3) / 7 : 0;
+    int16_t *pcm = malloc(n * sizeof(*pcm));
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        double noise = (int)(seed >> 16 & 0xff) - 128;
+        double t = (double)i / RATE;
+        double v = noise;
+
+        int k = t >= 1.5 ? (int)((t - 1.5) / 3.5) : -1;
+        if (k >= 0 && k < phrases) {
+            double start = 1.5 + k * 3.5, voiced = start + 1.2, end = voiced + 0.2;
+            if (t < voiced) {
+                double f0 = 140 + 20 * sin(2 * M_PI * 2 * t);
+                double envelope = sin(M_PI * (t - start) / 1.2);
+                for (int h = 1; h <= 6; h++) v += envelope * 3000 / h * sin(2 * M_PI * f0 * h * t);
+            } else if (t < end) {
+                v += noise * 12;
+            }
+        }
+        pcm[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+    }
+
+    *out_n = n;
+    return pcm;
+}
@@ -0,0 +1,17 @@
+/*
+ * xhisper - Whisper for Linux
+ * Test audio for the benchmarks: 16 kHz mono s16 from files or synthesized
+ */
+
+#ifndef XHISPER_BENCHAUDIO_H
+#define XHISPER_BENCHAUDIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_RATE 16000
+
+int16_t *load_pcm(const char *path, size_t *out_n);
+int16_t *synthetic_pcm(unsigned int seconds, size_t *out_n);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * xhisper - Whisper for Linux
+ * Streaming FLAC encoder for mono 16-bit PCM
+ *
+ * Each block is stored as a constant subframe, a fixed predictor of order
+ * 0-4 with partitioned Rice residuals, or verbatim, whichever is smallest.
+ * That is what the fast libFLAC presets do and is close to their ratio on
+ * speech.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flac.h"
+
+#define FIXED_ORDER_MAX 4
+#define RICE_PARAM_MAX 14      // 15 is the escape code
+#define PARTITION_ORDER_MAX 8
+
+// MSB-first bit writer over the encoder's output buffer
+struct bit_writer {
+    struct flac_encoder *enc;
+    uint64_t acc;
+    int bits;
+};
+
+static int reserve(struct flac_encoder *enc, size_t extra) {
+    if (enc->out_len + extra <= enc->out_cap) return 0;
+
+    size_t cap = enc->out_cap ? enc->out_cap : 65536;
+    while (cap < enc->out_len + extra) cap *= 2;
+    uint8_t *out = realloc(enc->out, cap);
+    if (!out) {
+        enc->failed = 1;
+        return -1;
+    }
+    enc->out = out;
+    enc->out_cap = cap;
+    return 0;
+}
+
+static void put_bits(struct bit_writer *bw, uint32_t value, int n) {
+    if (n < 32) value &= (1u << n) - 1;
+    bw->acc = (bw->acc << n) | value;
+    bw->bits += n;
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->enc->out[bw->enc->out_len++] = bw->acc >> bw->bits;
+    }
+}
+
+// Pad the last byte with zero bits
+static void align(struct bit_writer *bw) {
+    if (bw->bits) put_bits(bw, 0, 8 - bw->bits);
+}
+
+static void put_rice(struct bit_writer *bw, uint32_t u, int k) {
+    uint32_t q = u >> k;
+    while (q >= 32) {
+        put_bits(bw, 0, 32);
+        q -= 32;
+    }
+    put_bits(bw, 1, q + 1);
+    if (k) put_bits(bw, u, k);
+}
+
+static uint8_t crc8(const uint8_t *p, size_t len) {
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *p, size_t len) {
+    uint16_t crc = 0;
+    while (len--) {
+        crc ^= *p++ << 8;
+        for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+    return crc;
+}
+
+static int rate_code(uint32_t rate) {
+    static const uint32_t rates[] = {0, 88200, 176400, 192000, 8000, 16000, 22050,
+                                     24000, 32000, 44100, 48000, 96000};
+    for (int i = 1; i < 12; i++) {
+        if (rates[i] == rate) return i;
+    }
+    return 13; // rate in Hz follows the header
+}
+
+static uint32_t zigzag(int32_t r) {
+    return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+// Residual of the fixed predictor of the given order
+static void fixed_residual(const int16_t *x, size_t n, int order, int32_t *res) {
+    for (size_t i = order; i < n; i++) {
+        switch (order) {
+            case 0: res[i] = x[i]; break;
+            case 1: res[i] = x[i] - x[i - 1]; break;
+            case 2: res[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+            case 3: res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+            default: res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+    }
+}
+
+// Smallest Rice coding of count values summing to sum: returns the bit
+// count and stores the parameter
+static uint64_t rice_cost(const uint32_t *u, size_t count, uint64_t sum, int *param) {
+    int k = 0;
+    while (k < RICE_PARAM_MAX && ((uint64_t)count << (k + 1)) < sum) k++;
+
+    uint64_t best = UINT64_MAX;
+    for (int cand = k > 0 ? k - 1 : 0; cand <= k + 1 && cand <= RICE_PARAM_MAX; cand++) {
+        uint64_t bits = (uint64_t)count * (cand + 1);
+        for (size_t i = 0; i < count; i++) bits += u[i] >> cand;
+        if (bits < best) {
+            best = bits;
+            *param = cand;
+        }
+    }
+    return best;
+}
+
+// Pick the partition order for a residual; returns the residual section
+// size in bits and fills params[] (1 << order entries)
+static uint64_t plan_partitions(const uint32_t *u, size_t n, int order,
+                                int *partition_order, int *params) {
+    uint64_t best = UINT64_MAX;
+    int tmp[1 << PARTITION_ORDER_MAX];
+
+    for (int p = 0; p <= PARTITION_ORDER_MAX; p++) {
+        size_t part = n >> p;
+        if ((part << p) != n || part <= (size_t)order) break;
+
+        uint64_t bits = 2 + 4 + (4u << p);
+        for (int i = 0; i < (1 << p); i++) {
+            size_t from = i ? i * part : (size_t)order;
+            size_t to = (i + 1) * part;
+            uint64_t sum = 0;
+            for (size_t j = from; j < to; j++) sum += u[j];
+            bits += rice_cost(u + from, to - from, sum, &tmp[i]);
+        }
+        if (bits < best) {
+            best = bits;
+            *partition_order = p;
+            memcpy(params, tmp, sizeof(int) << p);
+        }
+    }
+    return best;
+}
+
+static void put_utf8(struct bit_writer *bw, uint32_t v) {
+    if (v < 0x80) {
+        put_bits(bw, v, 8);
+        return;
+    }
+    int extra = v < 0x800 ? 1 : v < 0x10000 ? 2 : v < 0x200000 ? 3 : v < 0x4000000 ? 4 : 5;
+    put_bits(bw, (0xff00 >> (extra + 1)) | (v >> (6 * extra)), 8);
+    while (extra--) put_bits(bw, 0x80 | ((v >> (6 * extra)) & 0x3f), 8);
+}
+
+static void encode_subframe(struct bit_writer *bw, const int16_t *x, size_t n) {
+    int constant = 1;
+    for (size_t i = 1; i < n && constant; i++) constant = x[i] == x[0];
+    if (constant) {
+        put_bits(bw, 0x00, 8);
+        put_bits(bw, (uint16_t)x[0], 16);
+        return;
+    }
+
+    // Choose the fixed order by the sum of absolute residuals
+    int32_t res[FLAC_BLOCK_SIZE];
+    uint32_t u[FLAC_BLOCK_SIZE];
+    int order = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (int o = 0; o <= FIXED_ORDER_MAX && (size_t)o < n; o++) {
+        fixed_residual(x, n, o, res);
+        uint64_t sum = 0;
+        for (size_t i = o; i < n; i++) sum += zigzag(res[i]);
+        if (sum < best_sum) {
+            best_sum = sum;
+            order = o;
+        }
+    }
+
+    fixed_residual(x, n, order, res);
+    for (size_t i = order; i < n; i++) u[i] = zigzag(res[i]);
+
+    int partition_order = 0;
+    int params[1 << PARTITION_ORDER_MAX];
+    uint64_t bits = UINT64_MAX;
+    if (n > (size_t)order) bits = 16 * order + plan_partitions(u, n, order, &partition_order, params);
+
+    if (bits >= 16 * n) {
+        put_bits(bw, 0x02, 8); // verbatim
+        for (size_t i = 0; i < n; i++) put_bits(bw, (uint16_t)x[i], 16);
+        return;
+    }
+
+    put_bits(bw, (0x08 | order) << 1, 8);
+    for (int i = 0; i < order; i++) put_bits(bw, (uint16_t)x[i], 16);
+
+    put_bits(bw, 0, 2); // 4-bit Rice parameters
+    put_bits(bw, partition_order, 4);
+    size_t part = n >> partition_order;
+    for (int p = 0; p < (1 << partition_order); p++) {
+        size_t from = p ? p * part : (size_t)order;
+        put_bits(bw, params[p], 4);
+        for (size_t i = from; i < (p + 1) * part; i++) put_rice(bw, u[i], params[p]);
+    }
+}
+
+static void encode_frame(struct flac_encoder *enc, const int16_t *x, size_t n) {
+    // Verbatim samples plus headers bound the frame size
+    if (reserve(enc, 2 * n + 64) < 0) return;
+
+    size_t start = enc->out_len;
+    struct bit_writer bw = {.enc = enc};
+    int rc = rate_code(enc->rate);
+
+    put_bits(&bw, 0xfff8, 16); // sync, fixed block size
+    put_bits(&bw, n == FLAC_BLOCK_SIZE ? 12 : 7, 4);
+    put_bits(&bw, rc, 4);
+    put_bits(&bw, 0x08, 8);    // mono, 16 bits per sample
+    put_utf8(&bw, enc->frame_number);
+    if (n != FLAC_BLOCK_SIZE) put_bits(&bw, n - 1, 16);
+    if (rc == 13) put_bits(&bw, enc->rate, 16);
+    put_bits(&bw, crc8(enc->out + start, enc->out_len - start), 8);
+
+    encode_subframe(&bw, x, n);
+    align(&bw);
+    put_bits(&bw, crc16(enc->out + start, enc->out_len - start), 16);
+
+    uint32_t size = enc->out_len - start;
+    if (!enc->min_frame || size < enc->min_frame) enc->min_frame = size;
+    if (size > enc->max_frame) enc->max_frame = size;
+    enc->frame_number++;
+    enc->total_samples += n;
+}
+
+// STREAMINFO with whatever is known so far; zero means unknown
+static void write_streaminfo(struct flac_encoder *enc) {
+    size_t len = enc->out_len;
+    struct bit_writer bw = {.enc = enc};
+
+    enc->out_len = 0;
+    put_bits(&bw, 0x664c6143, 32); // "fLaC"
+    put_bits(&bw, 0x80, 8);        // last metadata block, STREAMINFO
+    put_bits(&bw, 34, 24);
+    put_bits(&bw, FLAC_BLOCK_SIZE, 16);
+    put_bits(&bw, FLAC_BLOCK_SIZE, 16);
+    put_bits(&bw, enc->min_frame, 24);
+    put_bits(&bw, enc->max_frame, 24);
+    put_bits(&bw, enc->rate, 20);
+    put_bits(&bw, 0, 3);  // one channel
+    put_bits(&bw, 15, 5); // 16 bits per sample
+    put_bits(&bw, enc->total_samples >> 32, 4);
+    put_bits(&bw, enc->total_samples, 32);
+    for (int i = 0; i < 4; i++) put_bits(&bw, 0, 32); // no MD5
+
+    if (len > enc->out_len) enc->out_len = len;
+}
+
+int flac_init(struct flac_encoder *enc, uint32_t rate) {
+    uint8_t *out = enc->out;
+    size_t cap = enc->out_cap;
+
+    // Keep the buffer of a previous stream
+    memset(enc, 0, sizeof(*enc));
+    enc->out = out;
+    enc->out_cap = cap;
+    enc->rate = rate;
+    if (reserve(enc, FLAC_STREAMINFO_END) < 0) return -1;
+    write_streaminfo(enc);
+    return 0;
+}
+
+int flac_encode(struct flac_encoder *enc, const int16_t *pcm, size_t n) {
+    while (n > 0 && !enc->failed) {
+        size_t take = FLAC_BLOCK_SIZE - enc->block_len;
+        if (take > n) take = n;
+        memcpy(enc->block + enc->block_len, pcm, take * sizeof(*pcm));
+        enc->block_len += take;
+        pcm += take;
+        n -= take;
+
+        if (enc->block_len == FLAC_BLOCK_SIZE) {
+            encode_frame(enc, enc->block, FLAC_BLOCK_SIZE);
+            enc->block_len = 0;
+        }
+    }
+    return enc->failed ? -1 : 0;
+}
+
+// Encode the partial last block and fill in the stream length
+int flac_finish(struct flac_encoder *enc) {
+    if (enc->block_len && !enc->failed) {
+        encode_frame(enc, enc->block, enc->block_len);
+        enc->block_len = 0;
+    }
+    if (!enc->failed) write_streaminfo(enc);
+    return enc->failed ? -1 : 0;
+}
+
+void flac_free(struct flac_encoder *enc) {
+    free(enc->out);
+    enc->out = NULL;
+    enc->out_len = enc->out_cap = 0;
+}
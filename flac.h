@@ -0,0 +1,38 @@
+/*
+ * xhisper - Whisper for Linux
+ * Streaming FLAC encoder for mono 16-bit PCM
+ */
+
+#ifndef XHISPER_FLAC_H
+#define XHISPER_FLAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAC_BLOCK_SIZE 4096
+#define FLAC_STREAMINFO_END 42 // "fLaC", block header, STREAMINFO
+
+// Samples are buffered until a block is full, then encoded as one frame
+// and appended to out. out is a complete FLAC stream after flac_finish;
+// before that it holds the header (with unknown length) and every frame
+// encoded so far, so it can be sent while recording continues.
+struct flac_encoder {
+    uint32_t rate;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    int16_t block[FLAC_BLOCK_SIZE];
+    size_t block_len;
+    uint32_t frame_number;
+    uint64_t total_samples;
+    uint32_t min_frame;
+    uint32_t max_frame;
+    int failed; // out of memory, out is incomplete
+};
+
+int flac_init(struct flac_encoder *enc, uint32_t rate);
+int flac_encode(struct flac_encoder *enc, const int16_t *pcm, size_t n);
+int flac_finish(struct flac_encoder *enc);
+void flac_free(struct flac_encoder *enc);
+
+#endif
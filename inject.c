@@ -0,0 +1,286 @@
+/*
+ * xhisper - Whisper for Linux
+ * Key event backends: the uinput keyboard, a recording sink, an evdev reader
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "inject.h"
+#include "keymap.h"
+
+#define UINPUT_READY_TIMEOUT_MS 500
+
+// Wait until udev has created the /dev/input node for the new device, which
+// is when compositors get to open it. Kernels without UI_GET_SYSNAME fall
+// back to a fixed pause.
+static void wait_uinput_node(int fd) {
+    char sysname[64];
+    if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+        usleep(100000);
+        return;
+    }
+
+    char dir[128];
+    snprintf(dir, sizeof(dir), "/sys/devices/virtual/input/%s", sysname);
+
+    for (int waited_ms = 0; waited_ms < UINPUT_READY_TIMEOUT_MS; waited_ms++) {
+        DIR *d = opendir(dir);
+        struct dirent *entry;
+        while (d && (entry = readdir(d))) {
+            if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+            char node[300];
+            snprintf(node, sizeof(node), "/dev/input/%s", entry->d_name);
+            if (access(node, F_OK) == 0) {
+                closedir(d);
+                return;
+            }
+        }
+        if (d) closedir(d);
+        usleep(1000);
+    }
+
+    fprintf(stderr, "xhispertoold: input device node did not appear, continuing\n");
+}
+
+static int uinput_open(const char *arg) {
+    (void)arg;
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("failed to open /dev/uinput");
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+
+    // Register letters
+    for (int i = KEY_Q; i <= KEY_P; i++) ioctl(fd, UI_SET_KEYBIT, i);
+    for (int i = KEY_A; i <= KEY_L; i++) ioctl(fd, UI_SET_KEYBIT, i);
+    for (int i = KEY_Z; i <= KEY_M; i++) ioctl(fd, UI_SET_KEYBIT, i);
+
+    // Register numbers
+    for (int i = KEY_1; i <= KEY_0; i++) ioctl(fd, UI_SET_KEYBIT, i);
+
+    // Register special keys
+    ioctl(fd, UI_SET_KEYBIT, KEY_SPACE);
+    ioctl(fd, UI_SET_KEYBIT, KEY_MINUS);
+    ioctl(fd, UI_SET_KEYBIT, KEY_EQUAL);
+    ioctl(fd, UI_SET_KEYBIT, KEY_LEFTBRACE);
+    ioctl(fd, UI_SET_KEYBIT, KEY_RIGHTBRACE);
+    ioctl(fd, UI_SET_KEYBIT, KEY_SEMICOLON);
+    ioctl(fd, UI_SET_KEYBIT, KEY_APOSTROPHE);
+    ioctl(fd, UI_SET_KEYBIT, KEY_GRAVE);
+    ioctl(fd, UI_SET_KEYBIT, KEY_BACKSLASH);
+    ioctl(fd, UI_SET_KEYBIT, KEY_COMMA);
+    ioctl(fd, UI_SET_KEYBIT, KEY_DOT);
+    ioctl(fd, UI_SET_KEYBIT, KEY_SLASH);
+    ioctl(fd, UI_SET_KEYBIT, KEY_102ND);
+    ioctl(fd, UI_SET_KEYBIT, KEY_TAB);
+    ioctl(fd, UI_SET_KEYBIT, KEY_ENTER);
+    ioctl(fd, UI_SET_KEYBIT, KEY_BACKSPACE);
+
+    // Register modifiers
+    ioctl(fd, UI_SET_KEYBIT, KEY_LEFTCTRL);
+    ioctl(fd, UI_SET_KEYBIT, KEY_RIGHTCTRL);
+    ioctl(fd, UI_SET_KEYBIT, KEY_LEFTALT);
+    ioctl(fd, UI_SET_KEYBIT, KEY_RIGHTALT);
+    ioctl(fd, UI_SET_KEYBIT, KEY_LEFTSHIFT);
+    ioctl(fd, UI_SET_KEYBIT, KEY_RIGHTSHIFT);
+    ioctl(fd, UI_SET_KEYBIT, KEY_LEFTMETA);
+
+    struct uinput_setup setup = {0};
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x1234;
+    setup.id.product = 0x5678;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "xhisper");
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0) {
+        perror("failed to setup uinput device");
+        close(fd);
+        return -1;
+    }
+    if (ioctl(fd, UI_DEV_CREATE) < 0) {
+        perror("failed to create uinput device");
+        close(fd);
+        return -1;
+    }
+
+    wait_uinput_node(fd);
+    return fd;
+}
+
+static void uinput_stamp(struct input_event *ev, size_t n) {
+    (void)ev;
+    (void)n;
+}
+
+static void uinput_close(int fd) {
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+const struct inject_backend inject_uinput = {"uinput", uinput_open, uinput_stamp, uinput_close};
+
+static int record_open(const char *arg) {
+    int fd;
+    if (strncmp(arg, "fd:", 3) == 0) {
+        char *end;
+        fd = strtol(arg + 3, &end, 10);
+        if (*end || fd < 0 || fcntl(fd, F_GETFD) < 0) {
+            fprintf(stderr, "invalid event sink fd '%s'\n", arg + 3);
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "failed to open event sink %s: %s\n", arg, strerror(errno));
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void record_stamp(struct input_event *ev, size_t n) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    for (size_t i = 0; i < n; i++) {
+        ev[i].input_event_sec = ts.tv_sec;
+        ev[i].input_event_usec = ts.tv_nsec / 1000;
+    }
+}
+
+static void record_close(int fd) {
+    close(fd);
+}
+
+const struct inject_backend inject_record = {"record", record_open, record_stamp, record_close};
+
+// "uinput" or "record:<file|fd:n>"; arg is what follows the colon
+const struct inject_backend *inject_parse(const char *spec, const char **arg) {
+    if (strcmp(spec, "uinput") == 0) {
+        *arg = "";
+        return &inject_uinput;
+    }
+    if (strncmp(spec, "record:", 7) == 0 && spec[7]) {
+        *arg = spec + 7;
+        return &inject_record;
+    }
+    return NULL;
+}
+
+// Open the input device called name for reading, with CLOCK_MONOTONIC
+// timestamps, and grab it so its keys reach no application while read
+int evdev_open(const char *name) {
+    DIR *d = opendir("/dev/input");
+    if (!d) return -1;
+
+    struct dirent *entry;
+    int found = -1;
+    while (found < 0 && (entry = readdir(d))) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+        char node[300], dev_name[256] = {0};
+        snprintf(node, sizeof(node), "/dev/input/%s", entry->d_name);
+        int fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (ioctl(fd, EVIOCGNAME(sizeof(dev_name) - 1), dev_name) >= 0 && strcmp(dev_name, name) == 0) {
+            found = fd;
+        } else {
+            close(fd);
+        }
+    }
+    closedir(d);
+    if (found < 0) return -1;
+
+    int clock = CLOCK_MONOTONIC;
+    ioctl(found, EVIOCSCLOCKID, &clock);
+    if (ioctl(found, EVIOCGRAB, 1) < 0) perror("failed to grab input device");
+    return found;
+}
+
+// Replay key events as a text field would see them on layout km: keys
+// type with shift and AltGr as held, a dead key changes the key after it,
+// backspace erases the last character. Ctrl+Shift+U starts a hex code
+// point that space or enter commits, as IBus and GTK do. Returns the
+// length of the UTF-8 text; out is NUL-terminated and cut at cap - 1.
+size_t decode_events(const struct keymap *km, const struct input_event *ev, size_t n, char *out,
+                     size_t cap) {
+    struct keystroke dead = {0, 0};
+    uint8_t mods = 0;
+    int hex = 0; // in a Ctrl+Shift+U sequence
+    uint32_t hex_cp = 0;
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ev[i].type != EV_KEY) continue;
+        uint16_t code = ev[i].code;
+        uint8_t mod = 0;
+        if (code == KEY_LEFTSHIFT || code == KEY_RIGHTSHIFT) mod = MOD_SHIFT;
+        if (code == KEY_RIGHTALT) mod = MOD_ALTGR;
+        if (code == KEY_LEFTCTRL || code == KEY_RIGHTCTRL) mod = MOD_CTRL;
+
+        uint32_t cp = 0;
+        if (mod) {
+            mods = ev[i].value ? mods | mod : mods & ~mod;
+            continue;
+        } else if (ev[i].value != 1) {
+            continue;
+        } else if (hex) {
+            uint32_t c = keymap_decode(km, (struct keystroke){0, 0}, (struct keystroke){code, mods});
+            if (code == KEY_BACKSPACE) {
+                hex_cp >>= 4;
+                continue;
+            } else if (c >= '0' && c <= '9') {
+                hex_cp = hex_cp << 4 | (c - '0');
+                continue;
+            } else if (c >= 'a' && c <= 'f') {
+                hex_cp = hex_cp << 4 | (c - 'a' + 10);
+                continue;
+            }
+            // Space or enter commits, anything else drops the sequence
+            hex = 0;
+            if (c != ' ' && code != KEY_ENTER) continue;
+            cp = hex_cp;
+        } else if (mods == (MOD_CTRL | MOD_SHIFT)) {
+            hex = keymap_decode(km, (struct keystroke){0, 0}, (struct keystroke){code, MOD_SHIFT}) == 'U';
+            hex_cp = 0;
+            continue;
+        } else if (code == KEY_BACKSPACE) {
+            if (dead.code) {
+                dead = (struct keystroke){0, 0};
+                continue;
+            }
+            while (len && (out[len - 1] & 0xc0) == 0x80) len--;
+            if (len) len--;
+        } else {
+            struct keystroke k = {code, mods};
+            if (!dead.code && keymap_is_dead(km, k)) {
+                dead = k;
+                continue;
+            }
+            cp = keymap_decode(km, dead, k);
+            dead = (struct keystroke){0, 0};
+        }
+
+        char c[4];
+        size_t m = cp && cp <= 0x10ffff ? utf8_put(c, cp) : 0;
+        if (m && len + m < cap) {
+            memcpy(out + len, c, m);
+            len += m;
+        }
+    }
+    if (cap) out[len] = 0;
+    return len;
+}
@@ -0,0 +1,36 @@
+/*
+ * xhisper - Whisper for Linux
+ * Key event backends: the uinput keyboard, a recording sink, an evdev reader
+ */
+
+#ifndef XHISPER_INJECT_H
+#define XHISPER_INJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+struct keymap;
+
+// Where the daemon's key events go. open returns the fd they are written
+// to, already non-blocking; stamp fills in their time just before the
+// write (the kernel stamps uinput events itself).
+struct inject_backend {
+    const char *name;
+    int (*open)(const char *arg);
+    void (*stamp)(struct input_event *ev, size_t n);
+    void (*close)(int fd);
+};
+
+// The uinput virtual keyboard, and a sink that writes timestamped
+// input_events (CLOCK_MONOTONIC) to a file, or to an inherited fd given as
+// fd:<n> such as a pipe or memfd. "record:<file>" selects the sink.
+extern const struct inject_backend inject_uinput;
+extern const struct inject_backend inject_record;
+const struct inject_backend *inject_parse(const char *spec, const char **arg);
+
+int evdev_open(const char *name);
+size_t decode_events(const struct keymap *km, const struct input_event *ev, size_t n, char *out,
+                     size_t cap);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * xhisper - Whisper for Linux
+ * Benchmark for key injection: drives a corpus of transcripts through
+ * xhispertoold with type-string, the way xhisper does, and reports
+ * characters per second, events per character and the latency from
+ * starting the command to its last key event. The events are decoded back
+ * into text and checked against the transcript, and session-set is
+ * checked on the same corpus.
+ *
+ * Usage: injectbench [--profile p] [--rounds n] [--layout l] [--unicode hex]
+ *                    [--clip-cmd cmd] [--evdev] [corpus]
+ *
+ * The daemon next to this binary is started with its events going to a
+ * memfd, so no display or /dev/uinput is needed. With --evdev it uses
+ * uinput instead and its device is read (and grabbed, so nothing is typed
+ * anywhere) through /dev/input. A corpus file has one transcript per line.
+ * With --layout the daemon types for that layout and the events are
+ * decoded with it, dead keys included. With --unicode hex the daemon types
+ * characters without keys as Ctrl+Shift+U sequences and the default corpus
+ * gains non-Latin transcripts.
+ *
+ * The same corpus is also inserted the way xhisper pastes: the clipboard
+ * helper is started with the transcript on stdin (clip-cmd, by default one
+ * that discards it, as no clipboard is needed here), then paste, timed to
+ * its last key event.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "inject.h"
+#include "keymap.h"
+
+#define CORPUS_MAX 256
+#define TEXT_MAX 4096
+#define EVENTS_MAX (16 * TEXT_MAX)
+#define EVDEV_QUIET_MS 50 // no event for this long and the device is drained
+#define DEVICE_WAIT_MS 2000
+
+static const char *const default_corpus[] = {
+    "Okay.",
+    "Let me check the logs first.",
+    "The build fails on the second commit, not the first one.",
+    "Can you send me the PR link when it's ready?",
+    "Use a hash map here; the list lookup is O(n) per call.",
+    "Meeting moved to 3:30 PM (room B-12).",
+    "I think we should ship it behind a flag and measure the p99 latency before turning it on for "
+    "everyone.",
+    "TODO: rename handle_request() to dispatch_request() and update the callers in server.c.",
+    "Electric Clojure keeps the client and server in one program, which is why the LLM prompt "
+    "mentions it.",
+    "She said \"no\", so the answer is no - at least until Friday.",
+    "ls -la ~/src | grep -v node_modules",
+    "Thanks! That fixed it.",
+    "Der Bericht über die Größe ist fertig, à bientôt, señor.",
+};
+
+// Added to the default corpus with --unicode hex
+static const char *const unicode_corpus[] = {
+    "Привет, как дела? Встреча перенесена на пятницу.",
+    "这个函数的返回值需要检查。",
+    "Η ταχύτητα είναι περίπου 3·10⁸ m/s.",
+    "“Ship it” — then measure → compare ≤ 5 ms.",
+    "Спасибо! Всё работает.",
+};
+
+static const char *corpus[CORPUS_MAX];
+static size_t corpus_len = 0;
+static char dir[4096];        // where xhispertool and xhispertoold are
+static int fd_events = -1;    // memfd sink, or the evdev device
+static int evdev = 0;
+static off_t events_read = 0; // memfd: bytes already consumed
+static const struct keymap *layout;
+static int unicode_hex = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t event_ns(const struct input_event *ev) {
+    return (uint64_t)ev->input_event_sec * 1000000000ull + (uint64_t)ev->input_event_usec * 1000;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// pct-th percentile of n sorted values
+double percentile(const double *sorted, size_t n, int pct) {
+    return sorted[(n - 1) * pct / 100];
+}
+
+int load_corpus(const char *path) {
+    if (!path) {
+        corpus_len = sizeof(default_corpus) / sizeof(default_corpus[0]);
+        memcpy(corpus, default_corpus, sizeof(default_corpus));
+        if (unicode_hex) {
+            memcpy(corpus + corpus_len, unicode_corpus, sizeof(unicode_corpus));
+            corpus_len += sizeof(unicode_corpus) / sizeof(unicode_corpus[0]);
+        }
+        return 0;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[TEXT_MAX];
+    while (corpus_len < CORPUS_MAX && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0]) corpus[corpus_len++] = strdup(line);
+    }
+    fclose(f);
+    return corpus_len ? 0 : -1;
+}
+
+// Run the client with args and wait for it; its exit status, or -1
+int run_client(char *const *args) {
+    char path[4200];
+    snprintf(path, sizeof(path), "%sxhispertool", dir);
+    char *argv[8] = {path};
+    for (size_t i = 0; args[i] && i < 6; i++) argv[i + 1] = args[i];
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, NULL, NULL, argv, environ);
+    if (err) {
+        fprintf(stderr, "failed to start %s: %s\n", path, strerror(err));
+        return -1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+// Start the daemon with its events going to the sink and wait until it is
+// ready. The socket lives in a private runtime dir.
+pid_t start_daemon(const char *profile) {
+    char runtime[] = "/tmp/injectbench.XXXXXX";
+    if (!mkdtemp(runtime)) {
+        perror("failed to create runtime dir");
+        return -1;
+    }
+    setenv("XDG_RUNTIME_DIR", runtime, 1);
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%sxhispertoold", dir);
+    char *argv[] = {path, "--ready-fd", "4", "--profile", (char *)profile, "--inject",
+                    evdev ? "uinput" : "record:fd:3", "--layout", (char *)layout->name,
+                    "--unicode", unicode_hex ? "hex" : "paste", NULL};
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (!evdev) posix_spawn_file_actions_adddup2(&actions, fd_events, 3);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 4);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err) {
+        fprintf(stderr, "failed to start %s: %s\n", path, strerror(err));
+        close(fds[0]);
+        return -1;
+    }
+
+    char ready[16] = {0};
+    ssize_t n = read(fds[0], ready, sizeof(ready) - 1);
+    close(fds[0]);
+    if (n <= 0 || strncmp(ready, "READY=1", 7) != 0) {
+        fprintf(stderr, "%s did not start%s\n", path, evdev ? " (--evdev needs /dev/uinput)" : "");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        rmdir(runtime);
+        return -1;
+    }
+    return pid;
+}
+
+// Read the events injected since the last call
+size_t read_events(struct input_event *ev, size_t cap) {
+    size_t n = 0;
+
+    if (!evdev) {
+        ssize_t got;
+        while (n < cap && (got = pread(fd_events, (char *)(ev + n), (cap - n) * sizeof(*ev),
+                                       events_read)) > 0) {
+            events_read += got;
+            n += got / sizeof(*ev);
+        }
+        return n;
+    }
+
+    // The client returned once the events were written to uinput; evdev
+    // has them a moment later
+    struct pollfd pfd = {.fd = fd_events, .events = POLLIN};
+    while (n < cap && poll(&pfd, 1, EVDEV_QUIET_MS) > 0) {
+        ssize_t got = read(fd_events, ev + n, (cap - n) * sizeof(*ev));
+        if (got <= 0) break;
+        n += got / sizeof(*ev);
+    }
+    return n;
+}
+
+// Text as the daemon types it: characters without keys are dropped,
+// unless hex entry types the printable ones. Returns the number of
+// characters.
+size_t typeable(const char *s, char *out) {
+    size_t len = 0, chars = 0, n = strlen(s);
+    for (size_t i = 0; i < n;) {
+        size_t start = i;
+        uint32_t cp = utf8_next(s, n, &i);
+        int printable = cp >= 0x20 && cp != 0x7f && !(cp >= 0x80 && cp < 0xa0) &&
+                        !(cp >= 0xd800 && cp < 0xe000) && cp != 0xfffd && cp <= 0x10ffff;
+        if (keymap_lookup(layout, cp) || (unicode_hex && printable)) {
+            memcpy(out + len, s + start, i - start);
+            len += i - start;
+            chars++;
+        }
+    }
+    out[len] = 0;
+    return chars;
+}
+
+// Type the corpus rounds times. Prints the numbers and returns -1 if a
+// command failed or its decoded events differ from the text.
+int bench_typing(const char *profile, int rounds) {
+    static struct input_event ev[EVENTS_MAX];
+    size_t commands = corpus_len * rounds;
+    double *latency_ms = calloc(commands, sizeof(double));
+    size_t chars = 0, events = 0, mismatches = 0;
+    double typing_s = 0, command_s = 0;
+
+    for (size_t i = 0; i < commands; i++) {
+        const char *text = corpus[i % corpus_len];
+        char *args[] = {"--wait", "type-string", (char *)text, NULL};
+        uint64_t start = now_ns();
+        if (run_client(args) != 0) {
+            fprintf(stderr, "type-string failed\n");
+            free(latency_ms);
+            return -1;
+        }
+
+        size_t n = read_events(ev, EVENTS_MAX);
+        char expected[TEXT_MAX], decoded[TEXT_MAX];
+        size_t len = typeable(text, expected);
+        decode_events(layout, ev, n, decoded, sizeof(decoded));
+        if (!n || strcmp(decoded, expected) != 0) {
+            if (mismatches++ == 0) printf("MISMATCH: \"%s\" came out as \"%s\"\n", expected, decoded);
+            latency_ms[i] = 0;
+            continue;
+        }
+
+        latency_ms[i] = (event_ns(&ev[n - 1]) - start) / 1e6;
+        typing_s += (event_ns(&ev[n - 1]) - event_ns(&ev[0])) / 1e9;
+        command_s += latency_ms[i] / 1e3;
+        chars += len;
+        events += n;
+    }
+
+    qsort(latency_ms, commands, sizeof(double), compare_double);
+    printf("%s profile, %zu commands: %.0f chars/s (%.0f from the command), %.2f events/char, "
+           "command to last event p50 %.1f ms, p99 %.1f ms\n",
+           profile, commands, typing_s > 0 ? chars / typing_s : 0, command_s > 0 ? chars / command_s : 0,
+           chars ? (double)events / chars : 0, percentile(latency_ms, commands, 50),
+           percentile(latency_ms, commands, 99));
+    if (mismatches) printf("typing: %zu of %zu transcripts FAILED\n", mismatches, commands);
+    else printf("typing: %zu transcripts decoded ok\n", commands);
+    free(latency_ms);
+    return mismatches ? -1 : 0;
+}
+
+// Insert the corpus rounds times through the clipboard: clip_cmd gets the
+// whole transcript on stdin, then paste. Prints the numbers and returns -1
+// if a command failed.
+int bench_clipboard(const char *clip_cmd, int rounds) {
+    static struct input_event ev[EVENTS_MAX];
+    size_t commands = corpus_len * rounds;
+    double *latency_ms = calloc(commands, sizeof(double));
+    size_t chars = 0;
+    double command_s = 0;
+
+    for (size_t i = 0; i < commands; i++) {
+        const char *text = corpus[i % corpus_len];
+        char *args[] = {"--wait", "paste", NULL};
+        uint64_t start = now_ns();
+        FILE *clip = popen(clip_cmd, "w");
+        if (!clip) {
+            perror(clip_cmd);
+            free(latency_ms);
+            return -1;
+        }
+        fputs(text, clip);
+        if (pclose(clip) != 0 || run_client(args) != 0) {
+            fprintf(stderr, "clipboard paste failed\n");
+            free(latency_ms);
+            return -1;
+        }
+
+        size_t n = read_events(ev, EVENTS_MAX);
+        if (!n) {
+            fprintf(stderr, "paste typed no keys\n");
+            free(latency_ms);
+            return -1;
+        }
+        latency_ms[i] = (event_ns(&ev[n - 1]) - start) / 1e6;
+        command_s += latency_ms[i] / 1e3;
+        for (size_t k = 0, len = strlen(text); k < len; chars++) utf8_next(text, len, &k);
+    }
+
+    qsort(latency_ms, commands, sizeof(double), compare_double);
+    printf("clipboard, %zu commands: %.0f chars/s from the command, "
+           "command to last event p50 %.1f ms, p99 %.1f ms\n",
+           commands, command_s > 0 ? chars / command_s : 0, percentile(latency_ms, commands, 50),
+           percentile(latency_ms, commands, 99));
+    free(latency_ms);
+    return 0;
+}
+
+// Each transcript replaces a placeholder as session text; what the field
+// ends up holding must be the transcript
+int check_sessions() {
+    static struct input_event ev[EVENTS_MAX];
+    size_t failed = 0;
+
+    for (size_t i = 0; i < corpus_len; i++) {
+        char *end[] = {"--wait", "session-end", NULL};
+        char *placeholder[] = {"--wait", "session-set", "(transcribing...)", NULL};
+        char *text[] = {"--wait", "session-set", (char *)corpus[i], NULL};
+        if (run_client(end) != 0 || run_client(placeholder) != 0 || run_client(text) != 0) {
+            fprintf(stderr, "session-set failed\n");
+            return -1;
+        }
+
+        size_t n = read_events(ev, EVENTS_MAX);
+        char expected[TEXT_MAX], decoded[TEXT_MAX];
+        typeable(corpus[i], expected);
+        decode_events(layout, ev, n, decoded, sizeof(decoded));
+        if (strcmp(decoded, expected) != 0) {
+            if (failed++ == 0) printf("MISMATCH: session text \"%s\" came out as \"%s\"\n", expected, decoded);
+        }
+    }
+
+    if (failed) printf("session-set: %zu of %zu FAILED\n", failed, corpus_len);
+    else printf("session-set: %zu transcripts decoded ok\n", corpus_len);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *profile = "fast", *file = NULL, *layout_name = "us";
+    const char *clip_cmd = "cat > /dev/null";
+    int rounds = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            layout_name = argv[++i];
+        } else if (strcmp(argv[i], "--unicode") == 0 && i + 1 < argc) {
+            unicode_hex = strcmp(argv[++i], "hex") == 0;
+        } else if (strcmp(argv[i], "--clip-cmd") == 0 && i + 1 < argc) {
+            clip_cmd = argv[++i];
+        } else if (strcmp(argv[i], "--evdev") == 0) {
+            evdev = 1;
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            fprintf(stderr, "Usage: injectbench [--profile p] [--rounds n] [--layout l] [--unicode hex]\n"
+                            "                   [--clip-cmd cmd] [--evdev] [corpus]\n");
+            return 1;
+        }
+    }
+    if (!(layout = keymap_find(layout_name))) {
+        fprintf(stderr, "unknown layout '%s'\n", layout_name);
+        return 1;
+    }
+    if (rounds < 1) rounds = 1;
+    if (load_corpus(file) < 0) return 1;
+
+    const char *slash = strrchr(argv[0], '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+
+    if (!evdev) {
+        fd_events = memfd_create("xhisper-events", 0);
+        if (fd_events < 0) {
+            perror("failed to create event sink");
+            return 1;
+        }
+    }
+
+    pid_t daemon = start_daemon(profile);
+    if (daemon < 0) return 1;
+
+    int ret = 0;
+    if (evdev) {
+        for (int waited = 0; (fd_events = evdev_open("xhisper")) < 0 && waited < DEVICE_WAIT_MS; waited += 10) {
+            usleep(10000);
+        }
+        if (fd_events < 0) {
+            fprintf(stderr, "xhisper input device not found in /dev/input\n");
+            ret = 1;
+        }
+    }
+
+    if (!ret) {
+        printf("%s, %s layout%s, %zu transcripts\n", evdev ? "uinput read back through evdev" : "memfd event sink",
+               layout->name, unicode_hex ? " with hex entry" : "", corpus_len);
+        ret = bench_typing(profile, rounds) < 0;
+        if (bench_clipboard(clip_cmd, rounds) < 0) ret = 1;
+        if (check_sessions() < 0) ret = 1;
+    }
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    char socket[4200];
+    snprintf(socket, sizeof(socket), "%s/.xhisper_socket", getenv("XDG_RUNTIME_DIR"));
+    unlink(socket);
+    rmdir(getenv("XDG_RUNTIME_DIR"));
+    return ret;
+}
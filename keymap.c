@@ -0,0 +1,124 @@
+/*
+ * xhisper - Whisper for Linux
+ * Keyboard layouts: which keys type a character, generated from keymaps.txt
+ */
+
+#include <string.h>
+#include <linux/input.h>
+
+#include "keymap.h"
+#include "keymap_tables.h"
+
+// NULL for an unknown layout name
+const struct keymap *keymap_find(const char *name) {
+    for (size_t i = 0; i < keymap_count; i++) {
+        if (strcmp(name, keymaps[i].name) == 0) return &keymaps[i];
+    }
+    return NULL;
+}
+
+// How to type cp on this layout, NULL when no key does
+const struct keymap_entry *keymap_lookup(const struct keymap *km, uint32_t cp) {
+    if (cp < KEYMAP_DIRECT) return km->direct[cp].key.code ? &km->direct[cp] : NULL;
+
+    size_t lo = 0, hi = km->extra_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (km->extra[mid].cp == cp) return &km->extra[mid].entry;
+        if (km->extra[mid].cp < cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static int same_stroke(struct keystroke a, struct keystroke b) {
+    return a.code == b.code && a.mods == b.mods;
+}
+
+int keymap_is_dead(const struct keymap *km, struct keystroke k) {
+    for (size_t i = 0; i < km->dead_count; i++) {
+        if (same_stroke(km->dead[i], k)) return 1;
+    }
+    return 0;
+}
+
+// The character key types after dead (code 0 for none), 0 if the layout
+// doesn't produce one. A reverse search, for checking injected events.
+uint32_t keymap_decode(const struct keymap *km, struct keystroke dead, struct keystroke key) {
+    for (uint32_t cp = 0; cp < KEYMAP_DIRECT; cp++) {
+        const struct keymap_entry *e = &km->direct[cp];
+        if (e->key.code && same_stroke(e->dead, dead) && same_stroke(e->key, key)) return cp;
+    }
+    for (size_t i = 0; i < km->extra_count; i++) {
+        const struct keymap_entry *e = &km->extra[i].entry;
+        if (same_stroke(e->dead, dead) && same_stroke(e->key, key)) return km->extra[i].cp;
+    }
+    return 0;
+}
+
+// Decode the code point at s[*i] and step past it. Malformed bytes come
+// out one at a time as U+FFFD.
+uint32_t utf8_next(const char *s, size_t len, size_t *i) {
+    const unsigned char *p = (const unsigned char *)s + *i;
+    size_t left = len - *i;
+    uint32_t cp;
+    size_t n;
+
+    if (p[0] < 0x80) {
+        cp = p[0];
+        n = 1;
+    } else if ((p[0] & 0xe0) == 0xc0) {
+        cp = p[0] & 0x1f;
+        n = 2;
+    } else if ((p[0] & 0xf0) == 0xe0) {
+        cp = p[0] & 0x0f;
+        n = 3;
+    } else if ((p[0] & 0xf8) == 0xf0) {
+        cp = p[0] & 0x07;
+        n = 4;
+    } else {
+        (*i)++;
+        return 0xfffd;
+    }
+
+    if (n > left) {
+        (*i)++;
+        return 0xfffd;
+    }
+    for (size_t k = 1; k < n; k++) {
+        if ((p[k] & 0xc0) != 0x80) {
+            (*i)++;
+            return 0xfffd;
+        }
+        cp = cp << 6 | (p[k] & 0x3f);
+    }
+    *i += n;
+    return cp;
+}
+
+// Encode cp into out, which has room for 4 bytes; returns the length
+size_t utf8_put(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
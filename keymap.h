@@ -0,0 +1,58 @@
+/*
+ * xhisper - Whisper for Linux
+ * Keyboard layouts: which keys type a character, generated from keymaps.txt
+ */
+
+#ifndef XHISPER_KEYMAP_H
+#define XHISPER_KEYMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Modifiers a key is pressed with: KEY_LEFTSHIFT, KEY_RIGHTALT (AltGr)
+// and KEY_LEFTCTRL, which layouts don't use but Unicode entry does
+#define MOD_SHIFT 0x01
+#define MOD_ALTGR 0x02
+#define MOD_CTRL 0x04
+
+// Code points below this are looked up directly (Latin-1 and Latin
+// Extended-A); the few above it that a layout types are searched
+#define KEYMAP_DIRECT 0x180
+
+struct keystroke {
+    uint16_t code; // 0 for none
+    uint8_t mods;
+};
+
+// A character is typed as key, after the dead key if it has one
+struct keymap_entry {
+    struct keystroke dead;
+    struct keystroke key;
+};
+
+struct keymap_extra {
+    uint32_t cp;
+    struct keymap_entry entry;
+};
+
+struct keymap {
+    const char *name;
+    const struct keymap_entry *direct; // KEYMAP_DIRECT entries
+    const struct keymap_extra *extra;  // sorted by code point
+    size_t extra_count;
+    const struct keystroke *dead;      // the layout's dead keys
+    size_t dead_count;
+};
+
+extern const struct keymap keymaps[];
+extern const size_t keymap_count;
+
+const struct keymap *keymap_find(const char *name);
+const struct keymap_entry *keymap_lookup(const struct keymap *km, uint32_t cp);
+int keymap_is_dead(const struct keymap *km, struct keystroke k);
+uint32_t keymap_decode(const struct keymap *km, struct keystroke dead, struct keystroke key);
+
+uint32_t utf8_next(const char *s, size_t len, size_t *i);
+size_t utf8_put(char *out, uint32_t cp);
+
+#endif
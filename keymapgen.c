@@ -0,0 +1,339 @@
+/*
+ * xhisper - Whisper for Linux
+ * Build-time generator: compiles the layouts in keymaps.txt into the
+ * lookup tables of keymap_tables.h, one entry per character a layout can
+ * type, with its key, modifiers and dead key.
+ *
+ * Usage: keymapgen keymaps.txt > keymap_tables.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "keymap.h"
+
+#define LAYOUTS_MAX 32
+#define LEVELS 4
+#define ENTRIES_MAX 1024
+#define DEAD 0x80000000u // symbol is dead key number (sym & ~DEAD)
+
+static const struct { const char *name; const char *code; } keys[] = {
+    {"TLDE", "KEY_GRAVE"}, {"AE01", "KEY_1"}, {"AE02", "KEY_2"}, {"AE03", "KEY_3"},
+    {"AE04", "KEY_4"}, {"AE05", "KEY_5"}, {"AE06", "KEY_6"}, {"AE07", "KEY_7"},
+    {"AE08", "KEY_8"}, {"AE09", "KEY_9"}, {"AE10", "KEY_0"}, {"AE11", "KEY_MINUS"},
+    {"AE12", "KEY_EQUAL"},
+    {"AD01", "KEY_Q"}, {"AD02", "KEY_W"}, {"AD03", "KEY_E"}, {"AD04", "KEY_R"},
+    {"AD05", "KEY_T"}, {"AD06", "KEY_Y"}, {"AD07", "KEY_U"}, {"AD08", "KEY_I"},
+    {"AD09", "KEY_O"}, {"AD10", "KEY_P"}, {"AD11", "KEY_LEFTBRACE"}, {"AD12", "KEY_RIGHTBRACE"},
+    {"BKSL", "KEY_BACKSLASH"},
+    {"AC01", "KEY_A"}, {"AC02", "KEY_S"}, {"AC03", "KEY_D"}, {"AC04", "KEY_F"},
+    {"AC05", "KEY_G"}, {"AC06", "KEY_H"}, {"AC07", "KEY_J"}, {"AC08", "KEY_K"},
+    {"AC09", "KEY_L"}, {"AC10", "KEY_SEMICOLON"}, {"AC11", "KEY_APOSTROPHE"},
+    {"LSGT", "KEY_102ND"},
+    {"AB01", "KEY_Z"}, {"AB02", "KEY_X"}, {"AB03", "KEY_C"}, {"AB04", "KEY_V"},
+    {"AB05", "KEY_B"}, {"AB06", "KEY_N"}, {"AB07", "KEY_M"}, {"AB08", "KEY_COMMA"},
+    {"AB09", "KEY_DOT"}, {"AB10", "KEY_SLASH"},
+};
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+
+// What each dead key composes with: base[i] becomes composed[i]; spacing is
+// what it gives before a space, if that's worth typing this way
+static const struct {
+    const char *name;
+    const char *base;
+    const char *composed;
+    uint32_t spacing;
+} dead_keys[] = {
+    {"dead_acute", "aeiouyAEIOUYcnszCNSZ", "áéíóúýÁÉÍÓÚÝćńśźĆŃŚŹ", 0},
+    {"dead_grave", "aeiouAEIOU", "àèìòùÀÈÌÒÙ", '`'},
+    {"dead_circumflex", "aeiouAEIOU", "âêîôûÂÊÎÔÛ", '^'},
+    {"dead_diaeresis", "aeiouyAEIOUY", "äëïöüÿÄËÏÖÜŸ", 0},
+    {"dead_tilde", "anoANO", "ãñõÃÑÕ", '~'},
+    {"dead_cedilla", "cC", "çÇ", 0},
+};
+#define DEAD_COUNT (sizeof(dead_keys) / sizeof(dead_keys[0]))
+
+static const char *const level_mods[LEVELS] = {"0", "MOD_SHIFT", "MOD_ALTGR", "MOD_ALTGR | MOD_SHIFT"};
+
+struct layout {
+    char name[32];
+    uint32_t sym[KEY_COUNT][LEVELS]; // code point, DEAD | n, or 0
+};
+
+static struct layout layouts[LAYOUTS_MAX];
+static size_t layout_count = 0;
+
+// A character of the layout being generated: the key called code pressed
+// at level, after keys[dead_key] at dead_level if dead_key >= 0
+struct entry {
+    uint32_t cp;
+    const char *code;
+    int level;
+    int dead_key;
+    int dead_level;
+};
+
+static struct entry entries[ENTRIES_MAX];
+static size_t entry_count;
+
+static const char *path;
+static int lineno;
+
+static void fail(const char *msg, const char *arg) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", path, lineno, msg, arg ? " " : "", arg ? arg : "");
+    exit(1);
+}
+
+// Decode the UTF-8 character at *s and step past it; 0 if it is malformed
+static uint32_t next_char(const char **s) {
+    const unsigned char *p = (const unsigned char *)*s;
+    size_t n = p[0] < 0x80 ? 1 : (p[0] & 0xe0) == 0xc0 ? 2 : (p[0] & 0xf0) == 0xe0 ? 3 : 4;
+    uint32_t cp = n == 1 ? p[0] : p[0] & (0x7f >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) return 0;
+        cp = cp << 6 | (p[i] & 0x3f);
+    }
+    *s += n;
+    return cp;
+}
+
+// The code point of a token that is exactly one character, or 0
+static uint32_t single_char(const char *s) {
+    uint32_t cp = next_char(&s);
+    return *s ? 0 : cp;
+}
+
+static struct layout *find_layout(const char *name) {
+    for (size_t i = 0; i < layout_count; i++) {
+        if (strcmp(layouts[i].name, name) == 0) return &layouts[i];
+    }
+    return NULL;
+}
+
+static void parse(FILE *f) {
+    char line[1024];
+    struct layout *cur = NULL;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *tok[1 + LEVELS + 1];
+        size_t n = 0;
+        for (char *t = strtok(line, " \t\r\n"); t && n < sizeof(tok) / sizeof(tok[0]);
+             t = strtok(NULL, " \t\r\n")) {
+            tok[n++] = t;
+        }
+        if (n == 0 || tok[0][0] == '#') continue;
+
+        if (strcmp(tok[0], "layout") == 0) {
+            if (n != 2) fail("expected: layout <name>", NULL);
+            for (const char *c = tok[1]; *c; c++) {
+                if (!islower((unsigned char)*c) && !isdigit((unsigned char)*c) && *c != '_') {
+                    fail("layout names are lowercase letters, digits and _:", tok[1]);
+                }
+            }
+            if (find_layout(tok[1])) fail("layout defined twice:", tok[1]);
+            if (layout_count == LAYOUTS_MAX || strlen(tok[1]) >= sizeof(cur->name)) {
+                fail("too many layouts or name too long:", tok[1]);
+            }
+            cur = &layouts[layout_count++];
+            snprintf(cur->name, sizeof(cur->name), "%s", tok[1]);
+            continue;
+        }
+        if (!cur) fail("key before the first layout line", NULL);
+
+        if (strcmp(tok[0], "include") == 0) {
+            struct layout *base = n == 2 ? find_layout(tok[1]) : NULL;
+            if (!base || base == cur) fail("unknown layout to include:", n == 2 ? tok[1] : NULL);
+            memcpy(cur->sym, base->sym, sizeof(cur->sym));
+            continue;
+        }
+
+        size_t key = 0;
+        while (key < KEY_COUNT && strcmp(keys[key].name, tok[0]) != 0) key++;
+        if (key == KEY_COUNT) fail("unknown key", tok[0]);
+        if (n < 2 || n > 1 + LEVELS) fail("expected 1 to 4 symbols for", tok[0]);
+
+        memset(cur->sym[key], 0, sizeof(cur->sym[key]));
+        for (size_t level = 0; level + 1 < n; level++) {
+            const char *t = tok[level + 1];
+            uint32_t sym = 0;
+            if (strcmp(t, "none") == 0) {
+                sym = 0;
+            } else if (strncmp(t, "dead_", 5) == 0) {
+                size_t d = 0;
+                while (d < DEAD_COUNT && strcmp(dead_keys[d].name, t) != 0) d++;
+                if (d == DEAD_COUNT) fail("unknown dead key", t);
+                sym = DEAD | d;
+            } else if (!(sym = single_char(t))) {
+                fail("expected one character, a dead key or none, got", t);
+            }
+            cur->sym[key][level] = sym;
+        }
+    }
+}
+
+static struct entry *find_entry(uint32_t cp) {
+    for (size_t i = 0; i < entry_count; i++) {
+        if (entries[i].cp == cp) return &entries[i];
+    }
+    return NULL;
+}
+
+static void add_entry(uint32_t cp, const char *code, int level, int dead_key, int dead_level) {
+    if (find_entry(cp)) return; // an easier way was found first
+    if (entry_count == ENTRIES_MAX) {
+        fprintf(stderr, "%s: more than %d characters in a layout\n", path, ENTRIES_MAX);
+        exit(1);
+    }
+    entries[entry_count++] = (struct entry){cp, code, level, dead_key, dead_level};
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t x = ((const struct entry *)a)->cp, y = ((const struct entry *)b)->cp;
+    return (x > y) - (x < y);
+}
+
+static void print_entry(const struct entry *e) {
+    if (e->dead_key >= 0) {
+        printf("{{%s, %s}, {%s, %s}}", keys[e->dead_key].code, level_mods[e->dead_level], e->code,
+               level_mods[e->level]);
+    } else {
+        printf("{{0, 0}, {%s, %s}}", e->code, level_mods[e->level]);
+    }
+}
+
+static void print_comment(uint32_t cp) {
+    // No backslash: it would continue the comment onto the next line
+    if (cp > ' ' && cp != '\\' && cp != 0x7f) {
+        char s[5] = {0};
+        if (cp < 0x80) {
+            s[0] = cp;
+        } else if (cp < 0x800) {
+            s[0] = 0xc0 | cp >> 6;
+            s[1] = 0x80 | (cp & 0x3f);
+        } else {
+            s[0] = 0xe0 | cp >> 12;
+            s[1] = 0x80 | (cp >> 6 & 0x3f);
+            s[2] = 0x80 | (cp & 0x3f);
+        }
+        printf(" // U+%04X %s\n", cp, s);
+    } else {
+        printf(" // U+%04X\n", cp);
+    }
+}
+
+static void generate(const struct layout *l) {
+    entry_count = 0;
+    add_entry('\t', "KEY_TAB", 0, -1, 0);
+    add_entry('\n', "KEY_ENTER", 0, -1, 0);
+    add_entry(' ', "KEY_SPACE", 0, -1, 0);
+
+    // Characters on a key of their own, fewest modifiers first
+    for (int level = 0; level < LEVELS; level++) {
+        for (size_t key = 0; key < KEY_COUNT; key++) {
+            uint32_t sym = l->sym[key][level];
+            if (sym && !(sym & DEAD)) add_entry(sym, keys[key].code, level, -1, 0);
+        }
+    }
+
+    // Then the ones composed with a dead key from a character typed directly
+    size_t dead_count = 0;
+    for (int level = 0; level < LEVELS; level++) {
+        for (size_t key = 0; key < KEY_COUNT; key++) {
+            uint32_t sym = l->sym[key][level];
+            if (!(sym & DEAD)) continue;
+            dead_count++;
+
+            size_t d = sym & ~DEAD;
+            const char *b = dead_keys[d].base, *c = dead_keys[d].composed;
+            while (*b) {
+                uint32_t base = next_char(&b), composed = next_char(&c);
+                struct entry *e = find_entry(base);
+                if (e && e->dead_key < 0) add_entry(composed, e->code, e->level, key, level);
+            }
+            if (dead_keys[d].spacing) add_entry(dead_keys[d].spacing, "KEY_SPACE", 0, key, level);
+        }
+    }
+
+    qsort(entries, entry_count, sizeof(entries[0]), compare_entries);
+
+    printf("static const struct keymap_entry keymap_%s_direct[KEYMAP_DIRECT] = {\n", l->name);
+    size_t extra = 0;
+    for (size_t i = 0; i < entry_count; i++) {
+        if (entries[i].cp >= KEYMAP_DIRECT) {
+            extra++;
+            continue;
+        }
+        printf("    [0x%02x] = ", entries[i].cp);
+        print_entry(&entries[i]);
+        printf(",");
+        print_comment(entries[i].cp);
+    }
+    printf("};\n\n");
+
+    if (extra) {
+        printf("static const struct keymap_extra keymap_%s_extra[] = {\n", l->name);
+        for (size_t i = 0; i < entry_count; i++) {
+            if (entries[i].cp < KEYMAP_DIRECT) continue;
+            printf("    {0x%04x, ", entries[i].cp);
+            print_entry(&entries[i]);
+            printf("},");
+            print_comment(entries[i].cp);
+        }
+        printf("};\n\n");
+    }
+
+    if (dead_count) {
+        printf("static const struct keystroke keymap_%s_dead[] = {\n", l->name);
+        for (int level = 0; level < LEVELS; level++) {
+            for (size_t key = 0; key < KEY_COUNT; key++) {
+                uint32_t sym = l->sym[key][level];
+                if (sym & DEAD) {
+                    printf("    {%s, %s}, // %s\n", keys[key].code, level_mods[level],
+                           dead_keys[sym & ~DEAD].name);
+                }
+            }
+        }
+        printf("};\n\n");
+    }
+
+    // The tables a layout has no entries for are NULL, as C has no empty arrays
+    printf("#define KEYMAP_%s_EXTRA ", l->name);
+    printf(extra ? "keymap_%s_extra, %zu\n" : "NULL%.0s, %zu\n", l->name, extra);
+    printf("#define KEYMAP_%s_DEAD ", l->name);
+    printf(dead_count ? "keymap_%s_dead, %zu\n\n" : "NULL%.0s, %zu\n\n", l->name, dead_count);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s keymaps.txt > keymap_tables.h\n", argv[0]);
+        return 1;
+    }
+    path = argv[1];
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    parse(f);
+    fclose(f);
+    if (layout_count == 0) {
+        fprintf(stderr, "%s: no layouts\n", path);
+        return 1;
+    }
+
+    printf("// Generated by keymapgen from %s; edit that instead\n\n", path);
+    for (size_t i = 0; i < layout_count; i++) generate(&layouts[i]);
+
+    printf("const struct keymap keymaps[] = {\n");
+    for (size_t i = 0; i < layout_count; i++) {
+        const char *n = layouts[i].name;
+        printf("    {\"%s\", keymap_%s_direct, KEYMAP_%s_EXTRA, KEYMAP_%s_DEAD},\n", n, n, n, n);
+    }
+    printf("};\n\n");
+    printf("const size_t keymap_count = %zu;\n", layout_count);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * xhisper - Whisper for Linux
+ * Offline transcription on the CPU with whisper.cpp (make WHISPER=1)
+ *
+ * The model is loaded once when the daemon starts and stays resident, so
+ * a dictation pays only for decoding. The file is mapped just long enough
+ * for whisper.cpp to copy the weights into its own buffers. One context
+ * decodes one recording at a time, over all threads. Built without
+ * whisper.cpp, loading fails and every local request gets an error.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "localwhisper.h"
+
+#ifdef XHISPER_WHISPER
+
+#include <whisper.h>
+
+static struct whisper_context *ctx = NULL;
+static int n_threads = 1;
+
+// Load the ggml model at path, to decode with threads threads (0: one per CPU)
+int localwhisper_load(const char *path, int threads) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("xhispertoold: failed to open the whisper model");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *model = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (model == MAP_FAILED) {
+        perror("xhispertoold: failed to map the whisper model");
+        return -1;
+    }
+    // Advice values are not flags, so each takes its own call
+    madvise(model, st.st_size, MADV_SEQUENTIAL);
+    madvise(model, st.st_size, MADV_WILLNEED);
+
+    // whisper.cpp copies the weights into its own buffers while loading,
+    // so the mapping is only needed until then
+    struct whisper_context_params params = whisper_context_default_params();
+    params.use_gpu = 0;
+    ctx = whisper_init_from_buffer_with_params(model, st.st_size, params);
+    munmap(model, st.st_size);
+    if (!ctx) {
+        fprintf(stderr, "xhispertoold: %s is not a whisper model\n", path);
+        return -1;
+    }
+
+    n_threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1) n_threads = 1;
+    return 0;
+}
+
+int localwhisper_loaded(void) {
+    return ctx != NULL;
+}
+
+int localwhisper_threads(void) {
+    return n_threads;
+}
+
+// Transcript of n samples of 16 kHz mono PCM, or NULL with *error set.
+// Not reentrant: calls come from the transcription worker's local thread.
+char *localwhisper_run(const int16_t *pcm, size_t n, const char *prompt, char **error) {
+    if (!ctx) {
+        *error = strdup("no local model loaded (xhispertoold --model-file)");
+        return NULL;
+    }
+    float *samples = malloc(n * sizeof(*samples));
+    if (!samples) {
+        *error = strdup("out of memory");
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) samples[i] = pcm[i] / 32768.0f;
+
+    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    params.n_threads = n_threads;
+    params.language = "auto";
+    params.no_context = 1;
+    params.no_timestamps = 1;
+    params.print_progress = 0;
+    params.print_realtime = 0;
+    params.print_timestamps = 0;
+    params.initial_prompt = prompt && prompt[0] ? prompt : NULL;
+
+    int err = whisper_full(ctx, params, samples, n);
+    free(samples);
+    if (err) {
+        *error = strdup("whisper.cpp failed to decode the recording");
+        return NULL;
+    }
+
+    // Segments as the API joins them: each begins with its own space
+    size_t len = 0;
+    int segments = whisper_full_n_segments(ctx);
+    for (int i = 0; i < segments; i++) len += strlen(whisper_full_get_segment_text(ctx, i));
+    char *text = malloc(len + 1), *p = text;
+    if (!text) {
+        *error = strdup("out of memory");
+        return NULL;
+    }
+    for (int i = 0; i < segments; i++) {
+        const char *segment = whisper_full_get_segment_text(ctx, i);
+        size_t segment_len = strlen(segment);
+        memcpy(p, segment, segment_len);
+        p += segment_len;
+    }
+    *p = 0;
+    return text;
+}
+
+#else
+
+int localwhisper_load(const char *path, int threads) {
+    (void)path;
+    (void)threads;
+    fprintf(stderr, "xhispertoold: built without whisper.cpp, rebuild with make WHISPER=1\n");
+    return -1;
+}
+
+int localwhisper_loaded(void) {
+    return 0;
+}
+
+int localwhisper_threads(void) {
+    return 0;
+}
+
+char *localwhisper_run(const int16_t *pcm, size_t n, const char *prompt, char **error) {
+    (void)pcm;
+    (void)n;
+    (void)prompt;
+    *error = strdup("built without whisper.cpp (make WHISPER=1)");
+    return NULL;
+}
+
+#endif
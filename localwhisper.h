@@ -0,0 +1,17 @@
+/*
+ * xhisper - Whisper for Linux
+ * Offline transcription on the CPU with whisper.cpp (make WHISPER=1)
+ */
+
+#ifndef XHISPER_LOCALWHISPER_H
+#define XHISPER_LOCALWHISPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int localwhisper_load(const char *path, int threads);
+int localwhisper_loaded(void);
+int localwhisper_threads(void);
+char *localwhisper_run(const int16_t *pcm, size_t n, const char *prompt, char **error);
+
+#endif
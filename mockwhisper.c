@@ -0,0 +1,449 @@
+/*
+ * xhisper - Whisper for Linux
+ * Local stand-in for the transcription endpoint, for testing without an
+ * API key or network
+ *
+ * Usage: mockwhisper [--port n] [--delay-ms n] [--rtf x] [--jitter-ms n] [--tail p:ms]
+ *                    [--seed n] [--kbps n] [--key k] [--tls cert.pem key.pem]
+ *
+ * Serves POST /openai/v1/audio/transcriptions over HTTP/1.1 with
+ * keep-alive, plain or with --tls over TLS. Every request is logged with
+ * the number of the connection it came on, to show connection reuse.
+ * The multipart "file" field may be FLAC or WAV; the reply is
+ * {"text":" [<seconds> s]"} with the audio's length. The reply waits
+ * --delay-ms per request plus --rtf times the audio length, standing in
+ * for network latency and decoding time. --jitter-ms adds a uniformly
+ * random 0 to n ms, and --tail p:ms adds ms more to a fraction p of the
+ * requests, for a latency distribution with a long tail. --kbps reads
+ * requests no faster than that many kbit/s, like a slow uplink. With
+ * --key, requests without that bearer token get 401.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#define HEADER_MAX 16384
+#define BODY_MAX (64 << 20)
+#define ENDPOINT "/openai/v1/audio/transcriptions"
+
+static int delay_ms = 0;
+static double rtf = 0; // decoding time per second of audio
+static int kbps = 0;    // upload bandwidth, 0 for unlimited
+static int jitter_ms = 0;
+static double tail_p = 0; // fraction of requests that are slow
+static int tail_ms = 0;   // and by how much
+static unsigned int seed;
+static const char *api_key = NULL;
+static SSL_CTX *tls = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // also for seed
+
+struct conn {
+    int fd;
+    unsigned int id;
+    SSL *ssl;
+    char buf[HEADER_MAX];
+    size_t len; // bytes buffered but not consumed
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+ssize_t conn_recv(struct conn *c, void *buf, size_t n) {
+    ssize_t r;
+    if (kbps && n > 1460) n = 1460;
+    if (c->ssl) {
+        r = SSL_read(c->ssl, buf, n);
+        if (r < 0) r = -1;
+    } else {
+        r = recv(c->fd, buf, n, 0);
+    }
+    if (kbps && r > 0) usleep(r * 8000 / kbps);
+    return r;
+}
+
+int conn_send(struct conn *c, const void *buf, size_t n) {
+    if (c->ssl) return SSL_write(c->ssl, buf, n) == (int)n ? 0 : -1;
+    return send(c->fd, buf, n, MSG_NOSIGNAL) == (ssize_t)n ? 0 : -1;
+}
+
+// Make sure at least want bytes are buffered
+int fill(struct conn *c, size_t want) {
+    while (c->len < want) {
+        ssize_t n = conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c->len += n;
+    }
+    return 0;
+}
+
+void consume(struct conn *c, size_t n) {
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+// Read exactly n body bytes into out, buffered ones first
+int read_body(struct conn *c, char *out, size_t n) {
+    size_t take = n < c->len ? n : c->len;
+    memcpy(out, c->buf, take);
+    consume(c, take);
+    while (take < n) {
+        ssize_t r = conn_recv(c, out + take, n - take);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        take += r;
+    }
+    return 0;
+}
+
+// A line ending in CRLF, returned without it
+char *read_line(struct conn *c, char *line, size_t cap) {
+    char *end;
+    while (!(end = memmem(c->buf, c->len, "\r\n", 2))) {
+        if (c->len == sizeof(c->buf) || fill(c, c->len + 1) < 0) return NULL;
+    }
+    size_t n = end - c->buf;
+    if (n >= cap) return NULL;
+    memcpy(line, c->buf, n);
+    line[n] = 0;
+    consume(c, n + 2);
+    return line;
+}
+
+// Value of header name in the block of headers, copied to out
+int header(const char *headers, const char *name, char *out, size_t cap) {
+    size_t name_len = strlen(name);
+    for (const char *p = headers; *p;) {
+        const char *eol = strstr(p, "\r\n");
+        if (!eol) eol = p + strlen(p);
+        if (strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            const char *v = p + name_len + 1;
+            while (*v == ' ') v++;
+            size_t n = eol - v;
+            if (n >= cap) n = cap - 1;
+            memcpy(out, v, n);
+            out[n] = 0;
+            return 0;
+        }
+        p = *eol ? eol + 2 : eol;
+    }
+    return -1;
+}
+
+// Whole body, by Content-Length or chunked transfer encoding
+char *read_request_body(struct conn *c, const char *headers, size_t *out_len) {
+    char value[256];
+    if (header(headers, "Transfer-Encoding", value, sizeof(value)) == 0 && strcasestr(value, "chunked")) {
+        size_t len = 0, cap = 65536;
+        char *body = malloc(cap), line[256];
+        while (body && read_line(c, line, sizeof(line))) {
+            size_t n = strtoul(line, NULL, 16);
+            if (n == 0) {
+                // Trailers end with an empty line
+                while (read_line(c, line, sizeof(line)) && line[0]);
+                *out_len = len;
+                return body;
+            }
+            if (len + n > BODY_MAX) break;
+            while (len + n > cap) cap *= 2;
+            char *grown = realloc(body, cap);
+            if (!grown) break;
+            body = grown;
+            if (read_body(c, body + len, n) < 0 || !read_line(c, line, sizeof(line))) break;
+            len += n;
+        }
+        free(body);
+        return NULL;
+    }
+
+    size_t len = 0;
+    if (header(headers, "Content-Length", value, sizeof(value)) == 0) len = strtoul(value, NULL, 10);
+    if (len > BODY_MAX) return NULL;
+    char *body = malloc(len + 1);
+    if (!body || read_body(c, body, len) < 0) {
+        free(body);
+        return NULL;
+    }
+    *out_len = len;
+    return body;
+}
+
+// Locate the multipart field called name
+const char *multipart_field(const char *body, size_t len, const char *boundary,
+                            const char *name, size_t *field_len) {
+    char delim[256], disposition[300];
+    snprintf(delim, sizeof(delim), "\r\n--%s", boundary);
+    snprintf(disposition, sizeof(disposition), "name=\"%s\"", name);
+    size_t delim_len = strlen(delim);
+
+    // The first delimiter has no leading CRLF
+    const char *p = memmem(body, len, delim + 2, delim_len - 2);
+    while (p) {
+        const char *headers = p + delim_len - 2;
+        const char *data = memmem(headers, body + len - headers, "\r\n\r\n", 4);
+        if (!data) return NULL;
+        data += 4;
+        const char *next = memmem(data, body + len - data, delim, delim_len);
+        if (!next) return NULL;
+        if (memmem(headers, data - headers, disposition, strlen(disposition))) {
+            *field_len = next - data;
+            return data;
+        }
+        p = next + 2;
+    }
+    return NULL;
+}
+
+uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint8_t crc8(const uint8_t *p, size_t len) {
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+// Samples up to the end of the fixed-blocksize frame whose header starts at
+// p, or 0 if p is not a frame header (its CRC-8 does not match)
+uint64_t frame_end(const uint8_t *p, const uint8_t *end, uint32_t block_size) {
+    if (end - p < 6 || p[0] != 0xff || p[1] != 0xf8) return 0;
+    int bs_code = p[2] >> 4, rate_code = p[2] & 0x0f;
+    const uint8_t *q = p + 4;
+
+    // Frame number, UTF-8 style
+    int extra = 0;
+    while (extra < 6 && q[0] & (0x80 >> extra)) extra++;
+    if (extra == 1 || extra > 6 || end - q < extra + 4) return 0;
+    uint64_t frame = q[0] & (0x7f >> extra);
+    for (int i = 1; i < extra; i++) frame = frame << 6 | (q[i] & 0x3f);
+    q += extra ? extra : 1;
+
+    uint32_t n = bs_code == 1 ? 192 : bs_code >= 2 && bs_code <= 5 ? 576u << (bs_code - 2) :
+                 bs_code >= 8 ? 256u << (bs_code - 8) : 0;
+    if (bs_code == 6) n = *q++ + 1;
+    if (bs_code == 7) n = (q[0] << 8 | q[1]) + 1, q += 2;
+    if (rate_code == 12) q++;
+    if (rate_code == 13 || rate_code == 14) q += 2;
+    if (!n || q >= end || crc8(p, q - p) != *q) return 0;
+    return frame * block_size + n;
+}
+
+// Length of a FLAC or WAV file from its header; negative if unknown. A
+// FLAC stream uploaded while it was recorded has no length in its
+// STREAMINFO, so it is taken from the last frame instead.
+double audio_seconds(const uint8_t *a, size_t len) {
+    if (len >= 26 && memcmp(a, "fLaC", 4) == 0) {
+        uint32_t rate = a[18] << 12 | a[19] << 4 | a[20] >> 4;
+        uint64_t samples = (uint64_t)(a[21] & 0x0f) << 32 | (uint32_t)a[22] << 24 | a[23] << 16 |
+                           a[24] << 8 | a[25];
+        uint32_t block_size = a[8] << 8 | a[9];
+        for (size_t i = len - 2; !samples && i >= 42 && block_size == (uint32_t)(a[10] << 8 | a[11]); i--) {
+            samples = frame_end(a + i, a + len, block_size);
+        }
+        return rate && samples ? (double)samples / rate : -1;
+    }
+    if (len >= 44 && memcmp(a, "RIFF", 4) == 0 && memcmp(a + 8, "WAVE", 4) == 0) {
+        uint32_t byte_rate = le32(a + 28);
+        return byte_rate ? (double)le32(a + 40) / byte_rate : -1;
+    }
+    return -1;
+}
+
+// This request's share of --jitter-ms and --tail
+double random_delay_ms() {
+    pthread_mutex_lock(&log_lock);
+    double jitter = (double)rand_r(&seed) / RAND_MAX, tail = (double)rand_r(&seed) / RAND_MAX;
+    pthread_mutex_unlock(&log_lock);
+    return jitter * jitter_ms + (tail < tail_p ? tail_ms : 0);
+}
+
+// A HEAD request gets the headers only
+void respond(struct conn *c, int head_only, int status, const char *reason, const char *json) {
+    char msg[512];
+    int n = snprintf(msg, sizeof(msg),
+                     "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n\r\n%s", status, reason, strlen(json),
+                     head_only ? "" : json);
+    conn_send(c, msg, n);
+}
+
+void *serve(void *arg) {
+    struct conn *c = arg;
+    char line[1024], headers[HEADER_MAX];
+
+    if (tls) {
+        c->ssl = SSL_new(tls);
+        if (!c->ssl || SSL_set_fd(c->ssl, c->fd) != 1 || SSL_accept(c->ssl) != 1) goto done;
+    }
+
+    while (read_line(c, line, sizeof(line))) {
+        uint64_t start = now_ns();
+        char method[16] = "", path[512] = "";
+        sscanf(line, "%15s %511s", method, path);
+
+        size_t hlen = 0;
+        char h[HEADER_MAX];
+        while (read_line(c, h, sizeof(h)) && h[0]) {
+            hlen += snprintf(headers + hlen, sizeof(headers) - hlen, "%s\r\n", h);
+            if (hlen >= sizeof(headers)) break;
+        }
+        headers[hlen < sizeof(headers) ? hlen : sizeof(headers) - 1] = 0;
+
+        char value[HEADER_MAX], boundary[256] = "";
+        if (header(headers, "Expect", value, sizeof(value)) == 0 && strcasecmp(value, "100-continue") == 0) {
+            conn_send(c, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+
+        size_t body_len = 0;
+        char *body = read_request_body(c, headers, &body_len);
+        if (!body) break;
+
+        int status = 200, head_only = strcmp(method, "HEAD") == 0;
+        double seconds = -1;
+        if (strcmp(path, ENDPOINT) != 0) {
+            status = 404;
+            respond(c, head_only, 404, "Not Found", "{\"error\":{\"message\":\"unknown endpoint\"}}");
+        } else if (strcmp(method, "POST") != 0) {
+            // What a warm-up request gets
+            status = 405;
+            respond(c, head_only, 405, "Method Not Allowed", "{\"error\":{\"message\":\"use POST\"}}");
+        } else if (api_key && (header(headers, "Authorization", value, sizeof(value)) < 0 ||
+                               strncmp(value, "Bearer ", 7) != 0 || strcmp(value + 7, api_key) != 0)) {
+            status = 401;
+            respond(c, 0, 401, "Unauthorized", "{\"error\":{\"message\":\"Invalid API Key\"}}");
+        } else {
+            const char *b;
+            size_t file_len = 0;
+            const char *file = NULL;
+            if (header(headers, "Content-Type", value, sizeof(value)) == 0 &&
+                (b = strstr(value, "boundary="))) {
+                snprintf(boundary, sizeof(boundary), "%s", b + 9);
+                file = multipart_field(body, body_len, boundary, "file", &file_len);
+            }
+            if (!file) {
+                status = 400;
+                respond(c, 0, 400, "Bad Request", "{\"error\":{\"message\":\"no file field\"}}");
+            } else {
+                seconds = audio_seconds((const uint8_t *)file, file_len);
+                double wait_ms = delay_ms + (seconds > 0 ? seconds * rtf * 1000 : 0) + random_delay_ms();
+                if (wait_ms > 0) usleep(wait_ms * 1000);
+                char json[128];
+                snprintf(json, sizeof(json), "{\"text\":\" [%.2f s]\"}", seconds);
+                respond(c, 0, 200, "OK", json);
+            }
+        }
+
+        pthread_mutex_lock(&log_lock);
+        printf("mockwhisper: conn %u: %s %s %d, %zu bytes, %.2f s audio, %.1f ms\n", c->id, method,
+               path, status, body_len, seconds, (now_ns() - start) / 1e6);
+        fflush(stdout);
+        pthread_mutex_unlock(&log_lock);
+        free(body);
+
+        if (header(headers, "Connection", value, sizeof(value)) == 0 && strcasecmp(value, "close") == 0) break;
+    }
+
+done:
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 8090;
+    unsigned int conn_count = 0;
+    seed = time(NULL);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--delay-ms") == 0 && i + 1 < argc) {
+            delay_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rtf") == 0 && i + 1 < argc) {
+            rtf = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--jitter-ms") == 0 && i + 1 < argc) {
+            jitter_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tail") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%lf:%d", &tail_p, &tail_ms) == 2) {
+            i++;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--kbps") == 0 && i + 1 < argc) {
+            kbps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            api_key = argv[++i];
+        } else if (strcmp(argv[i], "--tls") == 0 && i + 2 < argc) {
+            tls = SSL_CTX_new(TLS_server_method());
+            if (!tls || SSL_CTX_use_certificate_chain_file(tls, argv[i + 1]) != 1 ||
+                SSL_CTX_use_PrivateKey_file(tls, argv[i + 2], SSL_FILETYPE_PEM) != 1) {
+                fprintf(stderr, "mockwhisper: failed to load %s and %s\n", argv[i + 1], argv[i + 2]);
+                return 1;
+            }
+            i += 2;
+        } else {
+            fprintf(stderr, "Usage: mockwhisper [--port n] [--delay-ms n] [--rtf x] [--jitter-ms n] "
+                            "[--tail p:ms]\n"
+                            "                   [--seed n] [--kbps n] [--key k] [--tls cert.pem key.pem]\n");
+            return 1;
+        }
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror("mockwhisper: failed to listen");
+        return 1;
+    }
+    printf("mockwhisper: listening on %s://127.0.0.1:%d%s\n", tls ? "https" : "http", port, ENDPOINT);
+    fflush(stdout);
+
+    while (1) {
+        int conn_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno != EINTR) perror("mockwhisper: accept failed");
+            continue;
+        }
+        struct conn *c = calloc(1, sizeof(*c));
+        pthread_t thread;
+        if (!c) {
+            close(conn_fd);
+            continue;
+        }
+        c->fd = conn_fd;
+        c->id = ++conn_count;
+        if (pthread_create(&thread, NULL, serve, c) != 0) {
+            close(conn_fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
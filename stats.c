@@ -0,0 +1,57 @@
+/*
+ * xhisper - Whisper for Linux
+ * Lock-free counters and latency histograms for the daemon's stats
+ */
+
+#include "stats.h"
+
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+
+// Values below HIST_SUB_COUNT get a bucket each; above, the position of
+// the top bit picks the block and the next HIST_SUB_BITS bits the bucket
+static size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return value;
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << HIST_SUB_BITS) + (size_t)((value >> shift) - HIST_SUB_COUNT);
+}
+
+// Middle of the range of values that land in bucket i
+static uint64_t hist_value(size_t i) {
+    size_t block = i >> HIST_SUB_BITS;
+    uint64_t sub = i & (HIST_SUB_COUNT - 1);
+    if (block == 0) return sub;
+    uint64_t low = (HIST_SUB_COUNT + sub) << (block - 1);
+    return low + ((1ull << (block - 1)) >> 1);
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->counts[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed,
+                                                  memory_order_relaxed));
+}
+
+// Value at or below which pct percent of the samples fall, to within a
+// bucket; 0 for an empty histogram
+uint64_t hist_percentile(const struct histogram *h, double pct) {
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(pct / 100.0 * total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,38 @@
+/*
+ * xhisper - Whisper for Linux
+ * Lock-free counters and latency histograms for the daemon's stats
+ */
+
+#ifndef XHISPER_STATS_H
+#define XHISPER_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear (HDR-style) histogram of microsecond values: each power of
+// two is split into 2^HIST_SUB_BITS equal buckets, so a bucket is never
+// wider than 1/32 of its values, from 0 up to the full uint64_t range.
+// Recording is a few relaxed atomic adds on a static array; readers may
+// see a sample counted in one field and not yet in another.
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+};
+
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_percentile(const struct histogram *h, double pct);
+
+static inline void counter_add(_Atomic uint64_t *c, uint64_t n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(const _Atomic uint64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+#endif
@@ -11,35 +11,10 @@
 #include <sys/ioctl.h>
 #include <linux/uinput.h>
 
-#define KEY_LEFTCTRL 29
-#define KEY_RIGHTCTRL 97
-#define KEY_LEFTALT 56
-#define KEY_RIGHTALT 100
-#define KEY_LEFTSHIFT 42
-#define KEY_RIGHTSHIFT 54
-#define KEY_LEFTMETA 125
-#define KEY_V 47
-#define FLAG_UPPERCASE 0x80000000
-
-// ASCII to Linux keycode mapping
-static const int32_t ascii2keycode_map[128] = {
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	-1,KEY_TAB,KEY_ENTER,-1,-1,-1,-1,-1,
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	KEY_SPACE,KEY_1|FLAG_UPPERCASE,KEY_APOSTROPHE|FLAG_UPPERCASE,KEY_3|FLAG_UPPERCASE,KEY_4|FLAG_UPPERCASE,KEY_5|FLAG_UPPERCASE,KEY_7|FLAG_UPPERCASE,KEY_APOSTROPHE,
-	KEY_9|FLAG_UPPERCASE,KEY_0|FLAG_UPPERCASE,KEY_8|FLAG_UPPERCASE,KEY_EQUAL|FLAG_UPPERCASE,KEY_COMMA,KEY_MINUS,KEY_DOT,KEY_SLASH,
-	KEY_0,KEY_1,KEY_2,KEY_3,KEY_4,KEY_5,KEY_6,KEY_7,
-	KEY_8,KEY_9,KEY_SEMICOLON|FLAG_UPPERCASE,KEY_SEMICOLON,KEY_COMMA|FLAG_UPPERCASE,KEY_EQUAL,KEY_DOT|FLAG_UPPERCASE,KEY_SLASH|FLAG_UPPERCASE,
-	KEY_2|FLAG_UPPERCASE,KEY_A|FLAG_UPPERCASE,KEY_B|FLAG_UPPERCASE,KEY_C|FLAG_UPPERCASE,KEY_D|FLAG_UPPERCASE,KEY_E|FLAG_UPPERCASE,KEY_F|FLAG_UPPERCASE,KEY_G|FLAG_UPPERCASE,
-	KEY_H|FLAG_UPPERCASE,KEY_I|FLAG_UPPERCASE,KEY_J|FLAG_UPPERCASE,KEY_K|FLAG_UPPERCASE,KEY_L|FLAG_UPPERCASE,KEY_M|FLAG_UPPERCASE,KEY_N|FLAG_UPPERCASE,KEY_O|FLAG_UPPERCASE,
-	KEY_P|FLAG_UPPERCASE,KEY_Q|FLAG_UPPERCASE,KEY_R|FLAG_UPPERCASE,KEY_S|FLAG_UPPERCASE,KEY_T|FLAG_UPPERCASE,KEY_U|FLAG_UPPERCASE,KEY_V|FLAG_UPPERCASE,KEY_W|FLAG_UPPERCASE,
-	KEY_X|FLAG_UPPERCASE,KEY_Y|FLAG_UPPERCASE,KEY_Z|FLAG_UPPERCASE,KEY_LEFTBRACE,KEY_BACKSLASH,KEY_RIGHTBRACE,KEY_6|FLAG_UPPERCASE,KEY_MINUS|FLAG_UPPERCASE,
-	KEY_GRAVE,KEY_A,KEY_B,KEY_C,KEY_D,KEY_E,KEY_F,KEY_G,
-	KEY_H,KEY_I,KEY_J,KEY_K,KEY_L,KEY_M,KEY_N,KEY_O,
-	KEY_P,KEY_Q,KEY_R,KEY_S,KEY_T,KEY_U,KEY_V,KEY_W,
-	KEY_X,KEY_Y,KEY_Z,KEY_LEFTBRACE|FLAG_UPPERCASE,KEY_BACKSLASH|FLAG_UPPERCASE,KEY_RIGHTBRACE|FLAG_UPPERCASE,KEY_GRAVE|FLAG_UPPERCASE,-1
-};
+#include "keymap.h"
+
+// Keyboard layout the keys are typed for, from keymaps.txt
+static const struct keymap *layout;
 
 static int fd_uinput = -1;
 
@@ -73,34 +48,51 @@ void do_paste() {
     emit(EV_SYN, SYN_REPORT, 0);
 }
 
-void type_char(unsigned char c) {
-    if (c >= 128) return;
-
-    int32_t kdef = ascii2keycode_map[c];
-    if (kdef == -1) return;
-
-    uint16_t keycode = kdef & 0xffff;
-
-    if (kdef & FLAG_UPPERCASE) {
+// Press k with its modifiers held
+void press_stroke(struct keystroke k) {
+    if (k.mods & MOD_SHIFT) {
         emit(EV_KEY, KEY_LEFTSHIFT, 1);
         emit(EV_SYN, SYN_REPORT, 0);
         usleep(2000);
     }
+    if (k.mods & MOD_ALTGR) {
+        emit(EV_KEY, KEY_RIGHTALT, 1);
+        emit(EV_SYN, SYN_REPORT, 0);
+        usleep(2000);
+    }
 
-    emit(EV_KEY, keycode, 1);
+    emit(EV_KEY, k.code, 1);
     emit(EV_SYN, SYN_REPORT, 0);
     usleep(8000);
 
-    emit(EV_KEY, keycode, 0);
+    emit(EV_KEY, k.code, 0);
     emit(EV_SYN, SYN_REPORT, 0);
     usleep(2000);
 
-    if (kdef & FLAG_UPPERCASE) {
+    if (k.mods & MOD_ALTGR) {
+        emit(EV_KEY, KEY_RIGHTALT, 0);
+        emit(EV_SYN, SYN_REPORT, 0);
+    }
+    if (k.mods & MOD_SHIFT) {
         emit(EV_KEY, KEY_LEFTSHIFT, 0);
         emit(EV_SYN, SYN_REPORT, 0);
     }
 }
 
+void type_char(uint32_t cp) {
+    const struct keymap_entry *e = keymap_lookup(layout, cp);
+    if (!e) return;
+
+    if (e->dead.code) press_stroke(e->dead);
+    press_stroke(e->key);
+}
+
+// Type the characters of a UTF-8 string that the layout has keys for
+void type_text(const char *s) {
+    size_t len = strlen(s);
+    for (size_t i = 0; i < len;) type_char(utf8_next(s, len, &i));
+}
+
 void do_backspace() {
     emit(EV_KEY, KEY_BACKSPACE, 1);
     emit(EV_SYN, SYN_REPORT, 0);
@@ -148,6 +140,7 @@ int setup_uinput() {
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_COMMA);
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_DOT);
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_SLASH);
+    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_102ND);
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_TAB);
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_ENTER);
     ioctl(fd_uinput, UI_SET_KEYBIT, KEY_BACKSPACE);
@@ -189,6 +182,8 @@ void run_clipboard_command(const char *text) {
     }
 }
 
+static const char accented[] = " àéîõü ñç ß €";
+
 void test_typer() {
     printf("\n--- Testing ASCII typing ---\n");
 
@@ -245,6 +240,10 @@ void test_typer() {
     for (int i = 0; sentence[i]; i++) {
         type_char(sentence[i]);
     }
+
+    // Typed with AltGr and dead keys where the layout has them; US has none
+    printf("Typing on %s: %s\n", layout->name, accented);
+    type_text(accented);
 }
 
 void test_paster() {
@@ -267,6 +266,19 @@ void test_paster() {
 int main(int argc, char *argv[]) {
     int wrap_keycode = 0;
     const char *wrap_name = NULL;
+    const char *prog = argv[0];
+
+    layout = keymap_find("us");
+    if (argc > 2 && strcmp(argv[1], "--layout") == 0) {
+        if (!(layout = keymap_find(argv[2]))) {
+            fprintf(stderr, "Unknown layout '%s', expected one of:", argv[2]);
+            for (size_t i = 0; i < keymap_count; i++) fprintf(stderr, " %s", keymaps[i].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
 
     // Parse command-line arguments for input switching key
     if (argc > 1) {
@@ -292,7 +304,7 @@ int main(int argc, char *argv[]) {
             wrap_keycode = KEY_LEFTMETA;
             wrap_name = "super";
         } else {
-            fprintf(stderr, "Usage: %s [--leftalt|--rightalt|--leftctrl|--rightctrl|--leftshift|--rightshift|--super]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [--layout <name>] [--leftalt|--rightalt|--leftctrl|--rightctrl|--leftshift|--rightshift|--super]\n", prog);
             return 1;
         }
     }
@@ -334,7 +346,13 @@ int main(int argc, char *argv[]) {
 
     printf("\n\n=== Test complete ===\n");
     printf("Expected output:\n");
-    printf("abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 !@#$%%^&*()_+-=[]{}\\|;:'\"<>,.?/`~ Hello, World! Testing 123.éàèùçäöüß你好世界مرحباМосква\n");
+    printf("abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 !@#$%%^&*()_+-=[]{}\\|;:'\"<>,.?/`~ Hello, World! Testing 123.");
+    size_t len = strlen(accented);
+    for (size_t i = 0; i < len;) {
+        size_t start = i;
+        if (keymap_lookup(layout, utf8_next(accented, len, &i))) printf("%.*s", (int)(i - start), accented + start);
+    }
+    printf("éàèùçäöüß你好世界مرحباМосква\n");
 
     return 0;
 }
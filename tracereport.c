@@ -0,0 +1,174 @@
+/*
+ * xhisper - Whisper for Linux
+ * Summarizes a trace written by xhispertoold --trace: groups the stage
+ * lines by dictation and prints, per stage, percentiles of the time since
+ * the toggle (record-stop) and since the stage before it.
+ *
+ * Usage: tracereport [trace.jsonl ...]   (stdin without arguments)
+ *
+ * A stage a dictation went through more than once (one per request when a
+ * recording is sent as several segments, last_key per typed command) counts
+ * at its last time, except first_key at its first. Dictations without a
+ * toggle, such as cancelled ones, are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define LINE_MAX_LEN 1024
+
+static const char *const stages[] = {
+    "start", "toggle", "capture_stopped", "flushed", "submitted", "upload_start", "upload_end",
+    "first_byte", "parsed", "transcript", "first_key", "last_key",
+};
+#define STAGE_COUNT (sizeof(stages) / sizeof(stages[0]))
+#define STAGE_TOGGLE 1
+#define STAGE_FIRST_KEY 10
+
+struct dictation {
+    long pid;
+    long session;
+    uint64_t t_us[STAGE_COUNT]; // 0 when the stage is missing
+};
+
+static struct dictation *dictations = NULL;
+static size_t dictation_count = 0, dictation_cap = 0;
+
+// Lines of one dictation are close together, so search from the newest
+static struct dictation *find_dictation(long pid, long session) {
+    for (size_t i = dictation_count; i-- > 0;)
+        if (dictations[i].pid == pid && dictations[i].session == session) return &dictations[i];
+
+    if (dictation_count == dictation_cap) {
+        size_t cap = dictation_cap ? 2 * dictation_cap : 256;
+        struct dictation *grown = realloc(dictations, cap * sizeof(*grown));
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        dictations = grown;
+        dictation_cap = cap;
+    }
+    struct dictation *d = &dictations[dictation_count++];
+    memset(d, 0, sizeof(*d));
+    d->pid = pid;
+    d->session = session;
+    return d;
+}
+
+// Value of "key": in one of the daemon's flat JSON lines, NULL if absent
+static const char *field(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    return p ? p + strlen(pattern) : NULL;
+}
+
+static int stage_index(const char *value) {
+    if (*value != '"') return -1;
+    value++;
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        size_t len = strlen(stages[i]);
+        if (strncmp(value, stages[i], len) == 0 && value[len] == '"') return (int)i;
+    }
+    return -1;
+}
+
+static void read_trace(FILE *f, const char *name) {
+    char line[LINE_MAX_LEN];
+    size_t lineno = 0, bad = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        const char *t = field(line, "t_us"), *pid = field(line, "pid");
+        const char *session = field(line, "session"), *stage = field(line, "stage");
+        int s = stage ? stage_index(stage) : -1;
+        if (!t || !pid || !session || s < 0) {
+            if (bad++ == 0) fprintf(stderr, "%s:%zu: skipping unrecognized line\n", name, lineno);
+            continue;
+        }
+
+        uint64_t t_us = strtoull(t, NULL, 10);
+        struct dictation *d = find_dictation(strtol(pid, NULL, 10), strtol(session, NULL, 10));
+        if (!d->t_us[s] || (s == STAGE_FIRST_KEY ? t_us < d->t_us[s] : t_us > d->t_us[s]))
+            d->t_us[s] = t_us;
+    }
+    if (bad > 1) fprintf(stderr, "%s: %zu unrecognized lines skipped\n", name, bad);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of n sorted values, in ms
+static double percentile_ms(const uint64_t *sorted, size_t n, double pct) {
+    size_t rank = (size_t)(pct / 100.0 * n + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        fprintf(stderr, "Usage: %s [trace.jsonl ...]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 1) read_trace(stdin, "stdin");
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        read_trace(f, argv[i]);
+        fclose(f);
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < dictation_count; i++)
+        if (dictations[i].t_us[STAGE_TOGGLE]) dictations[used++] = dictations[i];
+    if (used == 0) {
+        fprintf(stderr, "No finished dictations in the trace\n");
+        return 1;
+    }
+
+    uint64_t *since_toggle = malloc(used * sizeof(uint64_t));
+    uint64_t *step = malloc(used * sizeof(uint64_t));
+    if (!since_toggle || !step) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%zu dictations, ms      %9s %9s %9s  | %9s %9s %9s\n", used, "p50", "p90", "p99", "step p50",
+           "p90", "p99");
+    for (size_t s = STAGE_TOGGLE + 1; s < STAGE_COUNT; s++) {
+        size_t n = 0, steps = 0;
+        for (size_t i = 0; i < used; i++) {
+            const struct dictation *d = &dictations[i];
+            uint64_t toggle = d->t_us[STAGE_TOGGLE];
+            if (d->t_us[s] < toggle) continue; // missing, or before the toggle
+            since_toggle[n++] = d->t_us[s] - toggle;
+
+            // The stage before it that this dictation went through
+            size_t prev = s - 1;
+            while (prev > STAGE_TOGGLE && d->t_us[prev] < toggle) prev--;
+            step[steps++] = d->t_us[s] > d->t_us[prev] ? d->t_us[s] - d->t_us[prev] : 0;
+        }
+        if (n == 0) continue;
+
+        qsort(since_toggle, n, sizeof(uint64_t), compare_u64);
+        qsort(step, steps, sizeof(uint64_t), compare_u64);
+        printf("%-16s n=%-5zu %9.1f %9.1f %9.1f  | %9.1f %9.1f %9.1f\n", stages[s], n,
+               percentile_ms(since_toggle, n, 50), percentile_ms(since_toggle, n, 90),
+               percentile_ms(since_toggle, n, 99), percentile_ms(step, steps, 50),
+               percentile_ms(step, steps, 90), percentile_ms(step, steps, 99));
+    }
+
+    free(since_toggle);
+    free(step);
+    free(dictations);
+    return 0;
+}
@@ -0,0 +1,768 @@
+/*
+ * xhisper - Whisper for Linux
+ * Transcription requests to an OpenAI-style /audio/transcriptions endpoint
+ *
+ * A worker thread runs submitted jobs concurrently on one curl multi
+ * handle, over at most the configured number of connections, and reports
+ * finished jobs through an eventfd, so the daemon's event loop never
+ * blocks on the network. Connections, DNS results and TLS sessions are
+ * kept between requests, so a warmed-up connection serves every
+ * dictation that follows while the server keeps it open. A streaming
+ * upload pauses whenever it has sent everything appended so far and is
+ * resumed by the worker when more arrives. A job with a hedge deadline
+ * that has no good answer by then is sent again to a second endpoint or
+ * model; the first good answer wins and the other request is cancelled.
+ * Also here: cutting long recordings into chunks and joining the chunk
+ * transcripts again. Local jobs bypass curl: a second thread runs them
+ * through the resident whisper.cpp model one at a time and reports them
+ * the same way.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <curl/curl.h>
+
+#include "keymap.h"
+#include "localwhisper.h"
+#include "transcribe.h"
+#include "vad.h"
+
+struct response {
+    char *data;
+    size_t len;
+};
+
+struct active {
+    struct transcript_job *job;
+    CURL *easy;
+    curl_mime *mime;
+    struct curl_slist *headers;
+    struct response body;
+    struct active *next_stream; // streaming uploads, owned by the worker
+    int paused;                 // waiting for transcribe_append, under lock
+    int hedge;                  // the second request for the job
+    struct active *twin;        // the job's other request while both run
+    struct active *next_wait;   // primaries whose hedge deadline is still ahead
+    uint64_t start_ns;
+    uint64_t upload_end_ns;     // the last byte of the body went to curl
+    uint64_t first_byte_ns;     // the status line of the response arrived
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct transcript_job *submitted = NULL; // newest first
+static struct transcript_job *done = NULL;      // newest first
+static struct transcript_job *local_submitted = NULL; // newest first
+static pthread_cond_t local_wake = PTHREAD_COND_INITIALIZER;
+static CURLM *multi = NULL;
+static CURLSH *share = NULL; // TLS sessions, for a quick reconnect
+static struct active *streams = NULL;
+static struct active *hedge_waiting = NULL;
+static const char *ca_file = NULL;
+static int fd_done_jobs = -1;
+static _Atomic int connections = TRANSCRIBE_CONNECTIONS_DEFAULT;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t append_response(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct response *r = userdata;
+    size_t n = size * nmemb;
+    char *data = realloc(r->data, r->len + n + 1);
+    if (!data) return 0;
+    memcpy(data + r->len, ptr, n);
+    r->data = data;
+    r->len += n;
+    r->data[r->len] = 0;
+    return n;
+}
+
+static size_t response_header(char *ptr, size_t size, size_t nitems, void *userdata) {
+    struct active *a = userdata;
+    (void)ptr;
+    if (!a->first_byte_ns) a->first_byte_ns = now_ns();
+    return size * nitems;
+}
+
+// Body of a streaming upload: whatever has been appended and not sent yet,
+// or a pause until there is more
+static size_t read_upload(char *buffer, size_t size, size_t nitems, void *userdata) {
+    struct active *a = userdata;
+    struct transcript_job *job = a->job;
+
+    pthread_mutex_lock(&lock);
+    size_t n = job->audio_len - job->audio_sent;
+    if (n > size * nitems) n = size * nitems;
+    memcpy(buffer, job->audio + job->audio_sent, n);
+    job->audio_sent += n;
+    int more = !job->audio_complete;
+    if (!n && more) a->paused = 1;
+    pthread_mutex_unlock(&lock);
+    if (!n && !more && !a->upload_end_ns) a->upload_end_ns = now_ns();
+    return n || !more ? n : CURL_READFUNC_PAUSE;
+}
+
+// Notes when a body of known size has been sent in full
+static int upload_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                           curl_off_t ulnow) {
+    struct active *a = clientp;
+    (void)dltotal;
+    (void)dlnow;
+    if (!a->upload_end_ns && ultotal > 0 && ulnow >= ultotal) a->upload_end_ns = now_ns();
+    return 0;
+}
+
+static int hex4(const char *p, uint32_t *v) {
+    *v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (d < 0) return -1;
+        *v = *v << 4 | d;
+    }
+    return 0;
+}
+
+// Decoded value of the first string member named key, or NULL. Enough
+// JSON for the flat objects the transcription endpoint returns.
+char *json_string_field(const char *json, const char *key) {
+    size_t key_len = strlen(key);
+    const char *p = json;
+
+    while ((p = strchr(p, '"'))) {
+        const char *name = p + 1;
+        const char *end = name;
+        while (*end && *end != '"') end += *end == '\\' && end[1] ? 2 : 1;
+        if (!*end) return NULL;
+        p = end + 1;
+        if ((size_t)(end - name) != key_len || memcmp(name, key, key_len) != 0) continue;
+
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p != ':') continue;
+        p++;
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p != '"') return NULL;
+        p++;
+
+        // Escapes never grow the text
+        char *out = malloc(strlen(p) + 1), *o = out;
+        if (!out) return NULL;
+        while (*p && *p != '"') {
+            if (*p != '\\') {
+                *o++ = *p++;
+                continue;
+            }
+            p++;
+            uint32_t cp, low;
+            switch (*p) {
+                case 'n': *o++ = '\n'; break;
+                case 't': *o++ = '\t'; break;
+                case 'r': *o++ = '\r'; break;
+                case 'b': *o++ = '\b'; break;
+                case 'f': *o++ = '\f'; break;
+                case 'u':
+                    if (hex4(p + 1, &cp) < 0) goto invalid;
+                    p += 4;
+                    if (cp >= 0xd800 && cp < 0xdc00 && p[1] == '\\' && p[2] == 'u' &&
+                        hex4(p + 3, &low) == 0 && low >= 0xdc00 && low < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                    o += utf8_put(o, cp);
+                    break;
+                case 0: goto invalid;
+                default: *o++ = *p; break; // \" \\ \/
+            }
+            p++;
+        }
+        if (*p != '"') goto invalid;
+        *o = 0;
+        return out;
+    invalid:
+        free(out);
+        return NULL;
+    }
+    return NULL;
+}
+
+static void report(struct transcript_job *job) {
+    job->done_ns = now_ns();
+    pthread_mutex_lock(&lock);
+    job->next = done;
+    done = job;
+    pthread_mutex_unlock(&lock);
+    eventfd_write(fd_done_jobs, 1);
+}
+
+// One HTTP request for job: the primary, or the hedge sent to the second
+// endpoint and model. NULL if out of memory.
+static struct active *start_request(struct transcript_job *job, int hedge) {
+    struct active *a = calloc(1, sizeof(*a));
+    CURL *easy = curl_easy_init();
+    if (!a || !easy) {
+        free(a);
+        if (easy) curl_easy_cleanup(easy);
+        return NULL;
+    }
+    a->job = job;
+    a->easy = easy;
+    a->hedge = hedge;
+    a->start_ns = now_ns();
+    const char *key = hedge ? job->hedge_key : job->api_key;
+
+    if (!job->warm_up) {
+        a->mime = curl_mime_init(easy);
+        curl_mimepart *part = curl_mime_addpart(a->mime);
+        curl_mime_name(part, "file");
+        if (job->streaming) {
+            // Unknown size: curl sends the body with chunked encoding
+            curl_mime_data_cb(part, -1, read_upload, NULL, NULL, a);
+            a->next_stream = streams;
+            streams = a;
+        } else {
+            curl_mime_data(part, (const char *)job->audio, job->audio_len);
+            curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, upload_progress);
+            curl_easy_setopt(easy, CURLOPT_XFERINFODATA, a);
+            curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+        }
+        curl_mime_filename(part, "xhisper.flac");
+        curl_mime_type(part, "audio/flac");
+        part = curl_mime_addpart(a->mime);
+        curl_mime_name(part, "model");
+        curl_mime_data(part, hedge ? job->hedge_model : job->model, CURL_ZERO_TERMINATED);
+        if (job->prompt[0]) {
+            part = curl_mime_addpart(a->mime);
+            curl_mime_name(part, "prompt");
+            curl_mime_data(part, job->prompt, CURL_ZERO_TERMINATED);
+        }
+        curl_easy_setopt(easy, CURLOPT_MIMEPOST, a->mime);
+    } else {
+        curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+    }
+
+    // Without "Expect: 100-continue" large uploads start at once instead of
+    // waiting a round trip (or curl's 1 s timeout) for the server's go-ahead
+    a->headers = curl_slist_append(NULL, "Expect:");
+    if (key[0]) {
+        char auth[TRANSCRIBE_FIELD_MAX + 32];
+        snprintf(auth, sizeof(auth), "Authorization: Bearer %s", key);
+        a->headers = curl_slist_append(a->headers, auth);
+    }
+
+    curl_easy_setopt(easy, CURLOPT_URL, hedge ? job->hedge_url : job->url);
+    curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    if (ca_file) curl_easy_setopt(easy, CURLOPT_CAINFO, ca_file);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, a->headers);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, append_response);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &a->body);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, response_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, a);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, a);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_multi_add_handle(multi, easy);
+    return a;
+}
+
+// Take a request out of the multi handle and the worker's lists. A
+// request still running is cancelled.
+static void end_request(struct active *a) {
+    for (struct active **p = &streams; *p; p = &(*p)->next_stream) {
+        if (*p == a) {
+            *p = a->next_stream;
+            break;
+        }
+    }
+    for (struct active **p = &hedge_waiting; *p; p = &(*p)->next_wait) {
+        if (*p == a) {
+            *p = a->next_wait;
+            break;
+        }
+    }
+    double ms = (now_ns() - a->start_ns) / 1e6;
+    if (a->hedge) a->job->hedge_ms = ms;
+    else a->job->primary_ms = ms;
+
+    curl_multi_remove_handle(multi, a->easy);
+    curl_easy_cleanup(a->easy);
+    curl_mime_free(a->mime);
+    curl_slist_free_all(a->headers);
+    free(a->body.data);
+    free(a);
+}
+
+static void start_job(struct transcript_job *job) {
+    struct active *a = start_request(job, 0);
+    if (!a) {
+        job->text = strdup("out of memory");
+        report(job);
+        return;
+    }
+    if (job->hedge_after_ms > 0 && !job->warm_up && !job->streaming) {
+        a->next_wait = hedge_waiting;
+        hedge_waiting = a;
+    }
+}
+
+// Send the hedge for the job of primary request a, which has had no good
+// answer in time
+static void start_hedge(struct active *a) {
+    struct transcript_job *job = a->job;
+    for (struct active **p = &hedge_waiting; *p; p = &(*p)->next_wait) {
+        if (*p == a) {
+            *p = a->next_wait;
+            break;
+        }
+    }
+    struct active *hedge = start_request(job, 1);
+    if (!hedge) return;
+    job->hedged = 1;
+    job->hedge_sent_ms = (now_ns() - a->start_ns) / 1e6;
+    hedge->twin = a;
+    a->twin = hedge;
+}
+
+static void finish_request(CURL *easy, CURLcode result) {
+    struct active *a;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&a);
+    struct transcript_job *job = a->job;
+
+    long status = 0;
+    int ok = 0;
+    char *text = NULL;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    if (result != CURLE_OK) {
+        text = strdup(curl_easy_strerror(result));
+    } else if (job->warm_up) {
+        ok = 1; // any answer means the connection is up
+    } else if (status != 200) {
+        char *message = a->body.data ? json_string_field(a->body.data, "message") : NULL;
+        size_t len = 64 + (message ? strlen(message) : 0);
+        text = malloc(len);
+        if (text) snprintf(text, len, "HTTP %ld%s%s", status, message ? ": " : "", message ? message : "");
+        free(message);
+    } else {
+        text = a->body.data ? json_string_field(a->body.data, "text") : NULL;
+        ok = text != NULL;
+        if (!ok) text = strdup("no text in the response");
+    }
+
+    // A failed request leaves the job to its twin; a primary that fails
+    // before its deadline sends the hedge at once
+    if (!ok && !a->twin && !a->hedge && !job->hedged && job->hedge_after_ms > 0 &&
+        !job->warm_up && !job->streaming) {
+        start_hedge(a);
+    }
+    if (!ok && a->twin) {
+        a->twin->twin = NULL;
+        free(text);
+        end_request(a);
+        return;
+    }
+
+    curl_off_t connect_us = 0, tls_us = 0, pretransfer_us = 0;
+    job->http_status = status;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &job->new_connections);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+    curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us);
+    if (job->new_connections) job->connect_ms = (tls_us > connect_us ? tls_us : connect_us) / 1e3;
+    if (pretransfer_us) job->upload_start_ns = a->start_ns + pretransfer_us * 1000;
+    job->upload_end_ns = a->upload_end_ns;
+    job->first_byte_ns = a->first_byte_ns;
+    job->ok = ok;
+    job->text = text;
+    job->hedge_won = a->hedge;
+
+    if (a->twin) end_request(a->twin); // the slower one is not needed any more
+    end_request(a);
+    report(job);
+}
+
+static void *transcribe_worker(void *arg) {
+    (void)arg;
+    int applied = 0;
+
+    while (1) {
+        // Jobs beyond the limit wait inside curl for a free connection
+        int limit = atomic_load_explicit(&connections, memory_order_relaxed);
+        if (limit != applied) {
+            curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)limit);
+            curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)limit);
+            applied = limit;
+        }
+
+        pthread_mutex_lock(&lock);
+        struct transcript_job *jobs = submitted;
+        submitted = NULL;
+        pthread_mutex_unlock(&lock);
+
+        // Start in submission order
+        struct transcript_job *ordered = NULL;
+        while (jobs) {
+            struct transcript_job *next = jobs->next;
+            jobs->next = ordered;
+            ordered = jobs;
+            jobs = next;
+        }
+        while (ordered) {
+            struct transcript_job *next = ordered->next;
+            start_job(ordered);
+            ordered = next;
+        }
+
+        // Uploads that ran dry go on once more has been appended
+        pthread_mutex_lock(&lock);
+        for (struct active *a = streams; a; a = a->next_stream) {
+            struct transcript_job *job = a->job;
+            if (a->paused && (job->audio_sent < job->audio_len || job->audio_complete)) a->paused = -1;
+        }
+        pthread_mutex_unlock(&lock);
+        for (struct active *a = streams; a; a = a->next_stream) {
+            if (a->paused == -1) {
+                a->paused = 0;
+                curl_easy_pause(a->easy, CURLPAUSE_CONT);
+            }
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg == CURLMSG_DONE) finish_request(msg->easy_handle, msg->data.result);
+        }
+
+        // Hedge requests past their deadline; sleep until the next one
+        uint64_t now = now_ns();
+        int timeout_ms = 1000;
+        for (struct active *a = hedge_waiting, *next; a; a = next) {
+            next = a->next_wait;
+            uint64_t deadline = a->start_ns + (uint64_t)(a->job->hedge_after_ms * 1e6);
+            if (now >= deadline) {
+                start_hedge(a);
+                timeout_ms = 0;
+            } else if ((deadline - now) / 1000000 + 1 < (uint64_t)timeout_ms) {
+                timeout_ms = (deadline - now) / 1000000 + 1;
+            }
+        }
+        curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+    }
+
+    return NULL;
+}
+
+// Decode local jobs, oldest first; each one has every core
+static void *local_worker(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (!local_submitted) pthread_cond_wait(&local_wake, &lock);
+        struct transcript_job **oldest = &local_submitted;
+        while ((*oldest)->next) oldest = &(*oldest)->next;
+        struct transcript_job *job = *oldest;
+        *oldest = NULL;
+        pthread_mutex_unlock(&lock);
+
+        uint64_t start = now_ns();
+        char *error = NULL;
+        job->text = localwhisper_run(job->pcm, job->pcm_n, job->prompt, &error);
+        job->primary_ms = (now_ns() - start) / 1e6;
+        job->ok = job->text != NULL;
+        if (!job->ok) job->text = error;
+        report(job);
+    }
+
+    return NULL;
+}
+
+// Start the worker; finished jobs are signalled on the fd_notify eventfd
+int transcribe_start(int fd_notify, int max_connections) {
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return -1;
+    multi = curl_multi_init();
+    share = curl_share_init();
+    if (!multi || !share) return -1;
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    fd_done_jobs = fd_notify;
+    transcribe_set_connections(max_connections);
+
+    pthread_t worker, local;
+    if (pthread_create(&worker, NULL, transcribe_worker, NULL) != 0) return -1;
+    pthread_detach(worker);
+    if (pthread_create(&local, NULL, local_worker, NULL) != 0) return -1;
+    pthread_detach(local);
+    return 0;
+}
+
+// How many requests may run at once; takes effect with the next job
+void transcribe_set_connections(int max_connections) {
+    atomic_store_explicit(&connections, max_connections > 0 ? max_connections : 1,
+                          memory_order_relaxed);
+    if (multi) curl_multi_wakeup(multi);
+}
+
+// Trust the certificates in path instead of the system store, e.g. for a
+// local test server. Set before transcribe_start.
+void transcribe_set_ca_file(const char *path) {
+    ca_file = path;
+}
+
+void transcribe_submit(struct transcript_job *job) {
+    job->submit_ns = now_ns();
+    pthread_mutex_lock(&lock);
+    if (job->local) {
+        job->next = local_submitted;
+        local_submitted = job;
+        pthread_cond_signal(&local_wake);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    job->next = submitted;
+    submitted = job;
+    pthread_mutex_unlock(&lock);
+    curl_multi_wakeup(multi);
+}
+
+// Add the next bytes of a submitted streaming job's audio; last ends the
+// upload. The job may still be appended to after it finished early, until
+// the caller has taken it back with transcribe_take_done.
+int transcribe_append(struct transcript_job *job, const uint8_t *data, size_t len, int last) {
+    int err = 0;
+    pthread_mutex_lock(&lock);
+    if (job->audio_len + len > job->audio_cap) {
+        size_t cap = job->audio_cap ? job->audio_cap : 65536;
+        while (cap < job->audio_len + len) cap *= 2;
+        uint8_t *audio = realloc(job->audio, cap);
+        if (audio) {
+            job->audio = audio;
+            job->audio_cap = cap;
+        } else {
+            err = -1;
+            len = 0;
+        }
+    }
+    if (len) memcpy(job->audio + job->audio_len, data, len);
+    job->audio_len += len;
+    if (last) job->audio_complete = 1;
+    pthread_mutex_unlock(&lock);
+    curl_multi_wakeup(multi);
+    return err;
+}
+
+// Bytes of a streaming job's audio that have gone out so far
+size_t transcribe_uploaded(struct transcript_job *job) {
+    pthread_mutex_lock(&lock);
+    size_t sent = job->audio_sent;
+    pthread_mutex_unlock(&lock);
+    return sent;
+}
+
+// Finished jobs in completion order, as a list linked through next
+struct transcript_job *transcribe_take_done(void) {
+    pthread_mutex_lock(&lock);
+    struct transcript_job *jobs = done;
+    done = NULL;
+    pthread_mutex_unlock(&lock);
+
+    struct transcript_job *ordered = NULL;
+    while (jobs) {
+        struct transcript_job *next = jobs->next;
+        jobs->next = ordered;
+        ordered = jobs;
+        jobs = next;
+    }
+    return ordered;
+}
+
+void transcribe_free(struct transcript_job *job) {
+    free(job->audio);
+    free(job->pcm);
+    free(job->text);
+    free(job);
+}
+
+#define QUIET_FRAMES 5 // a cut goes in the middle of the quietest 100 ms
+
+// Split n samples into count chunks, cutting at the quietest spot within
+// CHUNK_SEARCH_MS of each even split. Chunks after the first reach back
+// CHUNK_OVERLAP_MS over the cut. out must hold count chunks.
+size_t plan_chunks(const int16_t *pcm, size_t n, uint32_t rate, size_t count, struct chunk *out) {
+    const struct vad_impl *impl = vad_best_impl();
+    size_t overlap = (size_t)rate * CHUNK_OVERLAP_MS / 1000;
+    size_t search = (size_t)rate * CHUNK_SEARCH_MS / 1000;
+    size_t prev_cut = 0;
+
+    if (count < 1) count = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t cut = n;
+        if (i + 1 < count) {
+            size_t ideal = n * (i + 1) / count;
+            size_t lo = ideal > search ? ideal - search : 0;
+            size_t hi = ideal + search < n ? ideal + search : n;
+            if (lo < prev_cut + overlap) lo = prev_cut + overlap;
+
+            uint64_t window[QUIET_FRAMES] = {0}, sum = 0, best = UINT64_MAX;
+            size_t frames = 0;
+            cut = ideal > prev_cut ? ideal : prev_cut;
+            for (size_t f = lo; f + VAD_FRAME <= hi; f += VAD_FRAME, frames++) {
+                uint64_t energy;
+                uint32_t crossings;
+                impl->analyze(pcm + f, VAD_FRAME, &energy, &crossings);
+                sum += energy - window[frames % QUIET_FRAMES];
+                window[frames % QUIET_FRAMES] = energy;
+                if (frames + 1 >= QUIET_FRAMES && sum < best) {
+                    best = sum;
+                    cut = f + VAD_FRAME - QUIET_FRAMES * VAD_FRAME / 2;
+                }
+            }
+        }
+        out[i].start = i && prev_cut > overlap ? prev_cut - overlap : 0;
+        out[i].end = cut;
+        prev_cut = cut;
+    }
+    return count;
+}
+
+struct word {
+    size_t start;
+    size_t len;
+};
+
+#define STITCH_WORDS 8  // how far back and ahead overlapping text is looked for
+#define STITCH_SKIP 2   // half words at a chunk edge that may be ignored
+
+static int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// ASCII punctuation is ignored and letters compared without case, so
+// "Hello," at the end of one chunk matches "hello" at the start of the next
+static int is_ignored(char c) {
+    return (unsigned char)c < 0x80 && !(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'z') &&
+           !(c >= 'A' && c <= 'Z');
+}
+
+static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Length of the word once ignored characters are left out
+static size_t word_weight(const char *s, struct word w) {
+    size_t n = 0;
+    for (size_t i = 0; i < w.len; i++) n += !is_ignored(s[w.start + i]);
+    return n;
+}
+
+static int word_eq(const char *a, struct word wa, const char *b, struct word wb) {
+    size_t i = 0, j = 0;
+    while (1) {
+        while (i < wa.len && is_ignored(a[wa.start + i])) i++;
+        while (j < wb.len && is_ignored(b[wb.start + j])) j++;
+        if (i == wa.len || j == wb.len) return i == wa.len && j == wb.len;
+        if (lower(a[wa.start + i]) != lower(b[wb.start + j])) return 0;
+        i++;
+        j++;
+    }
+}
+
+static size_t last_words(const char *s, size_t len, struct word *w) {
+    size_t count = 0, end = len;
+    while (count < STITCH_WORDS) {
+        while (end && is_space(s[end - 1])) end--;
+        if (!end) break;
+        size_t start = end;
+        while (start && !is_space(s[start - 1])) start--;
+        w[count++] = (struct word){start, end - start};
+        end = start;
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+        struct word t = w[i];
+        w[i] = w[count - 1 - i];
+        w[count - 1 - i] = t;
+    }
+    return count;
+}
+
+static size_t first_words(const char *s, size_t len, struct word *w) {
+    size_t count = 0, start = 0;
+    while (count < STITCH_WORDS) {
+        while (start < len && is_space(s[start])) start++;
+        if (start == len) break;
+        size_t end = start;
+        while (end < len && !is_space(s[end])) end++;
+        w[count++] = (struct word){start, end - start};
+        start = end;
+    }
+    return count;
+}
+
+// Drop the text the end of out and the start of next have in common.
+// Looks for the longest run of words ending the first that also starts
+// the second, allowing a couple of half words on either side of it. A
+// single word must be at least four letters and match without half words,
+// and next must keep some words: a chunk is far longer than the overlap.
+static void remove_overlap(char *out, size_t *out_len, const char **next, size_t *next_len) {
+    struct word tail[STITCH_WORDS], head[STITCH_WORDS];
+    size_t nt = last_words(out, *out_len, tail);
+    size_t nh = first_words(*next, *next_len, head);
+
+    for (size_t k = nt < nh ? nt : nh; k > 0; k--) {
+        for (size_t skip_tail = 0; skip_tail <= STITCH_SKIP; skip_tail++) {
+            for (size_t skip_head = 0; skip_head <= STITCH_SKIP; skip_head++) {
+                if (k + skip_tail > nt || k + skip_head >= nh) continue;
+                if (k == 1 && (skip_tail || skip_head)) continue;
+                size_t t0 = nt - skip_tail - k, i = 0;
+                while (i < k && word_eq(out, tail[t0 + i], *next, head[skip_head + i])) i++;
+                if (i < k || (k == 1 && word_weight(out, tail[t0]) < 4)) continue;
+
+                if (skip_tail) {
+                    *out_len = tail[nt - skip_tail].start;
+                    while (*out_len && is_space(out[*out_len - 1])) (*out_len)--;
+                }
+                size_t skip = k + skip_head < nh ? head[k + skip_head].start : *next_len;
+                *next += skip;
+                *next_len -= skip;
+                return;
+            }
+        }
+    }
+}
+
+// Join transcripts in order, separated by single spaces. With overlapping
+// set they come from chunks that share audio at their edges, and the
+// repeated words are removed.
+char *join_transcripts(char *const *texts, size_t n, int overlapping) {
+    size_t cap = 1;
+    for (size_t i = 0; i < n; i++) cap += (texts[i] ? strlen(texts[i]) : 0) + 1;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *t = texts[i] ? texts[i] : "";
+        size_t t_len = strlen(t);
+        while (t_len && is_space(*t)) t++, t_len--;
+        while (t_len && is_space(t[t_len - 1])) t_len--;
+
+        if (overlapping && len) remove_overlap(out, &len, &t, &t_len);
+        while (t_len && is_space(*t)) t++, t_len--;
+        if (!t_len) continue;
+        if (len) out[len++] = ' ';
+        memcpy(out + len, t, t_len);
+        len += t_len;
+    }
+    out[len] = 0;
+    return out;
+}
@@ -0,0 +1,96 @@
+/*
+ * xhisper - Whisper for Linux
+ * Transcription requests to an OpenAI-style /audio/transcriptions endpoint
+ */
+
+#ifndef XHISPER_TRANSCRIBE_H
+#define XHISPER_TRANSCRIBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRANSCRIBE_URL_DEFAULT "https://api.groq.com/openai/v1/audio/transcriptions"
+#define TRANSCRIBE_FIELD_MAX 1024
+#define TRANSCRIBE_CONNECTIONS_DEFAULT 4
+
+// Long recordings are cut at the quietest spot near evenly spaced points
+// and sent as parallel requests. Each chunk after the first starts
+// CHUNK_OVERLAP_MS before its cut, so a word cut in half is still heard
+// whole once; the duplicate text is removed when stitching.
+#define CHUNK_MIN_S 10
+#define CHUNK_MAX_S 120
+#define CHUNK_OVERLAP_MS 1000
+#define CHUNK_SEARCH_MS 3000 // how far from the even split a cut may move
+
+// One audio segment to transcribe. The caller fills in the request half
+// and hands the job over with transcribe_submit; the worker fills in the
+// result and returns it through transcribe_take_done. A warm-up job has
+// no audio: it sends a HEAD request so that a connection to the endpoint
+// is open, and stays pooled, before the first segment needs it. A
+// streaming job is submitted with no audio; the rest of its FLAC stream
+// follows through transcribe_append while the request is under way, sent
+// with chunked transfer encoding. With hedge_after_ms set, a request
+// still without a good answer after that long is duplicated to hedge_url
+// with hedge_model and hedge_key, and whichever answers well first wins.
+// A local job is decoded from pcm by the whisper.cpp model in this
+// process instead; its primary_ms is the decoding time.
+struct transcript_job {
+    struct transcript_job *next;
+    int warm_up;
+    int streaming;
+    int local;
+    int16_t *pcm;              // local: 16 kHz mono samples, freed with the job
+    size_t pcm_n;
+    uint32_t session;          // recording session the segment belongs to
+    uint32_t index;            // segment number within the session
+    uint8_t *audio;            // FLAC stream, freed with the job
+    size_t audio_len;
+    size_t audio_cap;          // streaming: allocated size of audio
+    size_t audio_sent;         // streaming: bytes handed to curl so far
+    int audio_complete;        // streaming: the last bytes have been appended
+    double audio_s;
+    char url[TRANSCRIBE_FIELD_MAX];
+    char api_key[TRANSCRIBE_FIELD_MAX];
+    char model[64];
+    char prompt[TRANSCRIBE_FIELD_MAX];
+    double hedge_after_ms;     // 0 for no hedge
+    char hedge_url[TRANSCRIBE_FIELD_MAX];
+    char hedge_key[TRANSCRIBE_FIELD_MAX];
+    char hedge_model[64];
+
+    int ok;
+    long http_status;
+    char *text;                // transcript, or an error message
+    long new_connections;      // 0 when a pooled connection was reused
+    double connect_ms;         // TCP and TLS setup, when not reused
+    uint64_t submit_ns;
+    uint64_t upload_start_ns;  // the request was on its way (0 if unknown)
+    uint64_t upload_end_ns;    // the body was sent in full
+    uint64_t first_byte_ns;    // the response started
+    uint64_t done_ns;          // the response was parsed
+    int hedged;                // the hedge was sent
+    int hedge_won;             // the answer is the hedge's
+    double hedge_sent_ms;      // after the primary was sent
+    double primary_ms;         // until the primary answered, failed or was cancelled
+    double hedge_ms;           // the same for the hedge
+};
+
+// Sample range [start, end) of one chunk
+struct chunk {
+    size_t start;
+    size_t end;
+};
+
+int transcribe_start(int fd_notify, int connections);
+void transcribe_set_connections(int connections);
+void transcribe_set_ca_file(const char *path);
+void transcribe_submit(struct transcript_job *job);
+int transcribe_append(struct transcript_job *job, const uint8_t *data, size_t len, int last);
+size_t transcribe_uploaded(struct transcript_job *job);
+struct transcript_job *transcribe_take_done(void);
+void transcribe_free(struct transcript_job *job);
+char *json_string_field(const char *json, const char *key);
+size_t plan_chunks(const int16_t *pcm, size_t n, uint32_t rate, size_t count, struct chunk *out);
+char *join_transcripts(char *const *texts, size_t n, int overlapping);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * xhisper - Whisper for Linux
+ * Benchmark for chunked transcription: wall-clock time of one long
+ * recording sent as 1, 2, 4 and 8 parallel chunks. Then for hedging:
+ * latency percentiles of many short requests to an endpoint with a slow
+ * tail, without a hedge and with one sent to a second endpoint at the
+ * measured 90th percentile.
+ *
+ * Usage: transcribebench [--url u] [--delay-ms n] [--rtf x] [--seconds s] [recording]
+ *
+ * Without --url a mockwhisper is started next to this binary, with
+ * --delay-ms of latency per request and --rtf seconds of decoding per
+ * second of audio, and the hedging run is skipped; it always uses two
+ * mockwhispers of its own. Also checks that overlapping transcripts are
+ * stitched.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "benchaudio.h"
+#include "flac.h"
+#include "transcribe.h"
+
+#define MOCK_PORT "8091"
+#define MOCK_URL "http://127.0.0.1:" MOCK_PORT "/openai/v1/audio/transcriptions"
+#define HEDGE_PORT "8092"
+#define HEDGE_URL "http://127.0.0.1:" HEDGE_PORT "/openai/v1/audio/transcriptions"
+#define HEDGE_REQUESTS 100
+#define HEDGE_IN_FLIGHT 4
+#define HEDGE_CLIP_S 5
+
+// The hedging run's endpoints: the primary is quick but one request in
+// ten takes 1.5 s longer; the second endpoint is a little slower, no tail
+static const char *const primary_mock[] = {"--delay-ms", "150", "--jitter-ms", "100",
+                                           "--tail", "0.1:1500", "--seed", "1", NULL};
+static const char *const second_mock[] = {"--delay-ms", "250", "--jitter-ms", "100",
+                                          "--seed", "2", NULL};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Start mockwhisper from this binary's directory with the NULL-terminated
+// options and wait until it listens
+pid_t start_mock(const char *self, const char *port, const char *const *options) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%.*smockwhisper",
+             strrchr(self, '/') ? (int)(strrchr(self, '/') - self + 1) : 0, self);
+    char *argv[16] = {path, "--port", (char *)port};
+    for (size_t i = 0; options[i] && i + 4 < sizeof(argv) / sizeof(argv[0]); i++) {
+        argv[i + 3] = (char *)options[i];
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err) {
+        fprintf(stderr, "failed to start %s: %s\n", path, strerror(err));
+        close(fds[0]);
+        return -1;
+    }
+
+    // The first line says it is listening; later ones are not read
+    char line[256];
+    FILE *out = fdopen(fds[0], "r");
+    if (!fgets(line, sizeof(line), out) || !strstr(line, "listening")) {
+        fprintf(stderr, "%s did not start\n", path);
+        fclose(out);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+int check_stitching() {
+    static const char *cases[][3] = {
+        {"the quick brown fox jumps", "fox jumps over the lazy dog",
+         "the quick brown fox jumps over the lazy dog"},
+        {"see you at the stat", "at the station tomorrow", "see you at the station tomorrow"},
+        {"Hello, world.", "world. How are you?", "Hello, world. How are you?"},
+        {"it was fine", "ine. it was fine really", "it was fine really"},
+        {"one two", "three four", "one two three four"},
+        {"I said no", "no way", "I said no no way"},
+        {"[14.36 s]", "[14.36 s]", "[14.36 s] [14.36 s]"},
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char *texts[2] = {(char *)cases[i][0], (char *)cases[i][1]};
+        char *joined = join_transcripts(texts, 2, 1);
+        if (!joined || strcmp(joined, cases[i][2]) != 0) {
+            printf("stitch FAILED: \"%s\" + \"%s\" gave \"%s\"\n", cases[i][0], cases[i][1],
+                   joined ? joined : "(null)");
+            failed = 1;
+        }
+        free(joined);
+    }
+    if (!failed) printf("stitching: %zu cases ok\n", sizeof(cases) / sizeof(cases[0]));
+    return failed ? -1 : 0;
+}
+
+// Send pcm as count chunks over count connections; wall-clock ms, or < 0
+double run(const int16_t *pcm, size_t n, size_t count, const char *url, int fd_notify) {
+    struct chunk chunks[64];
+    plan_chunks(pcm, n, BENCH_RATE, count, chunks);
+    transcribe_set_connections(count);
+
+    // Encoded up front: the daemon has the stream ready when recording stops
+    struct transcript_job *jobs[64];
+    for (size_t i = 0; i < count; i++) {
+        struct flac_encoder enc = {0};
+        flac_init(&enc, BENCH_RATE);
+        flac_encode(&enc, pcm + chunks[i].start, chunks[i].end - chunks[i].start);
+        flac_finish(&enc);
+
+        jobs[i] = calloc(1, sizeof(*jobs[i]));
+        jobs[i]->index = i;
+        jobs[i]->audio = enc.out;
+        jobs[i]->audio_len = enc.out_len;
+        jobs[i]->audio_s = (double)enc.total_samples / BENCH_RATE;
+        snprintf(jobs[i]->url, sizeof(jobs[i]->url), "%s", url);
+        snprintf(jobs[i]->model, sizeof(jobs[i]->model), "whisper-large-v3");
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) transcribe_submit(jobs[i]);
+
+    char *texts[64] = {0};
+    size_t done = 0;
+    int ok = 1;
+    double slowest_ms = 0;
+    while (done < count) {
+        eventfd_t v;
+        eventfd_read(fd_notify, &v);
+        for (struct transcript_job *job = transcribe_take_done(), *next; job; job = next) {
+            next = job->next;
+            double ms = (job->done_ns - job->submit_ns) / 1e6;
+            if (ms > slowest_ms) slowest_ms = ms;
+            if (!job->ok) {
+                fprintf(stderr, "chunk %u failed: %s\n", job->index, job->text);
+                ok = 0;
+            }
+            texts[job->index] = job->text;
+            job->text = NULL;
+            transcribe_free(job);
+            done++;
+        }
+    }
+    double wall_ms = (now_ns() - start) / 1e6;
+
+    char *joined = join_transcripts(texts, count, 1);
+    printf("%2zu chunks: %8.1f ms wall, slowest request %8.1f ms, text: %.60s%s\n", count,
+           wall_ms, slowest_ms, joined ? joined : "", joined && strlen(joined) > 60 ? "..." : "");
+    free(joined);
+    for (size_t i = 0; i < count; i++) free(texts[i]);
+    return ok ? wall_ms : -1;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// pct-th percentile of n sorted values
+double percentile(const double *sorted, size_t n, int pct) {
+    return sorted[(n - 1) * pct / 100];
+}
+
+// HEDGE_REQUESTS requests for the same clip, HEDGE_IN_FLIGHT at a time,
+// hedged after hedge_ms when that is > 0. Fills ms with the sorted
+// latencies; prints them and returns -1 if a request failed.
+int run_hedged(const uint8_t *audio, size_t len, double hedge_ms, int fd_notify, double *ms) {
+    char label[64] = "no hedge:";
+    if (hedge_ms > 0) snprintf(label, sizeof(label), "hedge at %.1f ms:", hedge_ms);
+    size_t submitted = 0, done = 0;
+    int hedges = 0, won = 0, ok = 1;
+    transcribe_set_connections(2 * HEDGE_IN_FLIGHT);
+
+    while (done < HEDGE_REQUESTS) {
+        while (submitted < HEDGE_REQUESTS && submitted - done < HEDGE_IN_FLIGHT) {
+            struct transcript_job *job = calloc(1, sizeof(*job));
+            job->audio = malloc(len);
+            memcpy(job->audio, audio, len);
+            job->audio_len = len;
+            job->index = submitted++;
+            snprintf(job->url, sizeof(job->url), "%s", MOCK_URL);
+            snprintf(job->model, sizeof(job->model), "whisper-large-v3-turbo");
+            job->hedge_after_ms = hedge_ms;
+            snprintf(job->hedge_url, sizeof(job->hedge_url), "%s", HEDGE_URL);
+            snprintf(job->hedge_model, sizeof(job->hedge_model), "whisper-large-v3");
+            transcribe_submit(job);
+        }
+
+        eventfd_t v;
+        eventfd_read(fd_notify, &v);
+        for (struct transcript_job *job = transcribe_take_done(), *next; job; job = next) {
+            next = job->next;
+            if (!job->ok) {
+                fprintf(stderr, "request %u failed: %s\n", job->index, job->text);
+                ok = 0;
+            }
+            hedges += job->hedged;
+            won += job->hedge_won;
+            ms[done++] = (job->done_ns - job->submit_ns) / 1e6;
+            transcribe_free(job);
+        }
+    }
+
+    qsort(ms, HEDGE_REQUESTS, sizeof(*ms), compare_double);
+    printf("%-20s p50 %6.1f ms, p90 %6.1f ms, p99 %6.1f ms, max %6.1f ms", label,
+           percentile(ms, HEDGE_REQUESTS, 50), percentile(ms, HEDGE_REQUESTS, 90),
+           percentile(ms, HEDGE_REQUESTS, 99), ms[HEDGE_REQUESTS - 1]);
+    if (hedge_ms > 0) printf(", %d hedges sent, %d won", hedges, won);
+    printf("\n");
+    return ok ? 0 : -1;
+}
+
+int bench_hedging(const char *self, const int16_t *pcm, size_t n, int fd_notify) {
+    pid_t primary = start_mock(self, MOCK_PORT, primary_mock);
+    pid_t second = primary > 0 ? start_mock(self, HEDGE_PORT, second_mock) : -1;
+    int ret = -1;
+    if (second < 0) goto out;
+
+    struct flac_encoder enc = {0};
+    flac_init(&enc, BENCH_RATE);
+    flac_encode(&enc, pcm, n < HEDGE_CLIP_S * BENCH_RATE ? n : HEDGE_CLIP_S * BENCH_RATE);
+    flac_finish(&enc);
+    printf("hedging: %d requests of %.1f s, %d at a time; primary 150-250 ms, 10%% 1.5 s slower, "
+           "second endpoint 250-350 ms\n", HEDGE_REQUESTS, (double)enc.total_samples / BENCH_RATE,
+           HEDGE_IN_FLIGHT);
+
+    // The deadline is the 90th percentile of the unhedged run
+    double ms[HEDGE_REQUESTS];
+    if (run_hedged(enc.out, enc.out_len, 0, fd_notify, ms) == 0) {
+        ret = run_hedged(enc.out, enc.out_len, percentile(ms, HEDGE_REQUESTS, 90), fd_notify, ms);
+    }
+    flac_free(&enc);
+
+out:
+    if (primary > 0) {
+        kill(primary, SIGTERM);
+        waitpid(primary, NULL, 0);
+    }
+    if (second > 0) {
+        kill(second, SIGTERM);
+        waitpid(second, NULL, 0);
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *url = NULL, *delay_ms = "200", *rtf = "0.02", *file = NULL;
+    unsigned int seconds = 300;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--url") == 0 && i + 1 < argc) {
+            url = argv[++i];
+        } else if (strcmp(argv[i], "--delay-ms") == 0 && i + 1 < argc) {
+            delay_ms = argv[++i];
+        } else if (strcmp(argv[i], "--rtf") == 0 && i + 1 < argc) {
+            rtf = argv[++i];
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            fprintf(stderr, "Usage: transcribebench [--url u] [--delay-ms n] [--rtf x] "
+                            "[--seconds s] [recording]\n");
+            return 1;
+        }
+    }
+
+    if (check_stitching() < 0) return 1;
+
+    size_t n;
+    int16_t *pcm = file ? load_pcm(file, &n) : synthetic_pcm(seconds, &n);
+    if (!pcm) return 1;
+
+    pid_t mock = 0;
+    if (!url) {
+        const char *options[] = {"--delay-ms", delay_ms, "--rtf", rtf, NULL};
+        mock = start_mock(argv[0], MOCK_PORT, options);
+        if (mock < 0) return 1;
+        url = MOCK_URL;
+        printf("mock server: %s ms per request, %s s per second of audio\n", delay_ms, rtf);
+    }
+
+    int fd_notify = eventfd(0, EFD_CLOEXEC);
+    if (fd_notify < 0 || transcribe_start(fd_notify, 1) < 0) {
+        fprintf(stderr, "failed to start transcription worker\n");
+        return 1;
+    }
+
+    printf("%s: %.1f s of audio\n", file ? file : "synthetic", (double)n / BENCH_RATE);
+    double serial_ms = 0;
+    int ret = 0;
+    for (size_t count = 1; count <= 8; count *= 2) {
+        if (count > 1 && n / count < CHUNK_MIN_S * BENCH_RATE) break;
+        double ms = run(pcm, n, count, url, fd_notify);
+        if (ms < 0) {
+            ret = 1;
+            break;
+        }
+        if (count == 1) serial_ms = ms;
+        else printf("          %.2fx faster than one request\n", serial_ms / ms);
+    }
+
+    if (mock > 0) {
+        kill(mock, SIGTERM);
+        waitpid(mock, NULL, 0);
+        if (!ret) ret = bench_hedging(argv[0], pcm, n, fd_notify) < 0;
+    }
+    free(pcm);
+    return ret;
+}
@@ -0,0 +1,218 @@
+/*
+ * xhisper - Whisper for Linux
+ * Voice activity detection and silence trimming for 16 kHz mono PCM
+ *
+ * A frame is speech when its energy is well above the tracked noise floor,
+ * or somewhat above it with many zero crossings (fricatives like "s" and
+ * "f" are quiet but noisy). The per-frame sums are vectorized with SSE2
+ * and AVX2; the scalar version is the reference and the fallback.
+ */
+
+#include <string.h>
+
+#include "vad.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VAD_X86 1
+#endif
+
+#define SPEECH_MIN_ENERGY 10000.0 // mean square, about -50 dBFS
+#define SPEECH_FLOOR_RATIO 8.0    // about 9 dB over the noise floor
+#define FRICATIVE_FLOOR_RATIO 3.0
+#define FRICATIVE_CROSSINGS (VAD_FRAME / 4)
+#define FLOOR_RISE 1.005          // per frame, doubles in about 3 s
+
+static void analyze_scalar(const int16_t *x, size_t n, uint64_t *energy, uint32_t *crossings) {
+    uint64_t e = 0;
+    uint32_t zc = 0;
+
+    for (size_t i = 0; i < n; i++) e += (uint32_t)(x[i] * x[i]);
+    for (size_t i = 1; i < n; i++) zc += (x[i - 1] ^ x[i]) < 0;
+
+    *energy = e;
+    *crossings = zc;
+}
+
+static int always(void) {
+    return 1;
+}
+
+#ifdef VAD_X86
+// Squares are summed in pairs by madd (at most 2^31, so unsigned) and
+// widened to 64 bits. A sign change between neighbours shows as a set top
+// bit in their xor; the all-ones masks are counted with a second madd.
+__attribute__((target("sse2")))
+static void analyze_sse2(const int16_t *x, size_t n, uint64_t *energy, uint32_t *crossings) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i minus_one = _mm_set1_epi16(-1);
+    __m128i e = zero, zc = zero;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i sq = _mm_madd_epi16(v, v);
+        e = _mm_add_epi64(e, _mm_unpacklo_epi32(sq, zero));
+        e = _mm_add_epi64(e, _mm_unpackhi_epi32(sq, zero));
+    }
+    uint64_t e_lanes[2];
+    _mm_storeu_si128((__m128i *)e_lanes, e);
+    uint64_t e_sum = e_lanes[0] + e_lanes[1];
+    for (; i < n; i++) e_sum += (uint32_t)(x[i] * x[i]);
+
+    size_t j = 0;
+    for (; j + 9 <= n; j += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(x + j));
+        __m128i b = _mm_loadu_si128((const __m128i *)(x + j + 1));
+        __m128i mask = _mm_srai_epi16(_mm_xor_si128(a, b), 15);
+        zc = _mm_add_epi32(zc, _mm_madd_epi16(mask, minus_one));
+    }
+    uint32_t zc_lanes[4];
+    _mm_storeu_si128((__m128i *)zc_lanes, zc);
+    uint32_t zc_sum = zc_lanes[0] + zc_lanes[1] + zc_lanes[2] + zc_lanes[3];
+    for (j++; j < n; j++) zc_sum += (x[j - 1] ^ x[j]) < 0;
+
+    *energy = e_sum;
+    *crossings = zc_sum;
+}
+
+__attribute__((target("avx2")))
+static void analyze_avx2(const int16_t *x, size_t n, uint64_t *energy, uint32_t *crossings) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i minus_one = _mm256_set1_epi16(-1);
+    __m256i e = zero, zc = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i sq = _mm256_madd_epi16(v, v);
+        e = _mm256_add_epi64(e, _mm256_unpacklo_epi32(sq, zero));
+        e = _mm256_add_epi64(e, _mm256_unpackhi_epi32(sq, zero));
+    }
+    uint64_t e_lanes[4];
+    _mm256_storeu_si256((__m256i *)e_lanes, e);
+    uint64_t e_sum = e_lanes[0] + e_lanes[1] + e_lanes[2] + e_lanes[3];
+    for (; i < n; i++) e_sum += (uint32_t)(x[i] * x[i]);
+
+    size_t j = 0;
+    for (; j + 17 <= n; j += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(x + j));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(x + j + 1));
+        __m256i mask = _mm256_srai_epi16(_mm256_xor_si256(a, b), 15);
+        zc = _mm256_add_epi32(zc, _mm256_madd_epi16(mask, minus_one));
+    }
+    uint32_t zc_lanes[8];
+    _mm256_storeu_si256((__m256i *)zc_lanes, zc);
+    uint32_t zc_sum = 0;
+    for (int k = 0; k < 8; k++) zc_sum += zc_lanes[k];
+    for (j++; j < n; j++) zc_sum += (x[j - 1] ^ x[j]) < 0;
+
+    *energy = e_sum;
+    *crossings = zc_sum;
+}
+
+static int has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// In order of preference, best last
+const struct vad_impl vad_impls[] = {
+    {"scalar", analyze_scalar, always},
+#ifdef VAD_X86
+    {"sse2", analyze_sse2, always},
+    {"avx2", analyze_avx2, has_avx2},
+#endif
+};
+
+const size_t vad_impl_count = sizeof(vad_impls) / sizeof(vad_impls[0]);
+
+const struct vad_impl *vad_best_impl(void) {
+    size_t i = vad_impl_count;
+    while (--i > 0 && !vad_impls[i].supported());
+    return &vad_impls[i];
+}
+
+static void emit(struct vad *v, const int16_t *x, size_t n) {
+    v->samples_out += n;
+    v->emit(v->ctx, x, n);
+}
+
+static int is_speech(struct vad *v, const int16_t *x, size_t n) {
+    uint64_t energy;
+    uint32_t crossings;
+    v->impl->analyze(x, n, &energy, &crossings);
+
+    double e = (double)energy / n;
+    double zc = (double)crossings * VAD_FRAME / n;
+
+    // The floor drops to any quieter frame at once and creeps up otherwise
+    if (v->samples_in == n || e < v->noise_floor) {
+        v->noise_floor = e;
+    } else if (v->noise_floor * FLOOR_RISE < e) {
+        v->noise_floor *= FLOOR_RISE;
+    }
+
+    double floor = v->noise_floor;
+    if (e > floor * SPEECH_FLOOR_RATIO && e > SPEECH_MIN_ENERGY) return 1;
+    return zc > FRICATIVE_CROSSINGS && e > floor * FRICATIVE_FLOOR_RATIO &&
+           e > SPEECH_MIN_ENERGY / 4;
+}
+
+static void process_frame(struct vad *v, const int16_t *x, size_t n) {
+    if (is_speech(v, x, n)) {
+        // Replay the held silence in order, then the speech
+        for (size_t i = 0; i < v->pad_count; i++) {
+            size_t slot = (v->pad_next + VAD_PAD_FRAMES - v->pad_count + i) % VAD_PAD_FRAMES;
+            emit(v, v->pad[slot], v->pad_len[slot]);
+        }
+        v->pad_count = 0;
+        emit(v, x, n);
+        v->since_speech = 0;
+        v->had_speech = 1;
+        return;
+    }
+
+    if (v->had_speech && v->since_speech < VAD_PAD_FRAMES) {
+        // Trailing pad, kept whether or not speech follows
+        emit(v, x, n);
+    } else {
+        if (v->had_speech && v->since_speech == VAD_PAD_FRAMES && v->pause) v->pause(v->ctx);
+        memcpy(v->pad[v->pad_next], x, n * sizeof(*x));
+        v->pad_len[v->pad_next] = n;
+        v->pad_next = (v->pad_next + 1) % VAD_PAD_FRAMES;
+        if (v->pad_count < VAD_PAD_FRAMES) v->pad_count++;
+    }
+    v->since_speech++;
+}
+
+void vad_init(struct vad *v, vad_emit_fn emit_fn, void *ctx) {
+    memset(v, 0, sizeof(*v));
+    v->impl = vad_best_impl();
+    v->emit = emit_fn;
+    v->ctx = ctx;
+}
+
+void vad_feed(struct vad *v, const int16_t *pcm, size_t n) {
+    while (n > 0) {
+        size_t take = VAD_FRAME - v->frame_len;
+        if (take > n) take = n;
+        memcpy(v->frame + v->frame_len, pcm, take * sizeof(*pcm));
+        v->frame_len += take;
+        v->samples_in += take;
+        pcm += take;
+        n -= take;
+
+        if (v->frame_len == VAD_FRAME) {
+            process_frame(v, v->frame, VAD_FRAME);
+            v->frame_len = 0;
+        }
+    }
+}
+
+// Classify the partial last frame; held silence is dropped
+void vad_finish(struct vad *v) {
+    if (v->frame_len) process_frame(v, v->frame, v->frame_len);
+    v->frame_len = 0;
+    v->pad_count = 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * xhisper - Whisper for Linux
+ * Voice activity detection and silence trimming for 16 kHz mono PCM
+ */
+
+#ifndef XHISPER_VAD_H
+#define XHISPER_VAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VAD_FRAME 320     // 20 ms at 16 kHz
+#define VAD_PAD_FRAMES 12 // silence kept next to speech, per side
+
+// Frame analysis, picked at runtime from the best the CPU supports
+struct vad_impl {
+    const char *name;
+    // Sum of squares and number of sign changes over n samples
+    void (*analyze)(const int16_t *x, size_t n, uint64_t *energy, uint32_t *crossings);
+    int (*supported)(void);
+};
+
+extern const struct vad_impl vad_impls[];
+extern const size_t vad_impl_count;
+const struct vad_impl *vad_best_impl(void);
+
+typedef void (*vad_emit_fn)(void *ctx, const int16_t *pcm, size_t n);
+typedef void (*vad_pause_fn)(void *ctx);
+
+// Streaming trimmer. Audio is classified in 20 ms frames; speech frames
+// are passed to emit at once, silence is held back. Leading and trailing
+// silence is cut to VAD_PAD_FRAMES frames and pauses to twice that.
+// If set, pause is called once the trailing pad of a phrase is emitted,
+// a natural place to cut the audio into segments.
+struct vad {
+    const struct vad_impl *impl;
+    vad_emit_fn emit;
+    vad_pause_fn pause;
+    void *ctx;
+    int16_t frame[VAD_FRAME];
+    size_t frame_len;
+    int16_t pad[VAD_PAD_FRAMES][VAD_FRAME]; // latest silence, a ring
+    size_t pad_len[VAD_PAD_FRAMES];
+    size_t pad_next;
+    size_t pad_count;
+    uint32_t since_speech; // silence frames since the last speech frame
+    int had_speech;
+    double noise_floor;    // mean square energy of background noise
+    uint64_t samples_in;
+    uint64_t samples_out;
+};
+
+void vad_init(struct vad *v, vad_emit_fn emit, void *ctx);
+void vad_feed(struct vad *v, const int16_t *pcm, size_t n);
+void vad_finish(struct vad *v);
+
+#endif
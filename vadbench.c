@@ -0,0 +1,98 @@
+/*
+ * xhisper - Whisper for Linux
+ * Benchmark for the voice activity detector: analysis speed of each
+ * implementation and how much audio the trimmer removes
+ *
+ * Usage: vadbench [-o trimmed.raw] [recording.wav|recording.raw ...]
+ * Input is 16 kHz mono s16. Without files a synthetic recording is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "benchaudio.h"
+#include "vad.h"
+
+#define RATE BENCH_RATE
+#define BENCH_MIN_NS 200000000ull
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static FILE *trimmed_out = NULL;
+
+void keep(void *ctx, const int16_t *pcm, size_t n) {
+    (void)ctx;
+    if (trimmed_out) fwrite(pcm, sizeof(*pcm), n, trimmed_out);
+}
+
+void bench(const char *name, const int16_t *pcm, size_t n) {
+    struct vad v;
+    vad_init(&v, keep, NULL);
+    uint64_t start = now_ns();
+    vad_feed(&v, pcm, n);
+    vad_finish(&v);
+    uint64_t trim_ns = now_ns() - start;
+
+    printf("%s: %.2f s in, %.2f s kept, %.1f%% removed, trimmed at %.0fx real time\n",
+           name, (double)n / RATE, (double)v.samples_out / RATE,
+           n ? 100.0 * (n - v.samples_out) / n : 0.0,
+           trim_ns ? (double)n / RATE / (trim_ns / 1e9) : 0.0);
+
+    for (size_t k = 0; k < vad_impl_count; k++) {
+        const struct vad_impl *impl = &vad_impls[k];
+        if (!impl->supported()) continue;
+
+        uint64_t samples = 0, sink = 0;
+        start = now_ns();
+        do {
+            for (size_t i = 0; i + VAD_FRAME <= n; i += VAD_FRAME) {
+                uint64_t energy;
+                uint32_t crossings;
+                impl->analyze(pcm + i, VAD_FRAME, &energy, &crossings);
+                sink += energy + crossings;
+                samples += VAD_FRAME;
+            }
+        } while (samples && now_ns() - start < BENCH_MIN_NS);
+        double secs = (now_ns() - start) / 1e9;
+
+        printf("  %-8s %8.1f Msamples/s%s\n", impl->name, samples / secs / 1e6,
+               impl == v.impl ? " (used)" : "");
+        if (sink == 1) printf("\n"); // keep the loop from being optimized away
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int first = 1;
+    if (argc >= 3 && strcmp(argv[1], "-o") == 0) {
+        trimmed_out = fopen(argv[2], "wb");
+        if (!trimmed_out) {
+            perror(argv[2]);
+            return 1;
+        }
+        first = 3;
+    }
+
+    if (first == argc) {
+        size_t n;
+        int16_t *pcm = synthetic_pcm(12, &n);
+        bench("synthetic", pcm, n);
+        free(pcm);
+    }
+
+    for (int i = first; i < argc; i++) {
+        size_t n;
+        int16_t *pcm = load_pcm(argv[i], &n);
+        if (!pcm) return 1;
+        bench(argv[i], pcm, n);
+        free(pcm);
+    }
+
+    if (trimmed_out) fclose(trimmed_out);
+    return 0;
+}
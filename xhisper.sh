@@ -5,16 +5,40 @@
 # - Transcription via Groq Whisper
 
 # Configuration:
-# - LONG_RECORDING_THRESHOLD (threshold for using large vs turbo model)
+# - LONG_RECORDING_THRESHOLD (threshold for using large vs turbo model, and for
+#   sending the recording as parallel chunks)
 # - TRANSCRIPTION_PROMPT (context for Whisper)
+# - TRANSCRIPTION_MODE (stream: segments are transcribed while recording; once: after;
+#   upload: one request, uploaded while recording)
+# - TRANSCRIPTION_CONNECTIONS (parallel requests for long recordings)
+# - WHISPER_MODEL (a whisper.cpp ggml model: transcribe offline with it instead
+#   of Groq; needs xhispertool built with make WHISPER=1)
+# - TRANSCRIPTION_HEDGE (resend a slow request after this many ms, or pNN for
+#   the NNth percentile of recent round trips; empty for never) and
+#   TRANSCRIPTION_HEDGE_MODEL (the model to resend it to)
+# - TYPING_PROFILE (keystroke timing: safe, fast, slow or hold:gap:settle in us)
+# - PASTE_THRESHOLD (transcripts longer than this many characters are pasted
+#   in one go instead of typed), PASTE_MERGE_GAP (typed runs shorter than this
+#   between two pasted runs are pasted with them) and CLIPBOARD_RESTORE_DELAY
+#   (seconds before the clipboard is given back its old contents)
+# - KEYBOARD_LAYOUT (the desktop's layout, one of those in keymaps.txt: us,
+#   de, fr, es, dvorak, colemak; text is typed for it, accented letters
+#   included, so no wrap key is needed to switch to QWERTY)
+# - UNICODE_INPUT (characters the layout has no keys for: paste them through
+#   the clipboard, or hex to type them as Ctrl+Shift+U, code point, space,
+#   which IBus and GTK applications understand)
+# - TRACE_FILE (the daemon appends a JSONL line per pipeline stage of every
+#   dictation here; summarize with tracereport; empty for none)
 
 # Requirements:
 # - pipewire, pipewire-utils (audio)
 # - wl-clipboard (Wayland) or xclip (X11) for clipboard
-# - jq, curl, ffmpeg (processing)
+# - libcurl (transcription requests)
 # - make to build, sudo make install to install
 
 [ -f "$HOME/.env" ] && source "$HOME/.env"
+# The daemon sends the transcription requests with the client's key
+export GROQ_API_KEY
 
 # Parse command-line arguments
 LOCAL_MODE=0
@@ -49,17 +73,21 @@ else
   XHISPERTOOLD="xhispertoold"
 fi
 
-RECORDING="/tmp/xhisper.wav"
 LOGFILE="/tmp/xhisper.log"
-PROCESS_PATTERN="pw-record.*$RECORDING"
 LONG_RECORDING_THRESHOLD=1000 # s
 TRANSCRIPTION_PROMPT="Programming terms. Often used words: Clojure, Claude, LLM, Emacs, Electric Clojure."
-
-# Auto-start daemon if not running
-if ! pgrep -x xhispertoold > /dev/null; then
-    "$XHISPERTOOLD" &
-    sleep 0.2  # Give daemon time to start
-fi
+TYPING_PROFILE="safe"
+TRANSCRIPTION_MODE="stream"
+TRANSCRIPTION_CONNECTIONS=4
+TRANSCRIPTION_HEDGE=""
+WHISPER_MODEL=""
+TRANSCRIPTION_HEDGE_MODEL="whisper-large-v3"
+PASTE_THRESHOLD=100
+PASTE_MERGE_GAP=3
+CLIPBOARD_RESTORE_DELAY=0.3
+TRACE_FILE="/tmp/xhisper-trace.jsonl"
+KEYBOARD_LAYOUT="us"
+UNICODE_INPUT="paste"
 
 # Check if xhispertool is available
 if ! command -v "$XHISPERTOOL" &> /dev/null; then
@@ -70,13 +98,35 @@ if ! command -v "$XHISPERTOOL" &> /dev/null; then
     exit 1
 fi
 
-# Detect clipboard tool
+# Auto-start daemon if it does not answer. The read returns as soon as the
+# daemon reports READY=1 on its ready fd; its log (with per-recording
+# sizes and encode times) goes to the logfile.
+# Loading a local model makes the first start slower.
+if ! "$XHISPERTOOL" wait-ready 0 2> /dev/null; then
+    DAEMON_ARGS=(--connections "$TRANSCRIPTION_CONNECTIONS" --layout "$KEYBOARD_LAYOUT"
+                 --unicode "$UNICODE_INPUT")
+    [ -n "$WHISPER_MODEL" ] && DAEMON_ARGS+=(--model-file "$WHISPER_MODEL")
+    [ -n "$TRACE_FILE" ] && DAEMON_ARGS+=(--trace "$TRACE_FILE")
+    read -r -t 30 DAEMON_STATUS < <("$XHISPERTOOLD" --ready-fd 3 "${DAEMON_ARGS[@]}" \
+      3>&1 >> "$LOGFILE" 2>&1 &)
+    if [ "$DAEMON_STATUS" != "READY=1" ]; then
+        echo "Error: xhispertoold failed to start" >&2
+        exit 1
+    fi
+fi
+
+# Detect clipboard tool. CLIP_TYPES lists the clipboard's MIME types,
+# CLIP_PASTE and CLIP_COPY take a type as their optional argument.
 if command -v wl-copy &> /dev/null; then
-    CLIP_COPY="wl-copy"
-    CLIP_PASTE="wl-paste"
+    CLIP_COPY() { wl-copy ${1:+--type "$1"}; }
+    CLIP_PASTE() { wl-paste --no-newline ${1:+--type "$1"}; }
+    CLIP_TYPES() { wl-paste --list-types; }
+    CLIP_CLEAR() { wl-copy --clear; }
 elif command -v xclip &> /dev/null; then
-    CLIP_COPY() { xclip -selection clipboard; }
-    CLIP_PASTE() { xclip -o -selection clipboard; }
+    CLIP_COPY() { xclip -selection clipboard ${1:+-t "$1"}; }
+    CLIP_PASTE() { xclip -o -selection clipboard ${1:+-t "$1"}; }
+    CLIP_TYPES() { xclip -o -selection clipboard -t TARGETS | grep /; }
+    CLIP_CLEAR() { printf '' | xclip -selection clipboard; }
 else
     echo "Error: No clipboard tool found. Install wl-clipboard or xclip." >&2
     exit 1
@@ -88,37 +138,120 @@ press_wrap_key() {
   fi
 }
 
+# Keep the user's clipboard, in its first MIME type, while ours is in use
+clipboard_save() {
+  CLIP_SAVED=$(mktemp) || return
+  CLIP_SAVED_TYPE=$(CLIP_TYPES 2> /dev/null | head -n 1)
+  if [ -z "$CLIP_SAVED_TYPE" ] || ! CLIP_PASTE "$CLIP_SAVED_TYPE" > "$CLIP_SAVED" 2> /dev/null; then
+    CLIP_SAVED_TYPE=""
+  fi
+}
+
+# Put it back once the application has had time to read the paste
+clipboard_restore() {
+  local saved="$CLIP_SAVED" type="$CLIP_SAVED_TYPE"
+  (
+    sleep "$CLIPBOARD_RESTORE_DELAY"
+    if [ -n "$type" ]; then
+      CLIP_COPY "$type" < "$saved"
+    else
+      CLIP_CLEAR
+    fi
+    rm -f "$saved"
+  ) > /dev/null 2>&1 &
+}
+
+# Insert text at the cursor. Characters KEYBOARD_LAYOUT has keys for (all
+# printable ones with UNICODE_INPUT=hex) are typed by the daemon; every run
+# of other characters goes through the clipboard as one paste, taking short
+# typed gaps (spaces between words) along with it, and text longer than
+# PASTE_THRESHOLD is pasted whole. INSERT_STRATEGY is set to what was done,
+# for the log.
 paste() {
   local text="$1"
+  local runs=() kinds=()
+
+  if [ "${#text}" -gt "$PASTE_THRESHOLD" ]; then
+    runs=("$text")
+    kinds=(paste)
+  else
+    # One t (typeable) or - per character, from the daemon: one started
+    # before the config changed still types for its own layout
+    local mask
+    mask=$("$XHISPERTOOL" typeable "$text")
+    local run="" kind="" char k
+    for ((i=0; i<${#text}; i++)); do
+      char="${text:$i:1}"
+      k=paste
+      [ "${mask:$i:1}" = t ] && k=type
+      if [ "$k" != "$kind" ] && [ -n "$run" ]; then
+        runs+=("$run")
+        kinds+=("$kind")
+        run=""
+      fi
+      kind="$k"
+      run+="$char"
+    done
+    [ -n "$run" ] && runs+=("$run") && kinds+=("$kind")
+
+    # Fold short typed gaps between pasted runs into one paste
+    local merged=() merged_kinds=() last
+    for ((i=0; i<${#runs[@]}; i++)); do
+      last=$((${#merged[@]} - 1))
+      if [ "$last" -ge 0 ] && [ "${merged_kinds[$last]}" = paste ] &&
+         { [ "${kinds[$i]}" = paste ] ||
+           { [ "${#runs[$i]}" -lt "$PASTE_MERGE_GAP" ] && [ "${kinds[$((i + 1))]}" = paste ]; }; }; then
+        merged[$last]+="${runs[$i]}"
+      else
+        merged+=("${runs[$i]}")
+        merged_kinds+=("${kinds[$i]}")
+      fi
+    done
+    runs=("${merged[@]}")
+    kinds=("${merged_kinds[@]}")
+  fi
+
+  local typed=0 pasted=0
   press_wrap_key
-  # Type character by character
-  # Use xhispertool type for ASCII (32-126), clipboard+paste for Unicode
-  for ((i=0; i<${#text}; i++)); do
-    local char="${text:$i:1}"
-    local ascii=$(printf '%d' "'$char")
-
-    if [[ $ascii -ge 32 && $ascii -le 126 ]]; then
-      # ASCII printable character - use direct key typing (faster)
-      "$XHISPERTOOL" type "$char"
+  for ((i=0; i<${#runs[@]}; i++)); do
+    if [ "${kinds[$i]}" = type ]; then
+      "$XHISPERTOOL" --wait --profile "$TYPING_PROFILE" type-string "${runs[$i]}"
+      typed=$((typed + 1))
     else
-      # Unicode or special character - use clipboard
-      echo -n "$char" | $CLIP_COPY
-      "$XHISPERTOOL" paste
+      # --wait: everything queued ahead must be typed before the clipboard
+      # changes, and the paste must be done before it is restored
+      [ "$pasted" -eq 0 ] && clipboard_save
+      printf '%s' "${runs[$i]}" | CLIP_COPY
+      "$XHISPERTOOL" --wait paste
+      pasted=$((pasted + 1))
     fi
   done
+  [ "$pasted" -gt 0 ] && clipboard_restore
   press_wrap_key
+
+  if [ "$typed" -eq 0 ]; then
+    INSERT_STRATEGY="paste"
+  elif [ "$pasted" -eq 0 ]; then
+    INSERT_STRATEGY="type"
+  else
+    INSERT_STRATEGY="mixed ($typed typed, $pasted pasted)"
+  fi
 }
 
-delete_n_chars() {
-  local n="$1"
-  for ((i=0; i<n; i++)); do
-    "$XHISPERTOOL" backspace
-  done
+# Replace the text typed so far this session. The daemon erases only what
+# differs from the last version, so placeholders and transcripts are never
+# counted out by hand.
+set_session_text() {
+  press_wrap_key
+  "$XHISPERTOOL" --wait --profile "$TYPING_PROFILE" session-set "$1"
+  press_wrap_key
 }
 
-get_duration() {
-  local recording="$1"
-  ffprobe -v error -show_entries format=duration -of default=noprint_wrappers=1:nokey=1 "$recording" 2>/dev/null || echo "0"
+# Short text the daemon can type is typed as session text; anything
+# else is pasted
+is_typeable() {
+  [ "${#1}" -le "$PASTE_THRESHOLD" ] &&
+    "$XHISPERTOOL" typeable "$1" > /dev/null
 }
 
 logging_end_and_write_to_logfile() {
@@ -134,44 +267,60 @@ logging_end_and_write_to_logfile() {
   echo "Time: ${time}s" >> "$LOGFILE"
 }
 
-transcribe() {
-  local recording="$1"
-  local logging_start=$(date +%s%N)
-
-  # Use large model for longer recordings, turbo for short ones
-  local is_long_recording=$(echo "$(get_duration "$recording") > $LONG_RECORDING_THRESHOLD" | bc -l)
-  local model=$([[ $is_long_recording -eq 1 ]] && echo "whisper-large-v3" || echo "whisper-large-v3-turbo")
-
-  local transcription=$(curl -s -X POST "https://api.groq.com/openai/v1/audio/transcriptions" \
-    -H "Authorization: Bearer $GROQ_API_KEY" \
-    -H "Content-Type: multipart/form-data" \
-    -F "file=@$recording" \
-    -F "model=$model" \
-    -F "prompt=$TRANSCRIPTION_PROMPT" \
-    | jq -r '.text' | sed 's/^ //') # Transcription always returns a leading space, so remove it via sed
-
-  logging_end_and_write_to_logfile "Transcription" "$transcription" "$logging_start"
-
-  echo "$transcription"
-}
-
 # Main
 
-# Find recording process, if so then kill
-if pgrep -f "$PROCESS_PATTERN" > /dev/null; then
-  pkill -f "$PROCESS_PATTERN"; sleep 0.2 # Buffer for flush
-  delete_n_chars 14 # "(recording...)"
-
-  paste "(transcribing...)"
-  TRANSCRIPTION=$(transcribe "$RECORDING")
-  delete_n_chars 17 # "(transcribing...)"
+# The daemon owns the recording and keeps it in memory. record-stop
+# returns once the capture has been drained, with the duration.
+if "$XHISPERTOOL" record-status > /dev/null; then
+  if ! read -r DURATION < <("$XHISPERTOOL" record-stop); then
+    exit 1
+  fi
+  # Nothing but silence: the daemon's VAD trimmed everything
+  if [ "$DURATION" = "0.000" ]; then
+    set_session_text ""
+    "$XHISPERTOOL" session-end
+    exit 0
+  fi
 
-  paste "$TRANSCRIPTION"
+  set_session_text "(transcribing...)"
+  # Streamed segments went out at each pause, so only the last one can
+  # still be pending; otherwise the request (or its chunks) left on stop
+  LOGGING_START=$(date +%s%N)
+  TRANSCRIPTION=$("$XHISPERTOOL" record-text)
+  logging_end_and_write_to_logfile "Transcription" "$TRANSCRIPTION" "$LOGGING_START"
 
-  rm -f "$RECORDING"
+  INSERT_START=$(date +%s%N)
+  if is_typeable "$TRANSCRIPTION"; then
+    set_session_text "$TRANSCRIPTION"
+    INSERT_STRATEGY="type"
+  else
+    set_session_text ""
+    paste "$TRANSCRIPTION"
+  fi
+  "$XHISPERTOOL" session-end
+  logging_end_and_write_to_logfile "Insertion" "$INSERT_STRATEGY" "$INSERT_START"
 else
-  # No recording running, so start
+  # No recording running, so start. Capture begins before the pause that
+  # lets the hotkey's modifiers be released, so no speech is lost to it.
+  BACKEND_ARGS=()
+  if [ -n "$WHISPER_MODEL" ]; then
+    BACKEND_ARGS=(--local)
+  elif [ -n "$TRANSCRIPTION_HEDGE" ]; then
+    BACKEND_ARGS=(--hedge "$TRANSCRIPTION_HEDGE" --hedge-model "$TRANSCRIPTION_HEDGE_MODEL")
+  fi
+  if [ "$TRANSCRIPTION_MODE" = "stream" ]; then
+    "$XHISPERTOOL" record-start --stream --model whisper-large-v3-turbo "${BACKEND_ARGS[@]}" \
+      --prompt "$TRANSCRIPTION_PROMPT" || exit 1
+  elif [ "$TRANSCRIPTION_MODE" = "upload" ]; then
+    "$XHISPERTOOL" record-start --upload --model whisper-large-v3-turbo "${BACKEND_ARGS[@]}" \
+      --prompt "$TRANSCRIPTION_PROMPT" || exit 1
+  else
+    # Long recordings use the large model and are sent as parallel chunks
+    "$XHISPERTOOL" record-start --transcribe --model whisper-large-v3-turbo \
+      --long-s "$LONG_RECORDING_THRESHOLD" --long-model whisper-large-v3 "${BACKEND_ARGS[@]}" \
+      --prompt "$TRANSCRIPTION_PROMPT" || exit 1
+  fi
   sleep 0.2
-  paste "(recording...)"
-  pw-record --channels=1 --rate=16000 "$RECORDING"
+  "$XHISPERTOOL" session-end
+  set_session_text "(recording...)"
 fi
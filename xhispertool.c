@@ -3,20 +3,47 @@
  * Combined daemon and client for text input via uinput
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/un.h>
-#include <linux/uinput.h>
+#include <sys/wait.h>
+
+#include "flac.h"
+#include "inject.h"
+#include "keymap.h"
+#include "localwhisper.h"
+#include "stats.h"
+#include "transcribe.h"
+#include "vad.h"
 
 #define SOCKET_PATH_LEN 108
+#define MSG_MAX 4096 // largest request payload
+#define STRING_CHUNK_MAX MSG_MAX
 #define KEY_LEFTCTRL 29
 #define KEY_RIGHTCTRL 97
 #define KEY_LEFTALT 56
@@ -25,195 +52,751 @@
 #define KEY_RIGHTSHIFT 54
 #define KEY_LEFTMETA 125
 #define KEY_V 47
-#define FLAG_UPPERCASE 0x80000000
-
-// ASCII to Linux keycode mapping
-static const int32_t ascii2keycode_map[128] = {
-	// 00 - 0f
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	-1,KEY_TAB,KEY_ENTER,-1,-1,-1,-1,-1,
-	// 10 - 1f
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	-1,-1,-1,-1,-1,-1,-1,-1,
-	// 20 - 2f
-	KEY_SPACE,KEY_1|FLAG_UPPERCASE,KEY_APOSTROPHE|FLAG_UPPERCASE,KEY_3|FLAG_UPPERCASE,KEY_4|FLAG_UPPERCASE,KEY_5|FLAG_UPPERCASE,KEY_7|FLAG_UPPERCASE,KEY_APOSTROPHE,
-	KEY_9|FLAG_UPPERCASE,KEY_0|FLAG_UPPERCASE,KEY_8|FLAG_UPPERCASE,KEY_EQUAL|FLAG_UPPERCASE,KEY_COMMA,KEY_MINUS,KEY_DOT,KEY_SLASH,
-	// 30 - 3f
-	KEY_0,KEY_1,KEY_2,KEY_3,KEY_4,KEY_5,KEY_6,KEY_7,
-	KEY_8,KEY_9,KEY_SEMICOLON|FLAG_UPPERCASE,KEY_SEMICOLON,KEY_COMMA|FLAG_UPPERCASE,KEY_EQUAL,KEY_DOT|FLAG_UPPERCASE,KEY_SLASH|FLAG_UPPERCASE,
-	// 40 - 4f
-	KEY_2|FLAG_UPPERCASE,KEY_A|FLAG_UPPERCASE,KEY_B|FLAG_UPPERCASE,KEY_C|FLAG_UPPERCASE,KEY_D|FLAG_UPPERCASE,KEY_E|FLAG_UPPERCASE,KEY_F|FLAG_UPPERCASE,KEY_G|FLAG_UPPERCASE,
-	KEY_H|FLAG_UPPERCASE,KEY_I|FLAG_UPPERCASE,KEY_J|FLAG_UPPERCASE,KEY_K|FLAG_UPPERCASE,KEY_L|FLAG_UPPERCASE,KEY_M|FLAG_UPPERCASE,KEY_N|FLAG_UPPERCASE,KEY_O|FLAG_UPPERCASE,
-	// 50 - 5f
-	KEY_P|FLAG_UPPERCASE,KEY_Q|FLAG_UPPERCASE,KEY_R|FLAG_UPPERCASE,KEY_S|FLAG_UPPERCASE,KEY_T|FLAG_UPPERCASE,KEY_U|FLAG_UPPERCASE,KEY_V|FLAG_UPPERCASE,KEY_W|FLAG_UPPERCASE,
-	KEY_X|FLAG_UPPERCASE,KEY_Y|FLAG_UPPERCASE,KEY_Z|FLAG_UPPERCASE,KEY_LEFTBRACE,KEY_BACKSLASH,KEY_RIGHTBRACE,KEY_6|FLAG_UPPERCASE,KEY_MINUS|FLAG_UPPERCASE,
-	// 60 - 6f
-	KEY_GRAVE,KEY_A,KEY_B,KEY_C,KEY_D,KEY_E,KEY_F,KEY_G,
-	KEY_H,KEY_I,KEY_J,KEY_K,KEY_L,KEY_M,KEY_N,KEY_O,
-	// 70 - 7f
-	KEY_P,KEY_Q,KEY_R,KEY_S,KEY_T,KEY_U,KEY_V,KEY_W,
-	KEY_X,KEY_Y,KEY_Z,KEY_LEFTBRACE|FLAG_UPPERCASE,KEY_BACKSLASH|FLAG_UPPERCASE,KEY_RIGHTBRACE|FLAG_UPPERCASE,KEY_GRAVE|FLAG_UPPERCASE,-1
+#define EVENT_BUF_MAX 64
+#define PLAN_MAX_STEPS (12 * MSG_MAX + 2) // longer plans are split between characters
+#define PLAN_CHAR_MAX_STEPS 40 // Ctrl+Shift+U, six hex digits and space, each after modifier changes
+#define PLAN_END_STEPS 3 // releasing Ctrl, Shift and AltGr
+#define SESSION_CHUNK_MAX ((PLAN_MAX_STEPS - PLAN_END_STEPS) / PLAN_CHAR_MAX_STEPS) // chars per plan
+#define FLUSH_TIMEOUT_MS 10
+#define SCHED_MAX_LAG_NS 5000000 // fall this far behind and the timeline restarts
+#define QUEUE_SLOTS 64 // power of two
+#define CONN_MAX 1024 // client connections are tracked by fd below this
+#define CLIENT_BUSY_TIMEOUT_MS 2000
+#define CLIENT_BUSY_RETRY_US 10000
+#define WAIT_READY_TIMEOUT_MS 5000
+#define WAIT_READY_REPLY_MS 1000 // minimum wait for the ping reply
+#define LISTEN_FDS_START 3 // first fd passed by a socket-activating supervisor
+#define CAPTURE_RATE 16000 // mono s16 samples per second
+#define CAPTURE_BYTES_PER_S (CAPTURE_RATE * 2)
+#define CAPTURE_RING_S 600 // longest recording kept in memory
+#define CAPTURE_RING_BYTES ((size_t)CAPTURE_RING_S * CAPTURE_BYTES_PER_S)
+#define CAPTURE_READ_MAX 65536
+#define CAPTURE_COMMAND_DEFAULT "pw-record --raw --rate=16000 --channels=1 --format=s16 -"
+#define WAV_HEADER_LEN 44
+#define PROCESS_INTERVAL_MS 100 // trim and encode new audio this often while recording
+#define CAPTURE_STOP_TIMEOUT_MS 2000 // a capture still running this long after SIGTERM is killed
+#define SEGMENT_MIN_S 3 // streaming: shortest segment cut at a pause
+#define HEDGE_HISTORY 100    // round trips a percentile deadline is taken over
+#define HEDGE_MIN_SAMPLES 20 // fewer than this and the deadline is HEDGE_INITIAL_MS
+#define HEDGE_INITIAL_MS 2000
+#define SESSION_TEXT_MAX 65536 // longest session text kept for corrections
+
+// Keystroke timing, all in microseconds
+struct timing_profile {
+    const char *name;
+    uint16_t hold_us;   // key down to key up
+    uint16_t gap_us;    // key up to the next key down
+    uint16_t settle_us; // modifier down to the key it modifies
+};
+
+static const struct timing_profile timing_profiles[] = {
+    {"safe", 8000, 2000, 2000},
+    {"fast", 2000, 1000, 500},
+    {"slow", 20000, 5000, 5000},
+};
+
+static struct timing_profile default_timing = {"safe", 8000, 2000, 2000};
+static struct timing_profile timing = {"safe", 8000, 2000, 2000};
+
+// Keyboard layout the text is typed for; the desktop must have the same
+static const struct keymap *layout;
+
+// Characters without keys on the layout are left to the script to paste,
+// or with --unicode hex typed as Ctrl+Shift+U, their code point in hex and
+// space, which IBus and GTK turn into the character
+static int unicode_hex = 0;
+
+// Request flags
+#define REQ_WAIT 0x01   // also reply once the command has been injected
+#define REQ_TIMING 0x02 // hold/gap/settle override the daemon's profile
+#define REQ_MORE 0x04   // session text continues in the next request
+
+// Every request on the seqpacket socket starts with this header, followed
+// by len bytes of payload. Client and daemon are the same binary, so the
+// layout is native.
+struct request {
+    uint32_t seq;
+    char cmd;
+    uint8_t flags;
+    uint16_t len;
+    uint16_t hold_us;
+    uint16_t gap_us;
+    uint16_t settle_us;
+    uint16_t reserved;
+};
+
+// Reply statuses. Each request is acknowledged at once (queued, busy,
+// invalid, or done for immediate commands); a queued request sent with
+// REQ_WAIT gets a second reply when it has finished.
+enum {
+    REPLY_QUEUED,
+    REPLY_BUSY,
+    REPLY_INVALID,
+    REPLY_DONE,
+    REPLY_CANCELLED,
+    REPLY_FAILED,
+};
+
+// Replies may carry len bytes of text after the header (recording paths
+// and durations, error messages)
+struct reply {
+    uint32_t seq;
+    uint8_t status;
+    uint8_t reserved;
+    uint16_t len;
+    uint32_t elapsed_us; // time spent injecting, for completions
+};
+
+// Commands received but not yet injected. The receiver thread fills slots
+// at queue_tail, the injection worker runs them and advances queue_done,
+// and the receiver sends any completion reply before freeing the slot at
+// queue_head.
+struct queued_cmd {
+    struct request req;
+    int conn_fd;
+    uint32_t conn_id;
+    uint32_t cancel_gen;
+    uint8_t status;
+    uint32_t elapsed_us;
+    uint64_t received_ns;
+    char data[MSG_MAX];
+};
+
+static struct queued_cmd cmd_queue[QUEUE_SLOTS];
+static size_t queue_head = 0;          // next slot the receiver frees
+static _Atomic size_t queue_done = 0;  // next slot the worker runs
+static _Atomic size_t queue_tail = 0;  // next slot the receiver fills
+static _Atomic uint32_t cancel_gen = 0; // bumped by every cancel
+static uint32_t active_gen = 0;         // generation of the running command
+static uint32_t conn_ids[CONN_MAX];     // per-fd connection id, 0 when closed
+
+// What xhispertool stats reports. The receiver and the injection worker
+// update these with relaxed atomic adds, which is cheap enough to leave on;
+// a report may be a sample or two out of step between fields.
+static struct {
+    uint64_t started_ns;
+    _Atomic uint64_t commands[128];            // requests received, by letter
+    _Atomic uint64_t outcomes[REPLY_FAILED + 1]; // busy and invalid, then how queued ones ended
+    size_t queue_max;                          // receiver only
+    _Atomic uint64_t flushes;                  // write() batches to the event fd
+    _Atomic uint64_t events;                   // events written
+    _Atomic uint64_t write_retries;            // partial writes and EAGAIN waits
+    _Atomic uint64_t write_failures;           // batches cut short
+    _Atomic uint64_t events_dropped;
+    struct histogram first_event;              // receive to first event written, us
+    struct histogram completion;               // receive to command finished, us
+} stats;
+static uint64_t first_event_ns = 0; // worker: first flush of the running command
+static uint64_t last_event_ns = 0;  // worker: latest flush of the running command
+
+// Stage trace (--trace): one JSON line per pipeline stage of a dictation.
+// The main thread writes the recording and transcription stages; the
+// injection worker writes first_key and last_key for commands run after
+// trace_session's transcript went out, until session-end or the next
+// record-start. Lines are short single write()s to an O_APPEND file, so
+// the two threads do not interleave.
+static int fd_trace = -1;
+static _Atomic uint32_t trace_session = 0;
+
+// Audio capture. A child process writes raw 16 kHz mono s16 PCM to a pipe
+// and the capture thread appends it to a ring sized for the longest
+// recording, publishing the running byte count in capture_bytes. Readers
+// only take bytes behind that count, so the ring needs no lock.
+static uint8_t *capture_ring = NULL;
+static _Atomic uint64_t capture_bytes = 0;
+static const char *capture_command = CAPTURE_COMMAND_DEFAULT;
+static uint64_t preroll_bytes = 0; // > 0 keeps capturing between sessions
+static int vad_enabled = 1;        // trim silence before encoding
+static int transcribe_connections = TRANSCRIBE_CONNECTIONS_DEFAULT;
+static double round_trips[HEDGE_HISTORY]; // latest primary requests, in ms
+static size_t round_trip_count = 0;
+
+// How a session is transcribed: not at all, as one request on stop, in
+// segments cut at pauses and sent while recording continues, or as one
+// request whose body is uploaded while recording continues
+enum {
+    TRANSCRIBE_OFF,
+    TRANSCRIBE_ONCE,
+    TRANSCRIBE_STREAM,
+    TRANSCRIBE_UPLOAD,
+};
+
+// Capture child and recording session, owned by the receiver thread. The
+// child is watched through a pidfd, so record-stop is answered as soon as
+// the child has exited and the pipe has been drained.
+struct recording {
+    pid_t pid;             // capture child, 0 when not capturing
+    int pidfd;
+    int pipe_fd;
+    pthread_t thread;
+    int active;            // between record-start and record-stop
+    uint64_t start;        // first byte of the session, pre-roll included
+    uint64_t start_ns;
+    int stop_fd;           // connection waiting for record-stop, -1 if none
+    uint32_t stop_conn_id;
+    uint32_t stop_seq;
+    char path[PATH_MAX];   // WAV file written on stop, empty for none
+    uint8_t *clip;         // PCM kept by the VAD, complete once stopped
+    size_t clip_len;
+    size_t clip_cap;
+    int clip_failed;
+    struct vad vad;
+    struct flac_encoder flac; // the clip, encoded as it grows
+    uint64_t processed;    // ring position the VAD and encoder have reached
+    uint64_t process_ns;   // time spent trimming and encoding this session
+    uint64_t stop_ns;
+    uint32_t session;      // bumped by every record-start
+    int transcribe;        // TRANSCRIBE_OFF, _ONCE, _STREAM or _UPLOAD
+    struct transcript_job request; // endpoint, key, model and prompt of every segment
+    double long_s;         // stopped recordings longer than this are sent in chunks
+    char long_model[64];   // model for those, empty for the usual one
+    int hedge_pct;         // hedge past this percentile of recent round trips, 0 if fixed
+    int overlapping;       // segments are chunks with shared audio at their edges
+    struct flac_encoder segment; // streaming: audio since the last cut
+    size_t segment_start;  // streaming: clip sample where that audio begins
+    double local_audio_s;  // local model: audio decoded this session
+    double local_ms;       // and the time it took
+    struct transcript_job *upload; // upload mode: the request still taking audio
+    size_t upload_len;     // bytes of flac.out appended to it
+    uint32_t segments;     // submitted this session
+    uint32_t segments_done;
+    char **texts;          // transcript of each segment, in order
+    char transcript_error[256]; // first failure, empty if none
+    int text_fd;           // connection waiting for record-text, -1 if none
+    uint32_t text_conn_id;
+    uint32_t text_seq;
 };
 
-static int fd_uinput = -1;
+static struct recording recording = {.pidfd = -1, .pipe_fd = -1, .stop_fd = -1, .text_fd = -1};
+
+static const struct inject_backend *backend = &inject_uinput;
+static const char *backend_arg = "";
+static int fd_inject = -1;
 static int fd_socket = -1;
+static int fd_timer = -1;
+static int fd_process = -1; // timerfd: trim and encode newly captured audio
+static int fd_work = -1; // eventfd: queue became non-empty
+static int fd_done = -1; // eventfd: worker finished a command
+static int fd_transcribed = -1; // eventfd: transcription requests finished
+static int fd_stats = -1; // timerfd: periodic stats dump
+static int fd_stop = -1; // timerfd: kill a capture that ignores record-stop's SIGTERM
+static int inject_failed = 0;
+static uint64_t sched_next_ns = 0;
+static uint8_t key_state[KEY_MAX + 1];
 static char socket_path[SOCKET_PATH_LEN] = {0};
 
 void cleanup() {
-    if (fd_uinput >= 0) {
-        ioctl(fd_uinput, UI_DEV_DESTROY);
-        close(fd_uinput);
+    if (fd_inject >= 0) {
+        backend->close(fd_inject);
     }
     if (fd_socket >= 0) {
         close(fd_socket);
     }
+    if (fd_timer >= 0) {
+        close(fd_timer);
+    }
+    if (recording.pid > 0) {
+        kill(-recording.pid, SIGTERM);
+    }
     if (socket_path[0]) {
         unlink(socket_path);
     }
 }
 
+// Socket paths live in XDG_RUNTIME_DIR, falling back to /tmp
+void get_socket_path(char *path, const char *name) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && runtime_dir[0]) {
+        snprintf(path, SOCKET_PATH_LEN, "%s/%s", runtime_dir, name);
+    } else {
+        snprintf(path, SOCKET_PATH_LEN, "/tmp/%s", name);
+    }
+}
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Append one stage to the trace: the session it belongs to, the segment
+// for per-request stages (-1 for none) and the monotonic time
+void trace_stage(uint32_t session, const char *stage, int segment, uint64_t t_ns) {
+    if (fd_trace < 0 || !t_ns) return;
+    char line[160];
+    int len = snprintf(line, sizeof(line), "{\"t_us\":%llu,\"pid\":%d,\"session\":%u,\"stage\":\"%s\"",
+                       (unsigned long long)(t_ns / 1000), getpid(), session, stage);
+    if (segment >= 0) len += snprintf(line + len, sizeof(line) - len, ",\"segment\":%d", segment);
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+    if (write(fd_trace, line, len) != len) {
+        perror("xhispertoold: failed to write trace");
+        close(fd_trace);
+        fd_trace = -1;
+    }
+}
+
+// Events are queued here between timing gaps and written with one syscall
+static struct input_event event_buf[EVENT_BUF_MAX];
+static size_t event_buf_len = 0;
+
+// Write all queued events with a single write(). Partial writes are resumed;
+// EAGAIN on the non-blocking event fd waits briefly for POLLOUT. Whatever
+// still cannot be written is reported and dropped. An empty buffer is not
+// a write and isn't counted as one.
+int flush_events() {
+    if (!event_buf_len) return 0;
+
+    size_t total = event_buf_len * sizeof(struct input_event);
+    size_t off = 0;
+    int ret = 0;
+
+    backend->stamp(event_buf, event_buf_len);
+    last_event_ns = monotonic_ns();
+    if (!first_event_ns) first_event_ns = last_event_ns;
+    counter_add(&stats.flushes, 1);
+
+    while (off < total) {
+        ssize_t n = write(fd_inject, (char *)event_buf + off, total - off);
+        if (n > 0) {
+            off += n;
+            if (off < total) counter_add(&stats.write_retries, 1);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) {
+            counter_add(&stats.write_retries, 1);
+            struct pollfd pfd = {.fd = fd_inject, .events = POLLOUT};
+            if (poll(&pfd, 1, FLUSH_TIMEOUT_MS) > 0) continue;
+        }
+        fprintf(stderr, "xhispertoold: dropped %zu of %zu events: %s\n",
+                (total - off) / sizeof(struct input_event), event_buf_len,
+                n < 0 ? strerror(errno) : "short write");
+        counter_add(&stats.write_failures, 1);
+        counter_add(&stats.events_dropped, (total - off) / sizeof(struct input_event));
+        ret = -1;
+        inject_failed = 1;
+        break;
+    }
+    counter_add(&stats.events, off / sizeof(struct input_event));
+
+    event_buf_len = 0;
+    return ret;
+}
+
 void emit(int type, int code, int val) {
-    struct input_event ie = {
+    if (event_buf_len == EVENT_BUF_MAX) flush_events();
+    if (type == EV_KEY && code <= KEY_MAX) key_state[code] = val != 0;
+    event_buf[event_buf_len++] = (struct input_event){
         .type = type,
         .code = code,
         .value = val
     };
-    write(fd_uinput, &ie, sizeof(ie));
+}
+
+uint16_t get_u16(const char *p) {
+    return ((unsigned char)p[0] << 8) | (unsigned char)p[1];
+}
+
+void put_u16(char *p, uint16_t v) {
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+// Resolve a profile name or a "hold:gap:settle" spec (microseconds)
+int parse_timing_profile(const char *spec, struct timing_profile *out) {
+    for (size_t i = 0; i < sizeof(timing_profiles) / sizeof(timing_profiles[0]); i++) {
+        if (strcmp(spec, timing_profiles[i].name) == 0) {
+            *out = timing_profiles[i];
+            return 0;
+        }
+    }
+
+    unsigned int hold, gap, settle;
+    char tail;
+    if (sscanf(spec, "%u:%u:%u%c", &hold, &gap, &settle, &tail) != 3 ||
+        hold > 0xffff || gap > 0xffff || settle > 0xffff) {
+        return -1;
+    }
+    *out = (struct timing_profile){"custom", hold, gap, settle};
+    return 0;
+}
+
+// Resolve a layout name from keymaps.txt, us when name is NULL, and a
+// Unicode entry mode, paste (the default) or hex
+int set_layout(const char *name, const char *unicode) {
+    layout = keymap_find(name ? name : "us");
+    if (!layout) {
+        fprintf(stderr, "unknown keyboard layout '%s', expected one of:", name);
+        for (size_t i = 0; i < keymap_count; i++) fprintf(stderr, " %s", keymaps[i].name);
+        fprintf(stderr, "\n");
+        return -1;
+    }
+
+    if (!unicode || strcmp(unicode, "paste") == 0) return 0;
+    if (strcmp(unicode, "hex") != 0) {
+        fprintf(stderr, "unknown Unicode entry mode '%s', expected paste or hex\n", unicode);
+        return -1;
+    }
+    // The sequence needs u and the hex digits on keys of their own
+    for (const char *c = "u0123456789abcdef"; *c; c++) {
+        const struct keymap_entry *e = keymap_lookup(layout, (unsigned char)*c);
+        if (!e || e->dead.code) {
+            fprintf(stderr, "layout %s has no key for '%c', needed for hex entry\n", layout->name, *c);
+            return -1;
+        }
+    }
+    unicode_hex = 1;
+    return 0;
+}
+
+// Whether transcript text cp gets typed: it is a printable character and
+// has keys, or hex entry is on. Newline and tab have keys too, but Enter
+// and Tab would submit or move focus, so those are left to the clipboard.
+int char_typeable(uint32_t cp) {
+    if (cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0) || (cp >= 0xd800 && cp < 0xe000) ||
+        cp == 0xfffd || cp > 0x10ffff)
+        return 0;
+    return unicode_hex || keymap_lookup(layout, cp);
+}
+
+// One character per code point: t where it gets typed, - where the script
+// has to paste it. mask has room for len + 1. Returns 1 if any is -.
+int typeable_mask(const char *text, size_t len, char *mask) {
+    size_t n = 0;
+    int all = 1;
+    for (size_t i = 0; i < len;) {
+        int typeable = char_typeable(utf8_next(text, len, &i));
+        mask[n++] = typeable ? 't' : '-';
+        all &= typeable;
+    }
+    mask[n] = 0;
+    return all ? 0 : 1;
+}
+
+int setup_scheduler() {
+    fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd_timer < 0) {
+        perror("failed to create timerfd");
+        return -1;
+    }
+    return 0;
+}
+
+// Release every key this device still holds down
+void release_keys() {
+    for (int code = 0; code <= KEY_MAX; code++) {
+        if (key_state[code]) emit(EV_KEY, code, 0);
+    }
+    emit(EV_SYN, SYN_REPORT, 0);
+    flush_events();
+}
+
+// True once a cancel arrived after the running command was queued
+int cancelled() {
+    return atomic_load_explicit(&cancel_gen, memory_order_relaxed) != active_gen;
+}
+
+// Flush the pending batch, then wait until us microseconds past the previous
+// deadline. Deadlines are absolute on CLOCK_MONOTONIC, so oversleeping one
+// gap shortens the next instead of accumulating drift.
+void key_delay(unsigned int us) {
+    flush_events();
+
+    uint64_t now = monotonic_ns();
+    if (sched_next_ns + SCHED_MAX_LAG_NS < now) sched_next_ns = now;
+    sched_next_ns += (uint64_t)us * 1000;
+    if (sched_next_ns <= now) return;
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = sched_next_ns / 1000000000ull,
+            .tv_nsec = sched_next_ns % 1000000000ull
+        }
+    };
+    if (timerfd_settime(fd_timer, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        usleep(us);
+        return;
+    }
+
+    uint64_t expirations;
+    while (read(fd_timer, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
 }
 
 void do_paste() {
+    // Ctrl stays down for a full hold before V; paste targets are the slowest
     emit(EV_KEY, KEY_LEFTCTRL, 1);
     emit(EV_SYN, SYN_REPORT, 0);
-    usleep(8000);
+    key_delay(timing.hold_us);
     emit(EV_KEY, KEY_V, 1);
     emit(EV_SYN, SYN_REPORT, 0);
-    usleep(8000);
+    key_delay(timing.hold_us);
     emit(EV_KEY, KEY_V, 0);
     emit(EV_SYN, SYN_REPORT, 0);
-    usleep(2000);
+    key_delay(timing.gap_us);
     emit(EV_KEY, KEY_LEFTCTRL, 0);
     emit(EV_SYN, SYN_REPORT, 0);
 }
 
-void type_char(unsigned char c) {
-    if (c >= 128) return;
+// One key event of a plan. A step with a delay closes the current report
+// and the injector waits delay_us before the next one; steps without one
+// share the report with whatever follows. PLAN_CHAR marks the press that
+// completes a character and PLAN_PREFIX one that starts it without
+// typing anything yet: a dead key, or Ctrl+Shift+U.
+#define PLAN_CHAR 0x01
+#define PLAN_PREFIX 0x02
 
-    int32_t kdef = ascii2keycode_map[c];
-    if (kdef == -1) return;
+struct plan_step {
+    uint16_t code;
+    uint8_t value;
+    uint8_t flags;
+    uint32_t delay_us;
+};
+
+struct key_plan {
+    struct plan_step steps[PLAN_MAX_STEPS];
+    size_t len;
+    size_t chars;     // characters that produced key presses
+    size_t events;    // input_events written, SYN reports included
+    uint64_t total_us;
+    uint8_t mods;     // MOD_ modifiers held after the last step
+};
+
+static const struct { uint8_t mod; uint16_t code; } modifier_keys[] = {
+    {MOD_CTRL, KEY_LEFTCTRL}, {MOD_SHIFT, KEY_LEFTSHIFT}, {MOD_ALTGR, KEY_RIGHTALT},
+};
 
-    uint16_t keycode = kdef & 0xffff;
+void plan_push(struct key_plan *plan, uint16_t code, uint8_t value, uint8_t flags, uint32_t delay_us) {
+    if (plan->len == PLAN_MAX_STEPS) return;
+    plan->steps[plan->len++] = (struct plan_step){code, value, flags, delay_us};
+    plan->events += delay_us ? 2 : 1;
+    plan->total_us += delay_us;
+}
 
-    if (kdef & FLAG_UPPERCASE) {
-        emit(EV_KEY, KEY_LEFTSHIFT, 1);
-        emit(EV_SYN, SYN_REPORT, 0);
-        usleep(2000);
+// Hold exactly the modifiers in mods. Releases share a report with the
+// next press; a press settles before the key it modifies.
+void plan_mods(struct key_plan *plan, uint8_t mods) {
+    for (size_t i = 0; i < sizeof(modifier_keys) / sizeof(modifier_keys[0]); i++) {
+        uint8_t mod = modifier_keys[i].mod;
+        if ((plan->mods & mod) && !(mods & mod)) plan_push(plan, modifier_keys[i].code, 0, 0, 0);
+    }
+    for (size_t i = 0; i < sizeof(modifier_keys) / sizeof(modifier_keys[0]); i++) {
+        uint8_t mod = modifier_keys[i].mod;
+        if (!(plan->mods & mod) && (mods & mod)) {
+            plan_push(plan, modifier_keys[i].code, 1, 0, timing.settle_us);
+        }
     }
+    plan->mods = mods;
+}
 
-    emit(EV_KEY, keycode, 1);
-    emit(EV_SYN, SYN_REPORT, 0);
-    usleep(8000);
+void plan_stroke(struct key_plan *plan, struct keystroke k, uint8_t flags) {
+    plan_mods(plan, k.mods);
+    plan_push(plan, k.code, 1, flags, timing.hold_us);
+    plan_push(plan, k.code, 0, 0, timing.gap_us);
+}
 
-    emit(EV_KEY, keycode, 0);
-    emit(EV_SYN, SYN_REPORT, 0);
-    usleep(2000);
+void plan_begin(struct key_plan *plan) {
+    plan->len = plan->chars = plan->events = 0;
+    plan->total_us = 0;
+    plan->mods = 0;
+}
+
+// Ctrl+Shift+U, the code point in lowercase hex, then space to commit.
+// set_layout made sure the layout has keys for all of them.
+void plan_hex(struct key_plan *plan, uint32_t cp) {
+    struct keystroke u = keymap_lookup(layout, 'u')->key;
+    u.mods |= MOD_CTRL | MOD_SHIFT;
+    plan_stroke(plan, u, PLAN_PREFIX);
+
+    char hex[9];
+    int n = snprintf(hex, sizeof(hex), "%x", cp);
+    for (int i = 0; i < n; i++) plan_stroke(plan, keymap_lookup(layout, (unsigned char)hex[i])->key, 0);
+    plan_stroke(plan, keymap_lookup(layout, ' ')->key, PLAN_CHAR);
+}
+
+// Add the keys that type cp. Returns 0 for a code point without keys
+// that hex entry can't type either, which is skipped; the script pastes
+// those through the clipboard. A newline typed on purpose presses Enter.
+// Returns -1 and adds nothing when the plan has no room left for a whole
+// character, so a plan never ends inside one.
+int plan_char(struct key_plan *plan, uint32_t cp) {
+    const struct keymap_entry *e = keymap_lookup(layout, cp);
+    if (!e && !char_typeable(cp)) return 0;
+    if (plan->len + PLAN_CHAR_MAX_STEPS + PLAN_END_STEPS > PLAN_MAX_STEPS) return -1;
+
+    if (!e) {
+        plan_hex(plan, cp);
+    } else {
+        if (e->dead.code) plan_stroke(plan, e->dead, PLAN_PREFIX);
+        plan_stroke(plan, e->key, PLAN_CHAR);
+    }
+    plan->chars++;
+    return 1;
+}
+
+void plan_end(struct key_plan *plan) {
+    plan_mods(plan, 0);
+    if (plan->len && plan->steps[plan->len - 1].delay_us == 0) {
+        plan->events++; // final SYN
+    }
+}
+
+// Resolve a UTF-8 string through the layout into a minimal key plan.
+// Modifiers are held across runs of characters that need them instead of
+// being cycled per character, so "HTTP API" costs two shift presses
+// rather than seven. Returns how much of s the plan covers, short of len
+// when it filled up.
+size_t plan_string(struct key_plan *plan, const char *s, size_t len) {
+    size_t i = 0;
+    plan_begin(plan);
+    while (i < len) {
+        size_t next = i;
+        if (plan_char(plan, utf8_next(s, len, &next)) < 0) break;
+        i = next;
+    }
+    plan_end(plan);
+    return i;
+}
+
+// Returns the number of characters pressed, which is short of plan->chars
+// when a cancel stopped the plan. A cancel never lands inside a character,
+// between a dead key and the key it applies to or in a hex sequence.
+size_t run_plan(const struct key_plan *plan) {
+    size_t chars = 0;
+    int in_char = 0;
+    for (size_t i = 0; i < plan->len; i++) {
+        const struct plan_step *step = &plan->steps[i];
+        if (step->value && !in_char && cancelled()) {
+            release_keys();
+            return chars;
+        }
+        emit(EV_KEY, step->code, step->value);
+        if (step->flags & PLAN_PREFIX) in_char = 1;
+        if (step->flags & PLAN_CHAR) {
+            in_char = 0;
+            chars++;
+        }
+        if (step->delay_us || i + 1 == plan->len) {
+            emit(EV_SYN, SYN_REPORT, 0);
+            if (step->delay_us) key_delay(step->delay_us);
+        }
+    }
+    return chars;
+}
+
+static struct key_plan string_plan;
 
-    if (kdef & FLAG_UPPERCASE) {
-        emit(EV_KEY, KEY_LEFTSHIFT, 0);
-        emit(EV_SYN, SYN_REPORT, 0);
+// Type a whole UTF-8 string, in one pass unless it needs more steps than
+// a plan holds
+size_t type_string(const char *s, size_t len) {
+    size_t chars = 0;
+    for (size_t off = 0; off < len;) {
+        off += plan_string(&string_plan, s + off, len - off);
+        size_t typed = run_plan(&string_plan);
+        chars += typed;
+        if (typed < string_plan.chars) break;
     }
+    return chars;
+}
+
+// Type n code points that are all typeable, at most SESSION_CHUNK_MAX,
+// which a plan always has room for
+size_t type_chars(const uint32_t *cps, size_t n) {
+    plan_begin(&string_plan);
+    for (size_t i = 0; i < n && plan_char(&string_plan, cps[i]) >= 0; i++);
+    plan_end(&string_plan);
+    return run_plan(&string_plan);
 }
 
 void do_backspace() {
     emit(EV_KEY, KEY_BACKSPACE, 1);
     emit(EV_SYN, SYN_REPORT, 0);
-    usleep(8000);
+    key_delay(timing.hold_us);
     emit(EV_KEY, KEY_BACKSPACE, 0);
     emit(EV_SYN, SYN_REPORT, 0);
 }
 
+// Returns how many were pressed before a cancel
+size_t do_backspaces(size_t n) {
+    size_t i;
+    for (i = 0; i < n && !cancelled(); i++) {
+        if (i > 0) key_delay(timing.gap_us);
+        do_backspace();
+    }
+    return i;
+}
+
 void do_key(int keycode) {
     emit(EV_KEY, keycode, 1);
     emit(EV_SYN, SYN_REPORT, 0);
-    usleep(8000);
+    key_delay(timing.hold_us);
     emit(EV_KEY, keycode, 0);
     emit(EV_SYN, SYN_REPORT, 0);
 }
 
-int setup_uinput() {
-    fd_uinput = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (fd_uinput < 0) {
-        perror("failed to open /dev/uinput");
-        return -1;
-    }
+// Session text: what session-set has typed since the last session-end, so
+// that a new version (a placeholder giving way to the transcript, a partial
+// transcript being corrected) erases only what differs instead of the whole
+// text. It is kept as code points, and only typeable ones, since nothing
+// else was typed: each is one backspace, even when it took a dead key and
+// a key or a hex sequence. The injection worker owns all of this.
+static uint32_t session_text[SESSION_TEXT_MAX];
+static size_t session_len = 0;
+static uint32_t session_next[SESSION_TEXT_MAX]; // text arriving in REQ_MORE parts
+static size_t session_next_len = 0;
+static uint32_t session_next_gen = 0;
 
-    ioctl(fd_uinput, UI_SET_EVBIT, EV_KEY);
-
-    // Register letters
-    for (int i = KEY_Q; i <= KEY_P; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i);
-    for (int i = KEY_A; i <= KEY_L; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i);
-    for (int i = KEY_Z; i <= KEY_M; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i);
-
-    // Register numbers
-    for (int i = KEY_1; i <= KEY_0; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i);
-
-    // Register special keys
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_SPACE);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_MINUS);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_EQUAL);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_LEFTBRACE);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_RIGHTBRACE);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_SEMICOLON);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_APOSTROPHE);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_GRAVE);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_BACKSLASH);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_COMMA);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_DOT);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_SLASH);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_TAB);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_ENTER);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_BACKSPACE);
-
-    // Register modifiers
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_LEFTCTRL);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_RIGHTCTRL);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_LEFTALT);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_RIGHTALT);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_LEFTSHIFT);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_RIGHTSHIFT);
-    ioctl(fd_uinput, UI_SET_KEYBIT, KEY_LEFTMETA);
-
-    struct uinput_setup setup = {0};
-    setup.id.bustype = BUS_USB;
-    setup.id.vendor = 0x1234;
-    setup.id.product = 0x5678;
-    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "xhisper");
-
-    if (ioctl(fd_uinput, UI_DEV_SETUP, &setup) < 0) {
-        perror("failed to setup uinput device");
-        return -1;
+// Append the typeable characters of s to the pending session text. Parts
+// left over from before a cancel are dropped.
+void session_stage(const char *s, size_t len) {
+    if (session_next_gen != active_gen) session_next_len = 0;
+    session_next_gen = active_gen;
+
+    for (size_t i = 0; i < len && session_next_len < SESSION_TEXT_MAX;) {
+        uint32_t cp = utf8_next(s, len, &i);
+        if (char_typeable(cp)) session_next[session_next_len++] = cp;
     }
-    if (ioctl(fd_uinput, UI_DEV_CREATE) < 0) {
-        perror("failed to create uinput device");
-        return -1;
+}
+
+// Turn the session text into the pending text: backspace over the part
+// after the common prefix and type the new tail. A cancel leaves the
+// session text matching whatever was erased and typed so far.
+void session_apply() {
+    size_t prefix = 0;
+    while (prefix < session_len && prefix < session_next_len &&
+           session_text[prefix] == session_next[prefix]) {
+        prefix++;
     }
 
-    usleep(100000);
-    return 0;
-}
+    size_t erase = session_len - prefix;
+    size_t erased = do_backspaces(erase);
+    session_len -= erased;
 
-int setup_socket() {
-    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
-    if (runtime_dir && runtime_dir[0]) {
-        snprintf(socket_path, SOCKET_PATH_LEN, "%s/.xhisper_socket", runtime_dir);
-    } else {
-        snprintf(socket_path, SOCKET_PATH_LEN, "/tmp/.xhisper_socket");
+    size_t typed = 0;
+    if (erased == erase) {
+        if (erased) key_delay(timing.gap_us);
+        while (session_len < session_next_len && !cancelled()) {
+            size_t chunk = session_next_len - session_len;
+            if (chunk > SESSION_CHUNK_MAX) chunk = SESSION_CHUNK_MAX;
+
+            size_t n = type_chars(session_next + session_len, chunk);
+            memcpy(session_text + session_len, session_next + session_len, n * sizeof(uint32_t));
+            session_len += n;
+            typed += n;
+            if (n < chunk) break;
+        }
     }
+    session_next_len = 0;
 
+    fprintf(stderr, "xhispertoold: session text kept %zu, erased %zu, typed %zu characters\n",
+            prefix, erased, typed);
+}
+
+int bind_socket(const char *path) {
     struct stat st;
-    if (stat(socket_path, &st) == 0) {
-        int test_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (stat(path, &st) == 0) {
+        int test_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
         struct sockaddr_un test_addr = {.sun_family = AF_UNIX};
-        strncpy(test_addr.sun_path, socket_path, sizeof(test_addr.sun_path) - 1);
+        strncpy(test_addr.sun_path, path, sizeof(test_addr.sun_path) - 1);
 
         if (connect(test_fd, (struct sockaddr*)&test_addr, sizeof(test_addr)) == 0) {
             close(test_fd);
@@ -221,199 +804,2149 @@ int setup_socket() {
             return -1;
         }
         close(test_fd);
-        unlink(socket_path);
+        unlink(path);
     }
 
-    fd_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (fd_socket < 0) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
         perror("failed to create socket");
         return -1;
     }
 
     struct sockaddr_un addr = {.sun_family = AF_UNIX};
-    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-    if (bind(fd_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("failed to bind socket");
+        close(fd);
         return -1;
     }
 
-    chmod(socket_path, 0600);
-    return 0;
+    chmod(path, 0600);
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-// Daemon mode
-int run_daemon() {
-    atexit(cleanup);
+// Socket activation: a supervisor such as systemd passes the already bound
+// listening socket as fd 3 with LISTEN_PID/LISTEN_FDS set
+int inherited_socket() {
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1) return -1;
 
-    if (setup_uinput() < 0) {
-        return 1;
-    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
 
-    if (setup_socket() < 0) {
-        return 1;
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+        type != SOCK_SEQPACKET) {
+        fprintf(stderr, "xhispertoold: inherited fd %d is not a seqpacket socket\n", LISTEN_FDS_START);
+        return -1;
     }
 
-    printf("xhispertoold: listening on %s\n", socket_path);
+    fcntl(LISTEN_FDS_START, F_SETFL, fcntl(LISTEN_FDS_START, F_GETFL) | O_NONBLOCK);
+    fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return LISTEN_FDS_START;
+}
 
-    char buf[2];
-    while (1) {
-        ssize_t n = recv(fd_socket, buf, sizeof(buf), 0);
-        if (n >= 1) {
-            char cmd = buf[0];
-            if (cmd == 'p') {
-                do_paste();
-            } else if (cmd == 't' && n == 2) {
-                type_char((unsigned char)buf[1]);
-            } else if (cmd == 'b') {
-                do_backspace();
-            } else if (cmd == 'r') {
-                do_key(KEY_RIGHTALT);
-            } else if (cmd == 'L') {
-                do_key(KEY_LEFTALT);
-            } else if (cmd == 'C') {
-                do_key(KEY_LEFTCTRL);
-            } else if (cmd == 'R') {
-                do_key(KEY_RIGHTCTRL);
-            } else if (cmd == 'S') {
-                do_key(KEY_LEFTSHIFT);
-            } else if (cmd == 'T') {
-                do_key(KEY_RIGHTSHIFT);
-            } else if (cmd == 'M') {
-                do_key(KEY_LEFTMETA);
-            }
-        }
+int setup_socket() {
+    get_socket_path(socket_path, ".xhisper_socket");
+
+    // The supervisor owns an inherited socket's path, so leave it in place
+    fd_socket = inherited_socket();
+    if (fd_socket >= 0) {
+        socket_path[0] = 0;
+        return 0;
     }
 
+    fd_socket = bind_socket(socket_path);
+    if (fd_socket < 0) {
+        socket_path[0] = 0;
+        return -1;
+    }
     return 0;
 }
 
-// Client mode
-void show_usage() {
-    fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  xhispertool paste            - Paste from clipboard (Ctrl+V)\n");
-    fprintf(stderr, "  xhispertool type <char>      - Type a single ASCII character\n");
-    fprintf(stderr, "  xhispertool backspace        - Press backspace\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Input switching keys:\n");
-    fprintf(stderr, "  xhispertool leftalt          - Press left alt\n");
-    fprintf(stderr, "  xhispertool rightalt         - Press right alt\n");
-    fprintf(stderr, "  xhispertool leftctrl         - Press left ctrl\n");
-    fprintf(stderr, "  xhispertool rightctrl        - Press right ctrl\n");
-    fprintf(stderr, "  xhispertool leftshift        - Press left shift\n");
-    fprintf(stderr, "  xhispertool rightshift       - Press right shift\n");
-    fprintf(stderr, "  xhispertool super            - Press super (Windows key)\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Daemon:\n");
-    fprintf(stderr, "  xhispertoold                 - Run daemon (or xhispertool --daemon)\n");
-}
+// Run one queued command on the injection worker and return its status
+uint8_t run_command(struct queued_cmd *slot) {
+    const struct request *req = &slot->req;
+    const char *data = slot->data;
 
-int run_client(int argc, char *argv[]) {
-    if (argc < 2) {
-        show_usage();
-        return 1;
+    timing = default_timing;
+    if (req->flags & REQ_TIMING) {
+        timing = (struct timing_profile){"request", req->hold_us, req->gap_us, req->settle_us};
     }
+    inject_failed = 0;
 
-    char socket_path[SOCKET_PATH_LEN];
-    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
-    if (runtime_dir && runtime_dir[0]) {
-        snprintf(socket_path, SOCKET_PATH_LEN, "%s/.xhisper_socket", runtime_dir);
+    char cmd = req->cmd;
+    if (cmd == 'p') {
+        do_paste();
+    } else if (cmd == 's' || cmd == 't') {
+        type_string(data, req->len);
+    } else if (cmd == 'E') {
+        session_stage(data, req->len);
+        if (!(req->flags & REQ_MORE)) session_apply();
+    } else if (cmd == 'e') {
+        session_len = session_next_len = 0;
+    } else if (cmd == 'b' && req->len == 2) {
+        do_backspaces(get_u16(data));
+    } else if (cmd == 'b') {
+        do_backspace();
+    } else if (cmd == 'r') {
+        do_key(KEY_RIGHTALT);
+    } else if (cmd == 'L') {
+        do_key(KEY_LEFTALT);
+    } else if (cmd == 'C') {
+        do_key(KEY_LEFTCTRL);
+    } else if (cmd == 'R') {
+        do_key(KEY_RIGHTCTRL);
+    } else if (cmd == 'S') {
+        do_key(KEY_LEFTSHIFT);
+    } else if (cmd == 'T') {
+        do_key(KEY_RIGHTSHIFT);
+    } else if (cmd == 'M') {
+        do_key(KEY_LEFTMETA);
     } else {
-        snprintf(socket_path, SOCKET_PATH_LEN, "/tmp/.xhisper_socket");
+        return REPLY_INVALID;
     }
+    flush_events();
 
-    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (fd < 0) {
-        perror("failed to create socket");
-        return 1;
+    if (cancelled()) return REPLY_CANCELLED;
+    return inject_failed ? REPLY_FAILED : REPLY_DONE;
+}
+
+// Trace the keys of a dictation's transcript: first_key once per session,
+// last_key after every command that injected something
+void trace_injection(char cmd) {
+    static uint32_t first_traced = 0;
+    uint32_t session = atomic_load_explicit(&trace_session, memory_order_relaxed);
+    if (cmd == 'e') atomic_compare_exchange_strong(&trace_session, &session, 0);
+    if (!session || !first_event_ns) return;
+
+    if (first_traced != session) {
+        trace_stage(session, "first_key", -1, first_event_ns);
+        first_traced = session;
     }
+    trace_stage(session, "last_key", -1, last_event_ns);
+}
 
-    struct sockaddr_un addr = {.sun_family = AF_UNIX};
-    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+// Injection worker: runs queued commands in order and leaves the status in
+// the slot for the receiver. Commands queued before the latest cancel are
+// skipped without touching uinput.
+void *injection_worker(void *arg) {
+    (void)arg;
 
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        int err = errno;
-        fprintf(stderr, "failed to connect to xhispertoold: %s\n", strerror(err));
+    while (1) {
+        size_t done = atomic_load_explicit(&queue_done, memory_order_relaxed);
+        if (done == atomic_load_explicit(&queue_tail, memory_order_acquire)) {
+            eventfd_t v;
+            eventfd_read(fd_work, &v);
+            continue;
+        }
 
-        switch (err) {
-            case ENOENT:
-            case ECONNREFUSED:
-                fprintf(stderr, "Please check if xhispertoold is running.\n");
-                fprintf(stderr, "Start it with: xhispertoold &\n");
-                break;
-            case EACCES:
-            case EPERM:
-                fprintf(stderr, "Permission denied. Check socket permissions.\n");
-                break;
+        struct queued_cmd *slot = &cmd_queue[done % QUEUE_SLOTS];
+        active_gen = slot->cancel_gen;
+        if (cancelled()) {
+            slot->status = REPLY_CANCELLED;
+            slot->elapsed_us = 0;
+        } else {
+            uint64_t start = monotonic_ns();
+            first_event_ns = 0;
+            slot->status = run_command(slot);
+            uint64_t end = monotonic_ns();
+            slot->elapsed_us = (end - start) / 1000;
+            if (first_event_ns) hist_record(&stats.first_event, (first_event_ns - slot->received_ns) / 1000);
+            hist_record(&stats.completion, (end - slot->received_ns) / 1000);
+            trace_injection(slot->req.cmd);
         }
-        close(fd);
-        return 2;
+        counter_add(&stats.outcomes[slot->status], 1);
+
+        atomic_store_explicit(&queue_done, done + 1, memory_order_release);
+        eventfd_write(fd_done, 1);
     }
 
-    char buf[2];
-    ssize_t len = 0;
+    return NULL;
+}
 
-    if (strcmp(argv[1], "paste") == 0) {
-        buf[0] = 'p';
-        len = 1;
-    } else if (strcmp(argv[1], "backspace") == 0) {
-        buf[0] = 'b';
-        len = 1;
-    } else if (strcmp(argv[1], "rightalt") == 0) {
-        buf[0] = 'r';
-        len = 1;
-    } else if (strcmp(argv[1], "leftalt") == 0) {
-        buf[0] = 'L';
-        len = 1;
-    } else if (strcmp(argv[1], "leftctrl") == 0) {
-        buf[0] = 'C';
-        len = 1;
-    } else if (strcmp(argv[1], "rightctrl") == 0) {
-        buf[0] = 'R';
-        len = 1;
-    } else if (strcmp(argv[1], "leftshift") == 0) {
-        buf[0] = 'S';
-        len = 1;
-    } else if (strcmp(argv[1], "rightshift") == 0) {
-        buf[0] = 'T';
-        len = 1;
-    } else if (strcmp(argv[1], "super") == 0) {
-        buf[0] = 'M';
-        len = 1;
-    } else if (strcmp(argv[1], "type") == 0) {
-        if (argc != 3 || strlen(argv[2]) != 1) {
-            fprintf(stderr, "Error: 'type' requires exactly one character argument\n");
-            show_usage();
-            close(fd);
-            return 1;
+void send_reply(int fd, uint32_t seq, uint8_t status, uint32_t elapsed_us) {
+    struct reply r = {.seq = seq, .status = status, .elapsed_us = elapsed_us};
+    send(fd, &r, sizeof(r), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void send_reply_text(int fd, uint32_t seq, uint8_t status, const char *text) {
+    size_t len = strnlen(text, MSG_MAX);
+    struct reply r = {.seq = seq, .status = status, .len = len};
+    struct iovec iov[2] = {
+        {.iov_base = &r, .iov_len = sizeof(r)},
+        {.iov_base = (void *)text, .iov_len = len},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+// Canonical 44-byte header for captured audio (mono s16 at CAPTURE_RATE)
+void wav_header(uint8_t *h, uint32_t data_len) {
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 36 + data_len);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1); // PCM
+    put_le16(h + 22, 1);
+    put_le32(h + 24, CAPTURE_RATE);
+    put_le32(h + 28, CAPTURE_BYTES_PER_S);
+    put_le16(h + 32, 2);
+    put_le16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, data_len);
+}
+
+// Write the last finished session to fd as a WAV file
+int write_clip_wav(int fd) {
+    uint8_t hdr[WAV_HEADER_LEN];
+    wav_header(hdr, recording.clip_len);
+    struct iovec iov[2] = {
+        {.iov_base = hdr, .iov_len = sizeof(hdr)},
+        {.iov_base = recording.clip, .iov_len = recording.clip_len},
+    };
+    size_t total = sizeof(hdr) + recording.clip_len, done = 0;
+
+    while (done < total) {
+        ssize_t n = writev(fd, iov, 2);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+        for (int i = 0; i < 2 && n > 0; i++) {
+            size_t used = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + used;
+            iov[i].iov_len -= used;
+            n -= used;
         }
-        buf[0] = 't';
-        buf[1] = argv[2][0];
-        len = 2;
-    } else {
-        fprintf(stderr, "Error: Unknown command '%s'\n", argv[1]);
-        show_usage();
-        close(fd);
-        return 1;
     }
+    return 0;
+}
 
-    if (write(fd, buf, len) != len) {
-        perror("failed to send command");
-        close(fd);
+// Append everything the capture child writes to the ring until EOF
+void *capture_thread(void *arg) {
+    (void)arg;
+    uint64_t pos = atomic_load_explicit(&capture_bytes, memory_order_relaxed);
+
+    while (1) {
+        size_t off = pos % CAPTURE_RING_BYTES;
+        size_t want = CAPTURE_RING_BYTES - off;
+        if (want > CAPTURE_READ_MAX) want = CAPTURE_READ_MAX;
+
+        ssize_t n = read(recording.pipe_fd, capture_ring + off, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        pos += n;
+        atomic_store_explicit(&capture_bytes, pos, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// Spawn the capture command in its own process group with its stdout on
+// a pipe to the capture thread. SIGINT and SIGTERM are reset to their
+// defaults, since a daemon started from a script's background job
+// inherits them ignored.
+int start_capture(int fd_epoll) {
+    char *const argv[] = {"sh", "-c", (char *)capture_command, NULL};
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, mask;
+    int pipe_fds[2];
+
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("xhispertoold: failed to create capture pipe");
+        return -1;
+    }
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipe_fds[1]);
+    if (err) {
+        fprintf(stderr, "xhispertoold: failed to start capture: %s\n", strerror(err));
+        close(pipe_fds[0]);
+        return -1;
+    }
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        perror("xhispertoold: pidfd_open failed");
+        kill(-pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(pipe_fds[0]);
+        return -1;
+    }
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+    // A child that wrote an odd number of bytes must not shift the samples
+    // of the next one
+    uint64_t pos = atomic_load_explicit(&capture_bytes, memory_order_relaxed);
+    atomic_store_explicit(&capture_bytes, (pos + 1) & ~1ull, memory_order_relaxed);
+
+    recording.pid = pid;
+    recording.pidfd = pidfd;
+    recording.pipe_fd = pipe_fds[0];
+    if (pthread_create(&recording.thread, NULL, capture_thread, NULL) != 0) {
+        fprintf(stderr, "xhispertoold: failed to start capture thread\n");
+        kill(-pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(pidfd);
+        close(pipe_fds[0]);
+        recording.pid = 0;
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = pidfd};
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, pidfd, &ev);
+    return 0;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reply done and pass passed_fd along with it, for payloads that do not
+// fit in a reply
+void send_reply_fd(int fd, uint32_t seq, int passed_fd) {
+    struct reply r = {.seq = seq, .status = REPLY_DONE};
+    struct iovec iov = {.iov_base = &r, .iov_len = sizeof(r)};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Hand the last finished session to the client as a WAV or FLAC memfd
+void send_clip(int fd, uint32_t seq, int flac) {
+    int clip_fd = memfd_create(flac ? "xhisper.flac" : "xhisper.wav", MFD_CLOEXEC);
+    int err = clip_fd < 0;
+    if (!err && flac) {
+        err = recording.flac.failed || write_all(clip_fd, recording.flac.out, recording.flac.out_len) < 0;
+    } else if (!err) {
+        err = write_clip_wav(clip_fd) < 0;
+    }
+    if (err || lseek(clip_fd, 0, SEEK_SET) < 0) {
+        if (clip_fd >= 0) close(clip_fd);
+        send_reply_text(fd, seq, REPLY_FAILED, "failed to copy the recording");
+        return;
+    }
+    send_reply_fd(fd, seq, clip_fd);
+    close(clip_fd);
+}
+
+// Answer record-text once the session is over and every segment is back:
+// the segment transcripts joined by single spaces, as a memfd
+void send_transcript() {
+    if (recording.active || recording.segments_done < recording.segments) return;
+
+    int fd = recording.text_fd;
+    uint32_t seq = recording.text_seq;
+    recording.text_fd = -1;
+    if (conn_ids[fd] != recording.text_conn_id) return;
+    if (recording.transcript_error[0]) {
+        send_reply_text(fd, seq, REPLY_FAILED, recording.transcript_error);
+        return;
+    }
+
+    char *text = join_transcripts(recording.texts, recording.segments, recording.overlapping);
+    int text_fd = memfd_create("xhisper.txt", MFD_CLOEXEC);
+    int err = !text || text_fd < 0 || write_all(text_fd, text, strlen(text)) < 0;
+    free(text);
+    if (err || lseek(text_fd, 0, SEEK_SET) < 0) {
+        if (text_fd >= 0) close(text_fd);
+        send_reply_text(fd, seq, REPLY_FAILED, "failed to copy the transcript");
+        return;
+    }
+    send_reply_fd(fd, seq, text_fd);
+    close(text_fd);
+    trace_stage(recording.session, "transcript", -1, monotonic_ns());
+    atomic_store_explicit(&trace_session, recording.session, memory_order_relaxed);
+}
+
+// Audio the VAD kept: append it to the clip and the FLAC stream
+void session_audio(void *ctx, const int16_t *pcm, size_t n) {
+    (void)ctx;
+    size_t len = n * sizeof(*pcm);
+    if (recording.clip_len + len > recording.clip_cap) {
+        size_t cap = recording.clip_cap ? recording.clip_cap : CAPTURE_BYTES_PER_S * 16;
+        while (cap < recording.clip_len + len) cap *= 2;
+        uint8_t *clip = realloc(recording.clip, cap);
+        if (!clip) {
+            recording.clip_failed = 1;
+            return;
+        }
+        recording.clip = clip;
+        recording.clip_cap = cap;
+    }
+    memcpy(recording.clip + recording.clip_len, pcm, len);
+    recording.clip_len += len;
+    flac_encode(&recording.flac, pcm, n);
+    if (recording.transcribe == TRANSCRIBE_STREAM) flac_encode(&recording.segment, pcm, n);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The pct-th percentile of recent round trips. A request the hedge beat
+// counts with the time it ran, which is less than it would have taken,
+// so a deadline that fires too often drifts down no further than that.
+double hedge_deadline_ms(int pct) {
+    size_t n = round_trip_count < HEDGE_HISTORY ? round_trip_count : HEDGE_HISTORY;
+    if (n < HEDGE_MIN_SAMPLES) return HEDGE_INITIAL_MS;
+    double sorted[HEDGE_HISTORY];
+    memcpy(sorted, round_trips, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_double);
+    return sorted[(n - 1) * pct / 100];
+}
+
+// A job for the session's next segment, with a slot for its transcript
+struct transcript_job *new_segment() {
+    struct transcript_job *job = malloc(sizeof(*job));
+    char **texts = realloc(recording.texts, (recording.segments + 1) * sizeof(*texts));
+    if (texts) recording.texts = texts;
+    if (!job || !texts) {
+        free(job);
+        snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+        return NULL;
+    }
+
+    *job = recording.request;
+    job->session = recording.session;
+    job->index = recording.segments;
+    if (recording.hedge_pct) job->hedge_after_ms = hedge_deadline_ms(recording.hedge_pct);
+    texts[recording.segments++] = NULL;
+    return job;
+}
+
+// Hand one FLAC stream to the transcription worker as the session's next
+// segment; audio is owned by the job from here on. pcm holds the same
+// samples, for the local model, which takes them undecoded.
+void submit_segment(uint8_t *audio, size_t len, const int16_t *pcm, uint64_t samples) {
+    struct transcript_job *job = new_segment();
+    if (job && job->local) {
+        job->pcm = malloc(samples * sizeof(*pcm));
+        if (job->pcm && !recording.clip_failed) {
+            memcpy(job->pcm, pcm, samples * sizeof(*pcm));
+            job->pcm_n = samples;
+        } else {
+            snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+            free(job->pcm);
+            free(job);
+            job = NULL;
+        }
+    }
+    if (!job) {
+        free(audio);
+        return;
+    }
+    job->audio = audio;
+    job->audio_len = len;
+    job->audio_s = (double)samples / CAPTURE_RATE;
+    transcribe_submit(job);
+}
+
+// Upload mode: append what the encoder has produced since the last call
+// to the running request; last also ends its body
+void feed_upload(int last) {
+    struct flac_encoder *enc = &recording.flac;
+    if (!recording.upload) return;
+    if (enc->failed ||
+        transcribe_append(recording.upload, enc->out + recording.upload_len,
+                          enc->out_len - recording.upload_len, last) < 0) {
+        snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+        if (!last) transcribe_append(recording.upload, NULL, 0, 1);
+        recording.upload = NULL;
+        return;
+    }
+    recording.upload_len = enc->out_len;
+    if (last) recording.upload = NULL;
+}
+
+// Upload mode: send the request at record-start, with only the FLAC
+// header as yet. Its STREAMINFO leaves the length unknown, which decoders
+// accept; the frames follow as they are encoded.
+void start_upload() {
+    struct transcript_job *job = new_segment();
+    if (!job) return;
+    job->streaming = 1;
+    job->hedge_after_ms = 0; // the body cannot be sent twice
+    recording.upload = job;
+    recording.upload_len = 0;
+    transcribe_submit(job);
+    feed_upload(0);
+}
+
+// Close the streaming segment and submit it, keeping the encoder for the next
+void cut_segment() {
+    struct flac_encoder *seg = &recording.segment;
+    if (seg->total_samples + seg->block_len == 0) return;
+
+    flac_finish(seg);
+    if (seg->failed) {
+        snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+    } else {
+        submit_segment(seg->out, seg->out_len,
+                       (const int16_t *)recording.clip + recording.segment_start, seg->total_samples);
+        seg->out = NULL;
+        seg->out_cap = 0;
+    }
+    recording.segment_start = recording.clip_len / 2;
+    flac_init(seg, CAPTURE_RATE);
+}
+
+// Submit the stopped session's clip in one request, or, past long_s, in
+// chunks cut at quiet spots that run in parallel. The local model takes
+// any length in one piece.
+void submit_clip() {
+    const int16_t *pcm = (const int16_t *)recording.clip;
+    size_t n = recording.clip_len / 2;
+    if (!recording.long_s || recording.request.local || (double)n / CAPTURE_RATE <= recording.long_s) {
+        // record-flac still needs the clip's own stream
+        uint8_t *audio = malloc(recording.flac.out_len);
+        if (audio) {
+            memcpy(audio, recording.flac.out, recording.flac.out_len);
+            submit_segment(audio, recording.flac.out_len, pcm, recording.flac.total_samples);
+        } else {
+            snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+        }
+        return;
+    }
+
+    // At least one chunk per connection, but none shorter than CHUNK_MIN_S
+    size_t count = (n + CHUNK_MAX_S * CAPTURE_RATE - 1) / (CHUNK_MAX_S * CAPTURE_RATE);
+    if (count < (size_t)transcribe_connections) count = transcribe_connections;
+    if (count > n / (CHUNK_MIN_S * CAPTURE_RATE)) count = n / (CHUNK_MIN_S * CAPTURE_RATE);
+    if (count < 1) count = 1;
+    struct chunk *chunks = malloc(count * sizeof(*chunks));
+    if (!chunks) {
+        snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+        return;
+    }
+    plan_chunks(pcm, n, CAPTURE_RATE, count, chunks);
+
+    if (recording.long_model[0]) {
+        snprintf(recording.request.model, sizeof(recording.request.model), "%s", recording.long_model);
+    }
+    recording.overlapping = 1;
+    struct flac_encoder enc = {0};
+    for (size_t i = 0; i < count; i++) {
+        flac_init(&enc, CAPTURE_RATE);
+        flac_encode(&enc, pcm + chunks[i].start, chunks[i].end - chunks[i].start);
+        if (flac_finish(&enc) < 0) {
+            snprintf(recording.transcript_error, sizeof(recording.transcript_error), "out of memory");
+            break;
+        }
+        submit_segment(enc.out, enc.out_len, pcm + chunks[i].start, enc.total_samples);
+        enc.out = NULL;
+        enc.out_cap = 0;
+    }
+    flac_free(&enc);
+    free(chunks);
+    printf("xhispertoold: %.3f s recording sent as %zu chunks over %d connections\n",
+           (double)n / CAPTURE_RATE, count, transcribe_connections);
+}
+
+// VAD pause: the phrase and its trailing pad are out, so a cut here
+// never splits a word
+void session_pause(void *ctx) {
+    (void)ctx;
+    struct flac_encoder *seg = &recording.segment;
+    if (recording.transcribe == TRANSCRIBE_STREAM &&
+        seg->total_samples + seg->block_len >= SEGMENT_MIN_S * CAPTURE_RATE) {
+        cut_segment();
+    }
+}
+
+// Run everything captured up to end through the VAD and the encoder
+void process_session(uint64_t end) {
+    uint64_t start_ns = monotonic_ns();
+
+    // The ring keeps CAPTURE_RING_S seconds; the slice being written is off limits
+    if (end - recording.processed > CAPTURE_RING_BYTES - CAPTURE_READ_MAX) {
+        recording.processed = end - (CAPTURE_RING_BYTES - CAPTURE_READ_MAX);
+        fprintf(stderr, "xhispertoold: fell behind the capture, skipping audio\n");
+    }
+
+    while (recording.processed < end) {
+        size_t off = recording.processed % CAPTURE_RING_BYTES;
+        size_t len = end - recording.processed;
+        if (len > CAPTURE_RING_BYTES - off) len = CAPTURE_RING_BYTES - off;
+        const int16_t *pcm = (const int16_t *)(capture_ring + off);
+        if (vad_enabled) {
+            vad_feed(&recording.vad, pcm, len / 2);
+        } else {
+            session_audio(NULL, pcm, len / 2);
+        }
+        recording.processed += len;
+    }
+    if (recording.transcribe == TRANSCRIBE_UPLOAD) feed_upload(0);
+
+    recording.process_ns += monotonic_ns() - start_ns;
+}
+
+void arm_process_timer(int on) {
+    struct itimerspec its = {0};
+    if (on) {
+        its.it_value.tv_nsec = PROCESS_INTERVAL_MS * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    timerfd_settime(fd_process, 0, &its, NULL);
+}
+
+void log_transcribed() {
+    printf("xhispertoold: transcribed %u segments, %.1f ms after stop", recording.segments,
+           (monotonic_ns() - recording.stop_ns) / 1e6);
+    if (recording.local_audio_s > 0) {
+        printf(", RTF %.3f over the recording", recording.local_ms / 1000 / recording.local_audio_s);
+    }
+    printf("\n");
+}
+
+// End the session: process the rest of its audio, finish the FLAC stream,
+// write the WAV file if one was asked for, and answer record-stop with
+// "<duration>[ <path>]", the duration being what is left after trimming
+void finish_session() {
+    uint64_t end = atomic_load_explicit(&capture_bytes, memory_order_acquire) & ~1ull;
+
+    arm_process_timer(0);
+    trace_stage(recording.session, "capture_stopped", -1, monotonic_ns());
+    process_session(end);
+    uint64_t finish_ns = monotonic_ns();
+    if (vad_enabled) vad_finish(&recording.vad);
+    flac_finish(&recording.flac);
+    if (recording.transcribe == TRANSCRIBE_STREAM) {
+        cut_segment();
+    } else if (recording.upload) {
+        // Only the last frames are left to send
+        size_t sent = transcribe_uploaded(recording.upload);
+        recording.upload->audio_s = (double)recording.flac.total_samples / CAPTURE_RATE;
+        feed_upload(1);
+        printf("xhispertoold: uploaded %zu of %zu bytes before stop (%.1f%%)\n", sent,
+               recording.flac.out_len,
+               recording.flac.out_len ? 100.0 * sent / recording.flac.out_len : 0.0);
+        // Nothing to transcribe: record-text gets an empty text, as in the other modes
+        if (!recording.clip_len) recording.segments = 0;
+    } else if (recording.transcribe == TRANSCRIBE_ONCE && recording.clip_len && !recording.flac.failed) {
+        submit_clip();
+    }
+    recording.process_ns += monotonic_ns() - finish_ns;
+    recording.stop_ns = monotonic_ns();
+    trace_stage(recording.session, "flushed", -1, recording.stop_ns);
+
+    uint8_t status = recording.clip_failed ? REPLY_FAILED : REPLY_DONE;
+    char text[PATH_MAX + 64];
+    snprintf(text, sizeof(text), "%.3f", (double)recording.clip_len / CAPTURE_BYTES_PER_S);
+    if (status == REPLY_DONE && recording.path[0]) {
+        int fd = open(recording.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0 || write_clip_wav(fd) < 0) {
+            perror("xhispertoold: failed to write recording");
+            status = REPLY_FAILED;
+        }
+        if (fd >= 0) close(fd);
+        size_t n = strlen(text);
+        snprintf(text + n, sizeof(text) - n, " %s", recording.path);
+    }
+
+    if (recording.stop_fd >= 0 && conn_ids[recording.stop_fd] == recording.stop_conn_id) {
+        send_reply_text(recording.stop_fd, recording.stop_seq, status,
+                        status == REPLY_DONE ? text : "failed to save the recording");
+    }
+
+    uint64_t captured = end - recording.start;
+    printf("xhispertoold: recorded %.3f s, kept %.3f s (%.1f%% silence removed), "
+           "%zu bytes FLAC (%.1f%% of PCM), processed in %.2f ms\n",
+           (double)captured / CAPTURE_BYTES_PER_S, (double)recording.clip_len / CAPTURE_BYTES_PER_S,
+           captured ? 100.0 * (captured - recording.clip_len) / captured : 0.0,
+           recording.flac.out_len,
+           recording.clip_len ? 100.0 * recording.flac.out_len / recording.clip_len : 0.0,
+           recording.process_ns / 1e6);
+    if (recording.segments && recording.segments_done == recording.segments) log_transcribed();
+    fflush(stdout);
+    recording.active = 0;
+    recording.stop_fd = -1;
+    if (recording.text_fd >= 0) send_transcript();
+}
+
+// The capture child has exited: reap it, let the capture thread drain the
+// pipe, and finish a session that was waiting for it
+void capture_exited() {
+    int status;
+    waitpid(recording.pid, &status, 0);
+    pthread_join(recording.thread, NULL);
+    close(recording.pidfd);
+    close(recording.pipe_fd);
+    recording.pid = 0;
+    recording.pidfd = -1;
+    recording.pipe_fd = -1;
+    timerfd_settime(fd_stop, 0, &(struct itimerspec){0}, NULL);
+
+    if (recording.stop_fd < 0 && !(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM)) {
+        fprintf(stderr, "xhispertoold: capture exited unexpectedly (status %d)\n", status);
+    }
+    if (recording.stop_fd >= 0) finish_session();
+}
+
+// Collect finished transcription requests. Results of an earlier session
+// are dropped.
+void collect_transcripts() {
+    struct transcript_job *job = transcribe_take_done();
+    while (job) {
+        struct transcript_job *next = job->next;
+        if (job == recording.upload) recording.upload = NULL; // failed before the end
+        if (!job->warm_up && (job->ok || job->hedged) && !job->streaming && !job->local) {
+            round_trips[round_trip_count++ % HEDGE_HISTORY] = job->primary_ms;
+        }
+        char connection[64] = "reused connection";
+        if (!job->http_status) {
+            snprintf(connection, sizeof(connection), "no connection");
+        } else if (job->new_connections) {
+            snprintf(connection, sizeof(connection), "new connection in %.1f ms", job->connect_ms);
+        }
+
+        if (job->warm_up) {
+            if (job->ok) {
+                printf("xhispertoold: endpoint ready, %s\n", connection);
+            } else {
+                fprintf(stderr, "xhispertoold: failed to reach the endpoint: %s\n", job->text);
+            }
+        } else if (job->session == recording.session && job->index < recording.segments) {
+            char hedge[160] = "";
+            if (job->hedged) {
+                snprintf(hedge, sizeof(hedge), ", hedged at %.0f ms: %s won, primary %.1f ms, hedge %.1f ms",
+                         job->hedge_sent_ms, job->hedge_won ? "hedge" : "primary", job->primary_ms,
+                         job->hedge_ms);
+            } else if (job->hedge_after_ms > 0) {
+                snprintf(hedge, sizeof(hedge), ", within the %.0f ms hedge deadline", job->hedge_after_ms);
+            }
+            if (job->local) {
+                // Real-time factor: decoding time per second of audio
+                recording.local_audio_s += job->audio_s;
+                recording.local_ms += job->primary_ms;
+                printf("xhispertoold: segment %u: %.3f s audio, decoded locally on %d threads in %.1f ms "
+                       "(RTF %.3f), %.1f ms after submitting%s\n",
+                       job->index, job->audio_s, localwhisper_threads(), job->primary_ms,
+                       job->audio_s ? job->primary_ms / 1000 / job->audio_s : 0.0,
+                       (job->done_ns - job->submit_ns) / 1e6, recording.active ? "" : " (after stop)");
+            } else {
+                printf("xhispertoold: segment %u: %.3f s audio, %zu bytes FLAC, %s%ld in %.1f ms, %s%s%s\n",
+                       job->index, job->audio_s, job->audio_len, job->http_status ? "HTTP " : "status ",
+                       job->http_status, (job->done_ns - job->submit_ns) / 1e6, connection, hedge,
+                       recording.active ? "" : " (after stop)");
+            }
+            trace_stage(job->session, "submitted", job->index, job->submit_ns);
+            trace_stage(job->session, "upload_start", job->index, job->upload_start_ns);
+            trace_stage(job->session, "upload_end", job->index, job->upload_end_ns);
+            trace_stage(job->session, "first_byte", job->index, job->first_byte_ns);
+            trace_stage(job->session, "parsed", job->index, job->done_ns);
+            if (job->ok) {
+                recording.texts[job->index] = job->text;
+                job->text = NULL;
+            } else if (!recording.transcript_error[0]) {
+                snprintf(recording.transcript_error, sizeof(recording.transcript_error),
+                         "transcription failed: %s", job->text ? job->text : "out of memory");
+            }
+            if (++recording.segments_done == recording.segments && !recording.active) {
+                log_transcribed();
+            }
+        }
+        transcribe_free(job);
+        job = next;
+    }
+    fflush(stdout);
+    if (recording.text_fd >= 0) send_transcript();
+}
+
+// Have a connection to the endpoint open by the time the first segment
+// is sent, so connecting and the TLS handshake happen while the user
+// speaks. A connection still pooled from the last dictation is reused.
+void warm_up_connection() {
+    const struct transcript_job *rq = &recording.request;
+    int hedge_elsewhere = rq->hedge_after_ms > 0 && strcmp(rq->hedge_url, rq->url) != 0;
+    for (int i = 0; i <= hedge_elsewhere; i++) {
+        struct transcript_job *job = malloc(sizeof(*job));
+        if (!job) return;
+        *job = *rq;
+        job->warm_up = 1;
+        job->session = recording.session;
+        if (i) {
+            memcpy(job->url, rq->hedge_url, sizeof(job->url));
+            memcpy(job->api_key, rq->hedge_key, sizeof(job->api_key));
+        }
+        transcribe_submit(job);
+    }
+}
+
+// record-start options: NUL-separated key=value fields
+int parse_record_options(const char *data, size_t len) {
+    struct transcript_job *rq = &recording.request;
+    memset(rq, 0, sizeof(*rq));
+    snprintf(rq->url, sizeof(rq->url), "%s", TRANSCRIBE_URL_DEFAULT);
+    snprintf(rq->model, sizeof(rq->model), "whisper-large-v3-turbo");
+    recording.path[0] = 0;
+    recording.transcribe = TRANSCRIBE_OFF;
+    recording.long_s = 0;
+    recording.long_model[0] = 0;
+    recording.hedge_pct = 0;
+
+    for (size_t off = 0; off < len;) {
+        const char *field = data + off;
+        size_t n = strnlen(field, len - off);
+        off += n + 1;
+        const char *value = memchr(field, '=', n);
+        if (!value) return -1;
+        size_t key_len = value - field, value_len = n - key_len - 1;
+        value++;
+
+        char *dest = NULL;
+        size_t cap = 0;
+        if (key_len == 4 && memcmp(field, "path", 4) == 0) {
+            dest = recording.path, cap = sizeof(recording.path);
+        } else if (key_len == 3 && memcmp(field, "url", 3) == 0) {
+            dest = rq->url, cap = sizeof(rq->url);
+        } else if (key_len == 3 && memcmp(field, "key", 3) == 0) {
+            dest = rq->api_key, cap = sizeof(rq->api_key);
+        } else if (key_len == 5 && memcmp(field, "model", 5) == 0) {
+            dest = rq->model, cap = sizeof(rq->model);
+        } else if (key_len == 6 && memcmp(field, "prompt", 6) == 0) {
+            dest = rq->prompt, cap = sizeof(rq->prompt);
+        } else if (key_len == 10 && memcmp(field, "long_model", 10) == 0) {
+            dest = recording.long_model, cap = sizeof(recording.long_model);
+        } else if (key_len == 9 && memcmp(field, "hedge_url", 9) == 0) {
+            dest = rq->hedge_url, cap = sizeof(rq->hedge_url);
+        } else if (key_len == 9 && memcmp(field, "hedge_key", 9) == 0) {
+            dest = rq->hedge_key, cap = sizeof(rq->hedge_key);
+        } else if (key_len == 11 && memcmp(field, "hedge_model", 11) == 0) {
+            dest = rq->hedge_model, cap = sizeof(rq->hedge_model);
+        } else if (key_len == 5 && memcmp(field, "local", 5) == 0) {
+            rq->local = 1;
+            continue;
+        } else if (key_len == 5 && memcmp(field, "hedge", 5) == 0) {
+            // "p95": the 95th percentile of recent round trips; or plain ms
+            if (value[0] == 'p') {
+                recording.hedge_pct = atoi(value + 1);
+                if (recording.hedge_pct < 1 || recording.hedge_pct > 99) return -1;
+                rq->hedge_after_ms = HEDGE_INITIAL_MS;
+            } else if ((rq->hedge_after_ms = strtod(value, NULL)) <= 0) {
+                return -1;
+            }
+            continue;
+        } else if (key_len == 6 && memcmp(field, "long_s", 6) == 0) {
+            recording.long_s = strtod(value, NULL);
+            continue;
+        } else if (key_len == 10 && memcmp(field, "transcribe", 10) == 0) {
+            if (value_len == 4 && memcmp(value, "once", 4) == 0) {
+                recording.transcribe = TRANSCRIBE_ONCE;
+            } else if (value_len == 6 && memcmp(value, "stream", 6) == 0) {
+                recording.transcribe = TRANSCRIBE_STREAM;
+            } else if (value_len == 6 && memcmp(value, "upload", 6) == 0) {
+                recording.transcribe = TRANSCRIBE_UPLOAD;
+            } else {
+                return -1;
+            }
+            continue;
+        } else {
+            return -1;
+        }
+        if (value_len >= cap) return -1;
+        memcpy(dest, value, value_len);
+        dest[value_len] = 0;
+    }
+
+    // The hedge goes to the same endpoint, with the same key, unless told otherwise
+    if (!rq->hedge_url[0]) memcpy(rq->hedge_url, rq->url, sizeof(rq->hedge_url));
+    if (!rq->hedge_key[0]) memcpy(rq->hedge_key, rq->api_key, sizeof(rq->hedge_key));
+    if (!rq->hedge_model[0]) memcpy(rq->hedge_model, rq->model, sizeof(rq->hedge_model));
+
+    // The local model needs no hedge, and decodes nothing before stop in upload mode
+    if (rq->local) {
+        rq->hedge_after_ms = 0;
+        recording.hedge_pct = 0;
+        if (recording.transcribe == TRANSCRIBE_UPLOAD) recording.transcribe = TRANSCRIBE_ONCE;
+    }
+    return 0;
+}
+
+void reset_transcript() {
+    for (uint32_t i = 0; i < recording.segments; i++) free(recording.texts[i]);
+    recording.segments = recording.segments_done = 0;
+    recording.transcript_error[0] = 0;
+    recording.overlapping = 0;
+}
+
+// record-start, record-stop, record-status, record-wav, record-flac and
+// record-text, answered by the receiver
+void record_command(int fd_epoll, int fd, const struct request *req, const char *data) {
+    char text[PATH_MAX + 64];
+
+    if (req->cmd == 'A') {
+        if (recording.active) {
+            send_reply_text(fd, req->seq, REPLY_FAILED, "already recording");
+            return;
+        }
+        if (parse_record_options(data, req->len) < 0) {
+            send_reply_text(fd, req->seq, REPLY_INVALID, "invalid recording options");
+            return;
+        }
+        // Pre-roll only exists when capture was already running
+        uint64_t now = atomic_load_explicit(&capture_bytes, memory_order_acquire) & ~1ull;
+        uint64_t start = now;
+        if (recording.pid) {
+            start = now > preroll_bytes ? now - preroll_bytes : 0;
+        } else if (start_capture(fd_epoll) < 0) {
+            send_reply_text(fd, req->seq, REPLY_FAILED, "failed to start audio capture");
+            return;
+        } else {
+            start = atomic_load_explicit(&capture_bytes, memory_order_relaxed);
+        }
+
+        if (recording.text_fd >= 0 && conn_ids[recording.text_fd] == recording.text_conn_id) {
+            send_reply_text(recording.text_fd, recording.text_seq, REPLY_FAILED, "a new recording started");
+        }
+        recording.text_fd = -1;
+        reset_transcript();
+        recording.session++;
+        recording.active = 1;
+        recording.start = start;
+        recording.start_ns = monotonic_ns();
+        atomic_store_explicit(&trace_session, 0, memory_order_relaxed);
+        trace_stage(recording.session, "start", -1, recording.start_ns);
+        recording.processed = start;
+        recording.process_ns = 0;
+        recording.clip_len = 0;
+        recording.clip_failed = 0;
+        vad_init(&recording.vad, session_audio, NULL);
+        recording.vad.pause = session_pause;
+        flac_init(&recording.flac, CAPTURE_RATE);
+        flac_init(&recording.segment, CAPTURE_RATE);
+        recording.segment_start = 0;
+        recording.local_audio_s = recording.local_ms = 0;
+        arm_process_timer(1);
+        if (recording.transcribe == TRANSCRIBE_UPLOAD) {
+            start_upload();
+        } else if (recording.transcribe != TRANSCRIBE_OFF && !recording.request.local) {
+            warm_up_connection();
+        }
+        send_reply_text(fd, req->seq, REPLY_DONE, "recording");
+    } else if (req->cmd == 'Z') {
+        if (!recording.active || recording.stop_fd >= 0) {
+            send_reply_text(fd, req->seq, REPLY_FAILED, "not recording");
+            return;
+        }
+        recording.stop_fd = fd;
+        recording.stop_conn_id = conn_ids[fd];
+        recording.stop_seq = req->seq;
+        trace_stage(recording.session, "toggle", -1, monotonic_ns());
+        if (recording.pid && !preroll_bytes) {
+            // Answered from capture_exited once the pipe has been drained;
+            // fd_stop makes sure that happens
+            struct itimerspec its = {.it_value = {CAPTURE_STOP_TIMEOUT_MS / 1000,
+                                                  CAPTURE_STOP_TIMEOUT_MS % 1000 * 1000000L}};
+            timerfd_settime(fd_stop, 0, &its, NULL);
+            kill(-recording.pid, SIGTERM);
+        } else {
+            finish_session();
+        }
+    } else if (req->cmd == 'W' || req->cmd == 'F') {
+        if (!recording.clip || recording.active) {
+            send_reply_text(fd, req->seq, REPLY_FAILED, "no finished recording");
+            return;
+        }
+        send_clip(fd, req->seq, req->cmd == 'F');
+    } else if (req->cmd == 'G') {
+        if (recording.transcribe == TRANSCRIBE_OFF || recording.text_fd >= 0) {
+            send_reply_text(fd, req->seq, REPLY_FAILED,
+                            recording.text_fd >= 0 ? "already waiting for the transcript"
+                                                   : "recording is not being transcribed");
+            return;
+        }
+        // Answered once the session has stopped and all segments are back
+        recording.text_fd = fd;
+        recording.text_conn_id = conn_ids[fd];
+        recording.text_seq = req->seq;
+        send_transcript();
+    } else {
+        if (recording.active) {
+            snprintf(text, sizeof(text), "recording %.3f",
+                     (monotonic_ns() - recording.start_ns) / 1e9);
+        } else {
+            snprintf(text, sizeof(text), "idle");
+        }
+        send_reply_text(fd, req->seq, REPLY_DONE, text);
+    }
+}
+
+// Stop the running command within one keystroke and drop everything queued
+void cancel_injection() {
+    atomic_fetch_add_explicit(&cancel_gen, 1, memory_order_relaxed);
+}
+
+// Client command names of the protocol letters, for the stats
+static const char *const command_names[128] = {
+    ['p'] = "paste", ['t'] = "type", ['s'] = "type-string", ['b'] = "backspace",
+    ['E'] = "session-set", ['e'] = "session-end", ['x'] = "cancel", ['?'] = "ping",
+    ['I'] = "stats", ['Y'] = "typeable", ['r'] = "rightalt", ['L'] = "leftalt", ['C'] = "leftctrl",
+    ['R'] = "rightctrl", ['S'] = "leftshift", ['T'] = "rightshift", ['M'] = "super",
+    ['A'] = "record-start", ['Z'] = "record-stop", ['Q'] = "record-status",
+    ['W'] = "record-wav", ['F'] = "record-flac", ['G'] = "record-text",
+};
+
+void format_histogram(char *buf, size_t cap, size_t *len, const char *name, const struct histogram *h) {
+    if (*len >= cap) return;
+    *len += snprintf(buf + *len, cap - *len, "  %-18s %8llu %8.2f %8.2f %8.2f %8.2f %8.2f\n", name,
+                     (unsigned long long)counter_get(&h->total), hist_percentile(h, 50) / 1e3,
+                     hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+                     hist_percentile(h, 99.9) / 1e3, counter_get(&h->max) / 1e3);
+}
+
+// The stats as text, for xhispertool stats and the periodic dump
+void format_stats(char *buf, size_t cap) {
+    size_t len = 0;
+    size_t depth = atomic_load_explicit(&queue_tail, memory_order_relaxed) -
+                   atomic_load_explicit(&queue_done, memory_order_relaxed);
+
+    len += snprintf(buf + len, cap - len, "uptime %.1f s\ncommands:",
+                    (monotonic_ns() - stats.started_ns) / 1e9);
+    for (int c = 0; c < 128 && len < cap; c++) {
+        uint64_t n = counter_get(&stats.commands[c]);
+        if (!n) continue;
+        if (command_names[c]) {
+            len += snprintf(buf + len, cap - len, " %s %llu", command_names[c], (unsigned long long)n);
+        } else {
+            len += snprintf(buf + len, cap - len, " '%c' %llu", c, (unsigned long long)n);
+        }
+    }
+    if (len < cap) {
+        len += snprintf(buf + len, cap - len,
+                        "\noutcomes: done %llu, cancelled %llu, failed %llu, busy %llu, invalid %llu\n"
+                        "queue: %zu waiting, at most %zu of %d\n"
+                        "%s writes: %llu batches of %llu events, %llu resumed, %llu failed, "
+                        "%llu events dropped\n"
+                        "latency ms              count      p50      p90      p99    p99.9      max\n",
+                        (unsigned long long)counter_get(&stats.outcomes[REPLY_DONE]),
+                        (unsigned long long)counter_get(&stats.outcomes[REPLY_CANCELLED]),
+                        (unsigned long long)counter_get(&stats.outcomes[REPLY_FAILED]),
+                        (unsigned long long)counter_get(&stats.outcomes[REPLY_BUSY]),
+                        (unsigned long long)counter_get(&stats.outcomes[REPLY_INVALID]),
+                        depth, stats.queue_max, QUEUE_SLOTS, backend->name,
+                        (unsigned long long)counter_get(&stats.flushes),
+                        (unsigned long long)counter_get(&stats.events),
+                        (unsigned long long)counter_get(&stats.write_retries),
+                        (unsigned long long)counter_get(&stats.write_failures),
+                        (unsigned long long)counter_get(&stats.events_dropped));
+    }
+    format_histogram(buf, cap, &len, "receive to first", &stats.first_event);
+    format_histogram(buf, cap, &len, "receive to done", &stats.completion);
+}
+
+// Hand finished slots back: send completion replies to clients that asked
+// to wait and are still connected, then free the slots
+void complete_commands() {
+    size_t done = atomic_load_explicit(&queue_done, memory_order_acquire);
+    while (queue_head != done) {
+        struct queued_cmd *slot = &cmd_queue[queue_head % QUEUE_SLOTS];
+        if ((slot->req.flags & REQ_WAIT) && conn_ids[slot->conn_fd] == slot->conn_id) {
+            send_reply(slot->conn_fd, slot->req.seq, slot->status, slot->elapsed_us);
+        }
+        queue_head++;
+    }
+}
+
+void close_connection(int fd) {
+    conn_ids[fd] = 0;
+    close(fd);
+}
+
+// Read every pending request on a client connection. Each one is answered
+// right away: queued, busy (queue full, nothing was queued) or invalid.
+// Cancel and the recording commands take effect immediately and never
+// enter the queue.
+void receive_requests(int fd_epoll, int fd) {
+    char scratch[MSG_MAX];
+
+    while (1) {
+        struct queued_cmd *slot = NULL;
+        size_t tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+        if (tail - queue_head < QUEUE_SLOTS) slot = &cmd_queue[tail % QUEUE_SLOTS];
+
+        struct request req;
+        struct iovec iov[2] = {
+            {.iov_base = &req, .iov_len = sizeof(req)},
+            {.iov_base = slot ? slot->data : scratch, .iov_len = MSG_MAX},
+        };
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n == 0) {
+            close_connection(fd);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) close_connection(fd);
+            return;
+        }
+        uint64_t received_ns = monotonic_ns();
+
+        if ((size_t)n < sizeof(req) || req.len != (size_t)n - sizeof(req)) {
+            counter_add(&stats.outcomes[REPLY_INVALID], 1);
+            send_reply(fd, n >= 4 ? req.seq : 0, REPLY_INVALID, 0);
+            continue;
+        }
+        counter_add(&stats.commands[req.cmd & 0x7f], 1);
+
+        if (req.cmd == 'x') {
+            cancel_injection();
+            send_reply(fd, req.seq, REPLY_DONE, 0);
+            continue;
+        }
+
+        if (req.cmd == '?') {
+            send_reply(fd, req.seq, REPLY_DONE, 0);
+            continue;
+        }
+
+        if (req.cmd == 'I') {
+            char text[MSG_MAX];
+            format_stats(text, sizeof(text));
+            send_reply_text(fd, req.seq, REPLY_DONE, text);
+            continue;
+        }
+
+        // The layout is fixed at startup, so this needs no worker
+        if (req.cmd == 'Y') {
+            char mask[MSG_MAX + 1];
+            typeable_mask(slot ? slot->data : scratch, req.len, mask);
+            send_reply_text(fd, req.seq, REPLY_DONE, mask);
+            continue;
+        }
+
+        if (req.cmd == 'A' || req.cmd == 'Z' || req.cmd == 'Q' || req.cmd == 'W' || req.cmd == 'F' ||
+            req.cmd == 'G') {
+            record_command(fd_epoll, fd, &req, slot ? slot->data : scratch);
+            continue;
+        }
+
+        if (!slot) {
+            counter_add(&stats.outcomes[REPLY_BUSY], 1);
+            send_reply(fd, req.seq, REPLY_BUSY, 0);
+            continue;
+        }
+
+        slot->req = req;
+        slot->conn_fd = fd;
+        slot->conn_id = conn_ids[fd];
+        slot->cancel_gen = atomic_load_explicit(&cancel_gen, memory_order_relaxed);
+        slot->received_ns = received_ns;
+        send_reply(fd, req.seq, REPLY_QUEUED, 0);
+        size_t depth = tail + 1 - atomic_load_explicit(&queue_done, memory_order_relaxed);
+        if (depth > stats.queue_max) stats.queue_max = depth;
+
+        atomic_store_explicit(&queue_tail, tail + 1, memory_order_release);
+        eventfd_write(fd_work, 1);
+    }
+}
+
+void accept_connections(int fd_epoll) {
+    static uint32_t next_conn_id = 0;
+
+    while (1) {
+        int fd = accept4(fd_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) perror("xhispertoold: accept failed");
+            return;
+        }
+        if (fd >= CONN_MAX) {
+            close(fd);
+            continue;
+        }
+
+        if (++next_conn_id == 0) next_conn_id = 1;
+        conn_ids[fd] = next_conn_id;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Tell whoever started us that requests are being served: write
+// "READY=1" to --ready-fd, and notify a systemd-style NOTIFY_SOCKET
+void notify_ready(int ready_fd) {
+    if (ready_fd >= 0) {
+        if (write(ready_fd, "READY=1\n", 8) != 8) perror("xhispertoold: failed to write ready fd");
+        close(ready_fd);
+    }
+
+    const char *notify = getenv("NOTIFY_SOCKET");
+    if (!notify || (notify[0] != '/' && notify[0] != '@')) return;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t len = strlen(notify);
+    if (len >= sizeof(addr.sun_path)) return;
+    memcpy(addr.sun_path, notify, len);
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = 0; // abstract namespace
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+
+    char msg[64];
+    int msg_len = snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%d", getpid());
+    sendto(fd, msg, msg_len, MSG_NOSIGNAL, (struct sockaddr *)&addr,
+           offsetof(struct sockaddr_un, sun_path) + len);
+    close(fd);
+    unsetenv("NOTIFY_SOCKET");
+}
+
+// Daemon mode
+int run_daemon(int argc, char *argv[]) {
+    const char *profile = getenv("XHISPER_PROFILE");
+    const char *preroll = getenv("XHISPER_PREROLL_MS");
+    const char *inject = getenv("XHISPER_INJECT");
+    int stats_interval = getenv("XHISPER_STATS_INTERVAL") ? atoi(getenv("XHISPER_STATS_INTERVAL")) : 0;
+    const char *trace = getenv("XHISPER_TRACE");
+    const char *layout_name = getenv("XHISPER_LAYOUT");
+    const char *unicode = getenv("XHISPER_UNICODE");
+    int ready_fd = -1;
+    if (getenv("XHISPER_CAPTURE")) capture_command = getenv("XHISPER_CAPTURE");
+    if (getenv("XHISPER_VAD") && strcmp(getenv("XHISPER_VAD"), "0") == 0) vad_enabled = 0;
+    if (getenv("XHISPER_CONNECTIONS")) transcribe_connections = atoi(getenv("XHISPER_CONNECTIONS"));
+    if (getenv("XHISPER_CA_FILE")) transcribe_set_ca_file(getenv("XHISPER_CA_FILE"));
+    const char *model_file = getenv("XHISPER_WHISPER_MODEL");
+    int model_threads = getenv("XHISPER_WHISPER_THREADS") ? atoi(getenv("XHISPER_WHISPER_THREADS")) : 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) continue;
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--ready-fd") == 0 && i + 1 < argc) {
+            ready_fd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_command = argv[++i];
+        } else if (strcmp(argv[i], "--preroll-ms") == 0 && i + 1 < argc) {
+            preroll = argv[++i];
+        } else if (strcmp(argv[i], "--no-vad") == 0) {
+            vad_enabled = 0;
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            transcribe_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ca-file") == 0 && i + 1 < argc) {
+            transcribe_set_ca_file(argv[++i]);
+        } else if (strcmp(argv[i], "--model-file") == 0 && i + 1 < argc) {
+            model_file = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            model_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--inject") == 0 && i + 1 < argc) {
+            inject = argv[++i];
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            layout_name = argv[++i];
+        } else if (strcmp(argv[i], "--unicode") == 0 && i + 1 < argc) {
+            unicode = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: xhispertoold [--profile <name|hold:gap:settle>] [--ready-fd <fd>]\n"
+                            "                    [--capture <command>] [--preroll-ms <ms>] [--no-vad]\n"
+                            "                    [--connections <n>] [--ca-file <pem>]\n"
+                            "                    [--model-file <ggml model>] [--threads <n>]\n"
+                            "                    [--inject <uinput|record:<file|fd:n>>] [--stats-interval <s>]\n"
+                            "                    [--trace <file>] [--layout <name>] [--unicode <paste|hex>]\n");
+            return 1;
+        }
+    }
+    if (transcribe_connections < 1) transcribe_connections = 1;
+    if (preroll) {
+        preroll_bytes = (uint64_t)strtoul(preroll, NULL, 10) * CAPTURE_BYTES_PER_S / 1000 & ~1ull;
+    }
+    if (profile && parse_timing_profile(profile, &default_timing) < 0) {
+        fprintf(stderr, "xhispertoold: unknown timing profile '%s'\n", profile);
+        return 1;
+    }
+    if (set_layout(layout_name, unicode) < 0) return 1;
+    if (inject && !(backend = inject_parse(inject, &backend_arg))) {
+        fprintf(stderr, "xhispertoold: unknown injection backend '%s'\n", inject);
+        return 1;
+    }
+    if (trace && trace[0]) {
+        fd_trace = open(trace, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd_trace < 0) {
+            fprintf(stderr, "xhispertoold: failed to open trace %s: %s\n", trace, strerror(errno));
+            return 1;
+        }
+    }
+
+    // Loaded before the daemon reports ready, once for every dictation
+    if (model_file) {
+        uint64_t load_ns = monotonic_ns();
+        if (localwhisper_load(model_file, model_threads) < 0) return 1;
+        printf("xhispertoold: loaded %s in %.0f ms, decoding on %d threads\n", model_file,
+               (monotonic_ns() - load_ns) / 1e6, localwhisper_threads());
+    }
+
+    atexit(cleanup);
+
+    fd_inject = backend->open(backend_arg);
+    if (fd_inject < 0) {
+        return 1;
+    }
+
+    if (setup_scheduler() < 0) {
         return 1;
     }
 
+    if (setup_socket() < 0) {
+        return 1;
+    }
+
+    // Address space for the whole ring up front; pages are only committed
+    // as audio arrives
+    capture_ring = mmap(NULL, CAPTURE_RING_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (capture_ring == MAP_FAILED) {
+        perror("failed to allocate capture buffer");
+        return 1;
+    }
+
+    fd_work = eventfd(0, EFD_CLOEXEC);
+    fd_done = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fd_process = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    fd_stop = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    fd_transcribed = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (fd_work < 0 || fd_done < 0 || fd_process < 0 || fd_stop < 0 || fd_transcribed < 0 ||
+        fd_epoll < 0) {
+        perror("failed to set up event loop");
+        return 1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = fd_socket;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_socket, &ev);
+    ev.data.fd = fd_done;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_done, &ev);
+    ev.data.fd = fd_process;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_process, &ev);
+    ev.data.fd = fd_stop;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_stop, &ev);
+    ev.data.fd = fd_transcribed;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_transcribed, &ev);
+
+    stats.started_ns = monotonic_ns();
+    if (stats_interval > 0) {
+        fd_stats = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        struct itimerspec every = {{stats_interval, 0}, {stats_interval, 0}};
+        if (fd_stats < 0 || timerfd_settime(fd_stats, 0, &every, NULL) < 0) {
+            perror("failed to set up stats timer");
+            return 1;
+        }
+        ev.data.fd = fd_stats;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_stats, &ev);
+    }
+
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, injection_worker, NULL) != 0) {
+        fprintf(stderr, "failed to start injection worker\n");
+        return 1;
+    }
+    if (transcribe_start(fd_transcribed, transcribe_connections) < 0) {
+        fprintf(stderr, "failed to start transcription worker\n");
+        return 1;
+    }
+
+    // With pre-roll the microphone stays open so record-start can reach back
+    if (preroll_bytes) start_capture(fd_epoll);
+
+    if (socket_path[0]) {
+        printf("xhispertoold: listening on %s\n", socket_path);
+    } else {
+        printf("xhispertoold: listening on inherited socket\n");
+    }
+    fflush(stdout);
+    notify_ready(ready_fd);
+
+    while (1) {
+        struct epoll_event events[16];
+        int n = epoll_wait(fd_epoll, events, 16, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("xhispertoold: epoll_wait failed");
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == fd_socket) {
+                accept_connections(fd_epoll);
+            } else if (fd == fd_done) {
+                eventfd_t v;
+                eventfd_read(fd_done, &v);
+                complete_commands();
+            } else if (fd == fd_process) {
+                uint64_t expirations;
+                if (read(fd_process, &expirations, sizeof(expirations)) > 0 && recording.active) {
+                    process_session(atomic_load_explicit(&capture_bytes, memory_order_acquire) & ~1ull);
+                }
+            } else if (fd == fd_stop) {
+                uint64_t expirations;
+                if (read(fd_stop, &expirations, sizeof(expirations)) > 0 && recording.pid) {
+                    fprintf(stderr, "xhispertoold: capture ignored SIGTERM for %d ms, killing it\n",
+                            CAPTURE_STOP_TIMEOUT_MS);
+                    kill(-recording.pid, SIGKILL);
+                }
+            } else if (fd == fd_transcribed) {
+                eventfd_t v;
+                eventfd_read(fd_transcribed, &v);
+                collect_transcripts();
+            } else if (fd == fd_stats) {
+                uint64_t expirations;
+                if (read(fd_stats, &expirations, sizeof(expirations)) > 0) {
+                    char text[MSG_MAX];
+                    format_stats(text, sizeof(text));
+                    fprintf(stderr, "xhispertoold: stats\n%s", text);
+                }
+            } else if (fd == recording.pidfd) {
+                capture_exited();
+            } else if (conn_ids[fd]) {
+                // Closing the fd also removes it from the epoll set
+                receive_requests(fd_epoll, fd);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Client mode
+void show_usage() {
+    fprintf(stderr, "Usage: xhispertool [--wait] [--profile <name|hold:gap:settle>] [--layout <name>] <command>\n");
+    fprintf(stderr, "  xhispertool paste            - Paste from clipboard (Ctrl+V)\n");
+    fprintf(stderr, "  xhispertool type <char>      - Type a single character\n");
+    fprintf(stderr, "  xhispertool type-string [s]  - Type a whole string (reads stdin if omitted)\n");
+    fprintf(stderr, "  xhispertool backspace [n]    - Press backspace (n times)\n");
+    fprintf(stderr, "  xhispertool session-set [s]  - Replace the text typed this session with s, erasing\n");
+    fprintf(stderr, "                                 only what differs (reads stdin if omitted)\n");
+    fprintf(stderr, "  xhispertool session-end      - Keep the session text and start a new session\n");
+    fprintf(stderr, "  xhispertool plan [s]         - Print the key event plan for a string (no daemon)\n");
+    fprintf(stderr, "  xhispertool typeable [s]     - Print t for each character the daemon types, - for\n");
+    fprintf(stderr, "                                 the others; exit 1 if any (with --layout or\n");
+    fprintf(stderr, "                                 --unicode: for those, no daemon)\n");
+    fprintf(stderr, "  xhispertool cancel           - Stop typing and drop queued commands\n");
+    fprintf(stderr, "  xhispertool wait-ready [ms]  - Wait until the daemon answers (default 5000 ms)\n");
+    fprintf(stderr, "  xhispertool stats            - Print command counts, queue depth, write errors\n");
+    fprintf(stderr, "                                 and injection latency percentiles\n");
+    fprintf(stderr, "  xhispertool record-start [options] [f]\n");
+    fprintf(stderr, "                               - Start recording (and save it as WAV file f on stop)\n");
+    fprintf(stderr, "      --transcribe             - Transcribe the recording when it stops\n");
+    fprintf(stderr, "      --stream                 - Transcribe in segments, cut at pauses while recording\n");
+    fprintf(stderr, "      --upload                 - Transcribe in one request, uploaded while recording\n");
+    fprintf(stderr, "      --model <m>              - Whisper model (default whisper-large-v3-turbo)\n");
+    fprintf(stderr, "      --prompt <p>             - Context for Whisper\n");
+    fprintf(stderr, "      --long-s <s>             - With --transcribe, send recordings longer than s\n");
+    fprintf(stderr, "                                 as parallel chunks\n");
+    fprintf(stderr, "      --long-model <m>         - Model for those recordings\n");
+    fprintf(stderr, "      --local                  - Transcribe with the daemon's whisper.cpp model\n");
+    fprintf(stderr, "      --hedge <ms|pNN>         - Resend a request with no answer after ms, or after\n");
+    fprintf(stderr, "                                 the NNth percentile of recent round trips\n");
+    fprintf(stderr, "      --hedge-url <u>          - Send that request here (key: XHISPER_HEDGE_API_KEY)\n");
+    fprintf(stderr, "      --hedge-model <m>        - With this model\n");
+    fprintf(stderr, "                                 Endpoint and key: XHISPER_API_URL, GROQ_API_KEY\n");
+    fprintf(stderr, "  xhispertool record-stop      - Stop recording, print \"<seconds>[ <file>]\"\n");
+    fprintf(stderr, "  xhispertool record-status    - Print the recording state, exit 1 when idle\n");
+    fprintf(stderr, "  xhispertool record-wav       - Write the last recording to stdout as WAV\n");
+    fprintf(stderr, "  xhispertool record-flac      - Write the last recording to stdout as FLAC\n");
+    fprintf(stderr, "  xhispertool record-text      - Wait for the transcript of the last recording\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Input switching keys:\n");
+    fprintf(stderr, "  xhispertool leftalt          - Press left alt\n");
+    fprintf(stderr, "  xhispertool rightalt         - Press right alt\n");
+    fprintf(stderr, "  xhispertool leftctrl         - Press left ctrl\n");
+    fprintf(stderr, "  xhispertool rightctrl        - Press right ctrl\n");
+    fprintf(stderr, "  xhispertool leftshift        - Press left shift\n");
+    fprintf(stderr, "  xhispertool rightshift       - Press right shift\n");
+    fprintf(stderr, "  xhispertool super            - Press super (Windows key)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --wait                       - Return once the keys have been injected\n");
+    fprintf(stderr, "  --profile <p>                - Timing profile for this command\n");
+    fprintf(stderr, "  --layout <name>              - Keyboard layout for plan and typeable (also\n");
+    fprintf(stderr, "                                 XHISPER_LAYOUT for plan; the daemon has its own)\n");
+    fprintf(stderr, "  --unicode <paste|hex>        - Unicode entry mode for plan and typeable (also\n");
+    fprintf(stderr, "                                 XHISPER_UNICODE for plan)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Daemon:\n");
+    fprintf(stderr, "  xhispertoold                 - Run daemon (or xhispertool --daemon)\n");
+    fprintf(stderr, "  xhispertoold --profile <p>   - Default timing profile (also XHISPER_PROFILE)\n");
+    fprintf(stderr, "  xhispertoold --ready-fd <fd> - Write READY=1 to fd once serving requests\n");
+    fprintf(stderr, "  xhispertoold --capture <cmd> - Command printing 16 kHz mono s16 PCM (also XHISPER_CAPTURE)\n");
+    fprintf(stderr, "  xhispertoold --preroll-ms <n>- Keep capturing and start recordings n ms early\n");
+    fprintf(stderr, "                                 (also XHISPER_PREROLL_MS)\n");
+    fprintf(stderr, "  xhispertoold --no-vad        - Keep silence in recordings (also XHISPER_VAD=0)\n");
+    fprintf(stderr, "  xhispertoold --connections <n> - Parallel transcription requests (default %d,\n",
+            TRANSCRIBE_CONNECTIONS_DEFAULT);
+    fprintf(stderr, "                                 also XHISPER_CONNECTIONS)\n");
+    fprintf(stderr, "  xhispertoold --ca-file <pem> - Trust these certificates for the endpoint\n");
+    fprintf(stderr, "                                 (also XHISPER_CA_FILE)\n");
+    fprintf(stderr, "  xhispertoold --model-file <f> - Load a whisper.cpp model for record-start --local\n");
+    fprintf(stderr, "                                 (also XHISPER_WHISPER_MODEL; needs make WHISPER=1)\n");
+    fprintf(stderr, "  xhispertoold --threads <n>   - Decoding threads (default one per CPU,\n");
+    fprintf(stderr, "                                 also XHISPER_WHISPER_THREADS)\n");
+    fprintf(stderr, "  xhispertoold --inject record:<f> - Write timestamped key events to file f (or fd:<n>)\n");
+    fprintf(stderr, "                                 instead of uinput (also XHISPER_INJECT)\n");
+    fprintf(stderr, "  xhispertoold --stats-interval <s> - Log the stats every s seconds\n");
+    fprintf(stderr, "                                 (also XHISPER_STATS_INTERVAL)\n");
+    fprintf(stderr, "  xhispertoold --trace <file>  - Append a JSON line per dictation stage (also XHISPER_TRACE)\n");
+    fprintf(stderr, "  xhispertoold --layout <name> - Type for this keyboard layout (default us, also\n");
+    fprintf(stderr, "                                 XHISPER_LAYOUT):");
+    for (size_t i = 0; i < keymap_count; i++) fprintf(stderr, " %s", keymaps[i].name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  xhispertoold --unicode hex   - Type characters without keys as Ctrl+Shift+U\n");
+    fprintf(stderr, "                                 sequences (IBus, GTK) instead of leaving them to\n");
+    fprintf(stderr, "                                 be pasted (also XHISPER_UNICODE)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Timing profiles: safe (default), fast, slow, or hold:gap:settle in microseconds\n");
+    fprintf(stderr, "Exit status: 0 ok, 1 error, 2 no daemon (or not ready), 3 daemon busy, 4 cancelled\n");
+}
+
+// Read all of stdin into a malloc'd buffer
+char *read_stdin(size_t *out_len) {
+    size_t cap = MSG_MAX, len = 0;
+    char *data = malloc(cap);
+    if (!data) return NULL;
+
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, data + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *grown = realloc(data, cap * 2);
+            if (!grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            cap *= 2;
+        }
+    }
+    if (n < 0) {
+        free(data);
+        return NULL;
+    }
+
+    *out_len = len;
+    return data;
+}
+
+// Client side of one connection: requests are numbered, and with --wait
+// every queued request is tracked until its completion reply arrives
+struct client {
+    int fd;
+    uint32_t next_seq;
+    uint8_t flags;
+    struct timing_profile timing;
+    unsigned int pending;  // queued requests still waiting for completion
+    uint8_t worst_status;  // most severe completion status seen
+    uint64_t elapsed_us;   // injection time summed over completions
+    char text[MSG_MAX + 1]; // text of the last reply, NUL-terminated
+    int passed_fd;          // fd passed with the last reply, or -1
+};
+
+// Completion statuses in increasing severity
+int status_rank(uint8_t status) {
+    switch (status) {
+        case REPLY_DONE: return 0;
+        case REPLY_CANCELLED: return 1;
+        default: return 2;
+    }
+}
+
+int read_reply(struct client *c, struct reply *r) {
+    struct iovec iov[2] = {
+        {.iov_base = r, .iov_len = sizeof(*r)},
+        {.iov_base = c->text, .iov_len = MSG_MAX},
+    };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov, .msg_iovlen = 2,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+    while ((n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (n < (ssize_t)sizeof(*r) || r->len != (size_t)n - sizeof(*r)) {
+        fprintf(stderr, "xhispertool: lost connection to xhispertoold\n");
+        return -1;
+    }
+    c->text[r->len] = 0;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        if (c->passed_fd >= 0) close(c->passed_fd);
+        memcpy(&c->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return 0;
+}
+
+void account_completion(struct client *c, const struct reply *r) {
+    if (c->pending) c->pending--;
+    c->elapsed_us += r->elapsed_us;
+    if (status_rank(r->status) > status_rank(c->worst_status)) c->worst_status = r->status;
+}
+
+// Send one request and wait for its acknowledgement. A busy daemon is
+// retried until CLIENT_BUSY_TIMEOUT_MS has passed. Completions of earlier
+// requests that arrive in between are accounted on the way.
+int client_request(struct client *c, char cmd, const char *payload, size_t len) {
+    char buf[sizeof(struct request) + MSG_MAX];
+    struct request *req = (struct request *)buf;
+
+    *req = (struct request){
+        .seq = c->next_seq++,
+        .cmd = cmd,
+        .flags = c->flags,
+        .len = len,
+        .hold_us = c->timing.hold_us,
+        .gap_us = c->timing.gap_us,
+        .settle_us = c->timing.settle_us,
+    };
+    memcpy(buf + sizeof(*req), payload, len);
+
+    uint64_t deadline = monotonic_ns() + CLIENT_BUSY_TIMEOUT_MS * 1000000ull;
+    while (1) {
+        if (send(c->fd, buf, sizeof(*req) + len, MSG_NOSIGNAL) < 0) {
+            perror("failed to send command");
+            return -1;
+        }
+
+        struct reply r;
+        do {
+            if (read_reply(c, &r) < 0) return -1;
+            if (r.seq != req->seq) account_completion(c, &r);
+        } while (r.seq != req->seq);
+
+        switch (r.status) {
+            case REPLY_QUEUED:
+                if (c->flags & REQ_WAIT) c->pending++;
+                return 0;
+            case REPLY_DONE:
+                return 0;
+            case REPLY_BUSY:
+                if (monotonic_ns() > deadline) {
+                    fprintf(stderr, "xhispertoold is busy, command not sent\n");
+                    return -2;
+                }
+                usleep(CLIENT_BUSY_RETRY_US);
+                break;
+            default:
+                if (r.len) {
+                    fprintf(stderr, "xhispertoold: %s\n", c->text);
+                } else {
+                    fprintf(stderr, "xhispertoold rejected the command\n");
+                }
+                return -1;
+        }
+    }
+}
+
+// Wait for all outstanding completions (--wait)
+int client_finish(struct client *c) {
+    while (c->pending) {
+        struct reply r;
+        if (read_reply(c, &r) < 0) return -1;
+        account_completion(c, &r);
+    }
+    if (c->worst_status == REPLY_CANCELLED) return -3;
+    if (c->worst_status != REPLY_DONE) {
+        fprintf(stderr, "xhispertoold failed to inject the command\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Length of the next piece of text to send or plan: at most
+// STRING_CHUNK_MAX bytes, ending on a character boundary. A run of stray
+// continuation bytes with no boundary in reach is cut anyway; they decode
+// as U+FFFD on either side.
+size_t string_chunk(const char *text, size_t len) {
+    if (len <= STRING_CHUNK_MAX) return len;
+
+    size_t chunk = STRING_CHUNK_MAX;
+    while (chunk > 0 && ((unsigned char)text[chunk] & 0xc0) == 0x80) chunk--;
+    return chunk ? chunk : STRING_CHUNK_MAX;
+}
+
+// Send text as cmd requests, splitting long text into chunks that never
+// cut a UTF-8 sequence in half. Session text ('E') goes out even when
+// empty, with REQ_MORE on every chunk but the last.
+int send_string(struct client *c, char cmd, const char *text, size_t len) {
+    size_t off = 0;
+    uint8_t flags = c->flags;
+
+    while (off < len || (cmd == 'E' && off == 0)) {
+        size_t chunk = string_chunk(text + off, len - off);
+
+        if (cmd == 'E' && off + chunk < len) c->flags |= REQ_MORE;
+        int ret = client_request(c, cmd, text + off, chunk);
+        c->flags = flags;
+        if (ret < 0) return ret;
+        off += chunk;
+        if (len == 0) break;
+    }
+
+    return 0;
+}
+
+// Print the event plan for text without touching uinput: one line per
+// input_event with its scheduled time, then a summary line
+int print_plan(const char *text, size_t len) {
+    size_t chars = 0, events = 0, off = 0;
+    uint64_t t_us = 0;
+
+    while (off < len) {
+        size_t chunk = string_chunk(text + off, len - off);
+        size_t planned = plan_string(&string_plan, text + off, chunk);
+        for (size_t i = 0; i < string_plan.len; i++) {
+            const struct plan_step *step = &string_plan.steps[i];
+            printf("%10.3f KEY %3u %u\n", t_us / 1000.0, step->code, step->value);
+            if (step->delay_us || i + 1 == string_plan.len) {
+                printf("%10.3f SYN\n", t_us / 1000.0);
+            }
+            t_us += step->delay_us;
+        }
+
+        chars += string_plan.chars;
+        events += string_plan.events;
+        off += planned;
+    }
+
+    printf("# profile=%u:%u:%u chars=%zu events=%zu events_per_char=%.2f scheduled_ms=%.3f\n",
+           timing.hold_us, timing.gap_us, timing.settle_us, chars, events,
+           chars ? (double)events / chars : 0.0, t_us / 1000.0);
+    return 0;
+}
+
+int print_typeable(const char *text, size_t len) {
+    char *mask = malloc(len + 1);
+    if (!mask) {
+        perror("malloc");
+        return 2;
+    }
+    int ret = typeable_mask(text, len, mask);
+    printf("%s\n", mask);
+    free(mask);
+    return ret;
+}
+
+// Map the single-key commands to their protocol letters
+char key_command(const char *name) {
+    static const struct { const char *name; char cmd; } keys[] = {
+        {"paste", 'p'}, {"cancel", 'x'},
+        {"rightalt", 'r'}, {"leftalt", 'L'}, {"leftctrl", 'C'}, {"rightctrl", 'R'},
+        {"leftshift", 'S'}, {"rightshift", 'T'}, {"super", 'M'},
+        {"record-stop", 'Z'}, {"record-status", 'Q'}, {"record-wav", 'W'},
+        {"record-flac", 'F'}, {"record-text", 'G'}, {"stats", 'I'},
+    };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (strcmp(name, keys[i].name) == 0) return keys[i].cmd;
+    }
+    return 0;
+}
+
+// Copy everything readable from in to out
+int copy_fd(int in, int out) {
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            off += w;
+        }
+    }
+    return 0;
+}
+
+// Returns a connected seqpacket socket, or -1 with errno set
+int connect_daemon() {
+    char path[SOCKET_PATH_LEN];
+    get_socket_path(path, ".xhisper_socket");
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Poll until the daemon accepts a connection and answers a ping. With
+// socket activation the connect succeeds at once and the reply arrives
+// once the daemon has started.
+int wait_ready(int timeout_ms) {
+    uint64_t deadline = monotonic_ns() + timeout_ms * 1000000ull;
+    int fd;
+
+    while ((fd = connect_daemon()) < 0) {
+        if (monotonic_ns() >= deadline) return 2;
+        usleep(1000);
+    }
+
+    struct request req = {.seq = 1, .cmd = '?'};
+    struct reply r;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    uint64_t now = monotonic_ns();
+    int reply_ms = deadline > now ? (deadline - now) / 1000000 : 0;
+    if (reply_ms < WAIT_READY_REPLY_MS) reply_ms = WAIT_READY_REPLY_MS;
+
+    int ready = send(fd, &req, sizeof(req), MSG_NOSIGNAL) == sizeof(req) &&
+                poll(&pfd, 1, reply_ms) > 0 &&
+                recv(fd, &r, sizeof(r), 0) == sizeof(r) && r.status == REPLY_DONE;
     close(fd);
+    return ready ? 0 : 2;
+}
+
+// Append one key=value field to a record-start payload
+int put_field(char *payload, size_t *len, const char *key, const char *value) {
+    int n = snprintf(payload + *len, MSG_MAX - *len, "%s=%s", key, value);
+    if (n < 0 || (size_t)n >= MSG_MAX - *len) {
+        fprintf(stderr, "Error: record-start options too long\n");
+        return -1;
+    }
+    *len += n + 1;
+    return 0;
+}
+
+// Build the record-start payload from its options. The endpoint and API
+// key come from the client's environment, so the daemon needs neither.
+int record_payload(int argc, char *argv[], char *payload, size_t *len) {
+    const char *mode = NULL;
+    *len = 0;
+
+    for (int i = 0; i < argc; i++) {
+        const char *opt = argv[i];
+        if (strcmp(opt, "--transcribe") == 0) {
+            if (!mode) mode = "once";
+        } else if (strcmp(opt, "--stream") == 0) {
+            mode = "stream";
+        } else if (strcmp(opt, "--upload") == 0) {
+            mode = "upload";
+        } else if (strcmp(opt, "--local") == 0) {
+            if (put_field(payload, len, "local", "1") < 0) return -1;
+        } else if ((strcmp(opt, "--model") == 0 || strcmp(opt, "--prompt") == 0) && i + 1 < argc) {
+            if (put_field(payload, len, opt + 2, argv[++i]) < 0) return -1;
+        } else if (strcmp(opt, "--long-s") == 0 && i + 1 < argc) {
+            if (put_field(payload, len, "long_s", argv[++i]) < 0) return -1;
+        } else if (strcmp(opt, "--long-model") == 0 && i + 1 < argc) {
+            if (put_field(payload, len, "long_model", argv[++i]) < 0) return -1;
+        } else if (strcmp(opt, "--hedge") == 0 && i + 1 < argc) {
+            if (put_field(payload, len, "hedge", argv[++i]) < 0) return -1;
+        } else if (strcmp(opt, "--hedge-url") == 0 && i + 1 < argc) {
+            if (put_field(payload, len, "hedge_url", argv[++i]) < 0) return -1;
+        } else if (strcmp(opt, "--hedge-model") == 0 && i + 1 < argc) {
+            if (put_field(payload, len, "hedge_model", argv[++i]) < 0) return -1;
+        } else if (opt[0] == '-' || i + 1 != argc) {
+            fprintf(stderr, "Error: Unknown record-start option '%s'\n", opt);
+            show_usage();
+            return -1;
+        } else {
+            // The daemon has its own working directory
+            char cwd[PATH_MAX] = "", path[PATH_MAX];
+            if (opt[0] != '/' && !getcwd(cwd, sizeof(cwd))) {
+                perror("failed to get working directory");
+                return -1;
+            }
+            int n = snprintf(path, sizeof(path), "%s%s%s", cwd, cwd[0] ? "/" : "", opt);
+            if (n >= (int)sizeof(path)) {
+                fprintf(stderr, "Error: recording path too long\n");
+                return -1;
+            }
+            if (put_field(payload, len, "path", path) < 0) return -1;
+        }
+    }
+
+    if (!mode) return 0;
+    if (put_field(payload, len, "transcribe", mode) < 0) return -1;
+    if (getenv("XHISPER_API_URL") && put_field(payload, len, "url", getenv("XHISPER_API_URL")) < 0) {
+        return -1;
+    }
+    if (getenv("GROQ_API_KEY") && put_field(payload, len, "key", getenv("GROQ_API_KEY")) < 0) {
+        return -1;
+    }
+    if (getenv("XHISPER_HEDGE_API_KEY") &&
+        put_field(payload, len, "hedge_key", getenv("XHISPER_HEDGE_API_KEY")) < 0) {
+        return -1;
+    }
     return 0;
 }
 
+int run_client(int argc, char *argv[]) {
+    struct client c = {.fd = -1, .next_seq = 1, .worst_status = REPLY_DONE, .passed_fd = -1};
+    const char *layout_name = getenv("XHISPER_LAYOUT");
+    const char *unicode = getenv("XHISPER_UNICODE");
+    int local_layout = 0; // --layout or --unicode: typeable answers without the daemon
+
+    while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--wait") == 0) {
+            c.flags |= REQ_WAIT;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--profile") == 0 && argc >= 3) {
+            if (parse_timing_profile(argv[2], &c.timing) < 0) {
+                fprintf(stderr, "Error: Unknown timing profile '%s'\n", argv[2]);
+                show_usage();
+                return 1;
+            }
+            timing = c.timing;
+            c.flags |= REQ_TIMING;
+            argc -= 2;
+            argv += 2;
+        } else if (strcmp(argv[1], "--layout") == 0 && argc >= 3) {
+            layout_name = argv[2];
+            local_layout = 1;
+            argc -= 2;
+            argv += 2;
+        } else if (strcmp(argv[1], "--unicode") == 0 && argc >= 3) {
+            unicode = argv[2];
+            local_layout = 1;
+            argc -= 2;
+            argv += 2;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[1]);
+            show_usage();
+            return 1;
+        }
+    }
+
+    if (argc < 2) {
+        show_usage();
+        return 1;
+    }
+    if (set_layout(layout_name, unicode) < 0) return 1;
+
+    int ask_daemon = strcmp(argv[1], "typeable") == 0 && !local_layout;
+    if (strcmp(argv[1], "plan") == 0 || (strcmp(argv[1], "typeable") == 0 && !ask_daemon)) {
+        int (*run)(const char *, size_t) = argv[1][0] == 'p' ? print_plan : print_typeable;
+        if (argc == 3) return run(argv[2], strlen(argv[2]));
+
+        size_t text_len;
+        char *text = read_stdin(&text_len);
+        if (!text) {
+            perror("failed to read stdin");
+            return 1;
+        }
+        int ret = run(text, text_len);
+        free(text);
+        return ret;
+    }
+
+    if (strcmp(argv[1], "wait-ready") == 0) {
+        return wait_ready(argc == 3 ? atoi(argv[2]) : WAIT_READY_TIMEOUT_MS);
+    }
+
+    // Validate arguments before connecting
+    char cmd = key_command(argv[1]);
+    char payload[MSG_MAX];
+    size_t payload_len = 0;
+    char *text = NULL;
+    size_t text_len = 0;
+
+    if (cmd) {
+        // No arguments
+    } else if (strcmp(argv[1], "backspace") == 0) {
+        cmd = 'b';
+        if (argc == 3) {
+            char *end;
+            long count = strtol(argv[2], &end, 10);
+            if (*end || count < 0 || count > 0xffff) {
+                fprintf(stderr, "Error: 'backspace' count must be between 0 and 65535\n");
+                return 1;
+            }
+            put_u16(payload, count);
+            payload_len = 2;
+        }
+    } else if (strcmp(argv[1], "type") == 0) {
+        size_t end = 0;
+        if (argc == 3 && argv[2][0]) utf8_next(argv[2], strlen(argv[2]), &end);
+        if (argc != 3 || !argv[2][0] || argv[2][end]) {
+            fprintf(stderr, "Error: 'type' requires exactly one character argument\n");
+            show_usage();
+            return 1;
+        }
+        cmd = 't';
+        memcpy(payload, argv[2], end);
+        payload_len = end;
+    } else if (strcmp(argv[1], "record-start") == 0) {
+        cmd = 'A';
+        if (record_payload(argc - 2, argv + 2, payload, &payload_len) < 0) return 1;
+    } else if (strcmp(argv[1], "session-end") == 0) {
+        cmd = 'e';
+    } else if (ask_daemon) {
+        // What the running daemon types, whatever layout it was started with
+        cmd = 'Y';
+        char *s = argc == 3 ? strdup(argv[2]) : read_stdin(&payload_len);
+        if (!s) {
+            perror("failed to read text");
+            return 1;
+        }
+        if (argc == 3) payload_len = strlen(s);
+        if (payload_len > MSG_MAX) {
+            fprintf(stderr, "Error: 'typeable' text is longer than %d bytes\n", MSG_MAX);
+            free(s);
+            return 1;
+        }
+        memcpy(payload, s, payload_len);
+        free(s);
+    } else if (strcmp(argv[1], "type-string") == 0 || strcmp(argv[1], "session-set") == 0) {
+        if (argc > 3) {
+            fprintf(stderr, "Error: '%s' takes at most one argument\n", argv[1]);
+            show_usage();
+            return 1;
+        }
+        cmd = argv[1][0] == 't' ? 's' : 'E';
+        if (argc == 3) {
+            text = strdup(argv[2]);
+            text_len = strlen(argv[2]);
+        } else {
+            text = read_stdin(&text_len);
+        }
+        if (!text) {
+            perror("failed to read text");
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "Error: Unknown command '%s'\n", argv[1]);
+        show_usage();
+        return 1;
+    }
+
+    c.fd = connect_daemon();
+    if (c.fd < 0) {
+        int err = errno;
+        fprintf(stderr, "failed to connect to xhispertoold: %s\n", strerror(err));
+
+        switch (err) {
+            case ENOENT:
+            case ECONNREFUSED:
+                fprintf(stderr, "Please check if xhispertoold is running.\n");
+                fprintf(stderr, "Start it with: xhispertoold &\n");
+                break;
+            case EACCES:
+            case EPERM:
+                fprintf(stderr, "Permission denied. Check socket permissions.\n");
+                break;
+        }
+        free(text);
+        return 2;
+    }
+
+    int ret = text ? send_string(&c, cmd, text, text_len)
+                         : client_request(&c, cmd, payload, payload_len);
+    if (ret == 0) ret = client_finish(&c);
+
+    // Recording replies carry text for scripts: "<duration>[ <path>]" on
+    // record-stop, the session state on record-status
+    if (ret == 0 && (cmd == 'Z' || cmd == 'Q')) {
+        printf("%s\n", c.text);
+        if (cmd == 'Q' && strcmp(c.text, "idle") == 0) ret = -1;
+    }
+    if (ret == 0 && cmd == 'I') fputs(c.text, stdout);
+    if (ret == 0 && cmd == 'Y') {
+        printf("%s\n", c.text);
+        if (strchr(c.text, '-')) ret = -1;
+    }
+    if (ret == 0 && (cmd == 'W' || cmd == 'F' || cmd == 'G')) {
+        ret = c.passed_fd >= 0 ? copy_fd(c.passed_fd, STDOUT_FILENO) : -1;
+        if (ret < 0) perror("failed to write recording");
+        if (ret == 0 && cmd == 'G') printf("\n");
+    }
+    if (c.passed_fd >= 0) close(c.passed_fd);
+
+    close(c.fd);
+    free(text);
+
+    switch (ret) {
+        case 0: return 0;
+        case -2: return 3;
+        case -3: return 4;
+        default: return 1;
+    }
+}
+
 int main(int argc, char *argv[]) {
     // Detect mode: daemon or client
     char *prog = basename(argv[0]);
 
     if (strcmp(prog, "xhispertoold") == 0 ||
         (argc > 1 && strcmp(argv[1], "--daemon") == 0)) {
-        return run_daemon();
+        return run_daemon(argc, argv);
     } else {
         return run_client(argc, argv);
     }